@@ -0,0 +1,224 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_ARENA_H_
+#define BASE_ARENA_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "base.h"
+
+// Bump allocator for many small arrays that are freed together. Memory is taken from blocks that
+// are only released by Clear or the destructor, so that freeing all arrays costs one free per
+// block. Blocks double in size up to max_block_bytes, so that small arenas stay small. Not
+// thread-safe: threads allocate from their own arenas, which are then merged.
+class Arena {
+public:
+  explicit Arena(size_t max_block_bytes = 1 << 16)
+      : max_block_bytes_(max_block_bytes), pos_(nullptr), end_(nullptr), allocated_bytes_(0), used_bytes_(0) {}
+
+  Arena(Arena&& o) : Arena(o.max_block_bytes_) {
+    Swap(&o);
+  }
+
+  Arena& operator=(Arena&& o) {
+    Clear();
+    Swap(&o);
+    return *this;
+  }
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  ~Arena() {
+    Clear();
+  }
+
+  // Returns uninitialized memory for n elements of T. Only trivially destructible types can be
+  // allocated, since destructors are never called.
+  template<class T>
+  T* AllocateArray(size_t n) {
+    static_assert(std::is_trivially_destructible<T>::value, "Arena elements are never destroyed");
+    return static_cast<T*>(Allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void* Allocate(size_t bytes, size_t alignment) {
+    if (bytes == 0) return nullptr;
+    char* p = Align(pos_, alignment);
+    if (pos_ == nullptr || p + bytes > end_) {
+      // Large requests get a block of their own, so that the current block is not abandoned.
+      if (bytes + alignment > max_block_bytes_ / 4) {
+        char* block = NewBlock(bytes + alignment);
+        used_bytes_ += bytes;
+        return Align(block, alignment);
+      }
+      const size_t block_bytes = std::max(bytes + alignment,
+          std::min(max_block_bytes_, std::max<size_t>(kMinBlockBytes, allocated_bytes_)));
+      pos_ = NewBlock(block_bytes);
+      end_ = pos_ + block_bytes;
+      p = Align(pos_, alignment);
+    }
+    pos_ = p + bytes;
+    used_bytes_ += bytes;
+    return p;
+  }
+
+  // Takes over the blocks of o, whose arrays stay valid. o is empty afterwards.
+  void Merge(Arena* o) {
+    blocks_.insert(blocks_.end(), o->blocks_.begin(), o->blocks_.end());
+    allocated_bytes_ += o->allocated_bytes_;
+    used_bytes_ += o->used_bytes_;
+    o->blocks_.clear();
+    o->pos_ = o->end_ = nullptr;
+    o->allocated_bytes_ = o->used_bytes_ = 0;
+  }
+
+  // Frees all arrays.
+  void Clear() {
+    for (char* block : blocks_) {
+      free(block);
+    }
+    blocks_.clear();
+    pos_ = end_ = nullptr;
+    allocated_bytes_ = used_bytes_ = 0;
+  }
+
+  // Bytes taken from the system and bytes handed out.
+  size_t MemoryBytes() const { return allocated_bytes_; }
+  size_t UsedBytes() const { return used_bytes_; }
+
+private:
+  enum { kMinBlockBytes = 256 };
+
+  static char* Align(char* p, size_t alignment) {
+    return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + alignment - 1) & ~(alignment - 1));
+  }
+
+  char* NewBlock(size_t bytes) {
+    char* block = static_cast<char*>(malloc(bytes));
+    CHECK(block != nullptr) << "Out of memory allocating " << bytes << " bytes";
+    blocks_.push_back(block);
+    allocated_bytes_ += bytes;
+    return block;
+  }
+
+  void Swap(Arena* o) {
+    std::swap(max_block_bytes_, o->max_block_bytes_);
+    std::swap(blocks_, o->blocks_);
+    std::swap(pos_, o->pos_);
+    std::swap(end_, o->end_);
+    std::swap(allocated_bytes_, o->allocated_bytes_);
+    std::swap(used_bytes_, o->used_bytes_);
+  }
+
+  size_t max_block_bytes_;
+  std::vector<char*> blocks_;
+  // Free space of the current block.
+  char* pos_;
+  char* end_;
+  size_t allocated_bytes_;
+  size_t used_bytes_;
+};
+
+// Array of trivially copyable elements in an Arena. The array does not own its elements: copies
+// share them and they are freed with the arena.
+template<class T>
+class ArenaArray {
+public:
+  typedef T value_type;
+  typedef T* iterator;
+  typedef const T* const_iterator;
+
+  ArenaArray() : data_(nullptr), size_(0), capacity_(0) {}
+
+  // Makes room for at least n elements. Growing copies the elements to a new array; the old one
+  // stays allocated until the arena is cleared.
+  void reserve(size_t n, Arena* arena) {
+    if (n <= capacity_) return;
+    CHECK_LE(n, 0xFFFFFFFFu);
+    T* data = arena->AllocateArray<T>(n);
+    std::copy(data_, data_ + size_, data);
+    data_ = data;
+    capacity_ = static_cast<uint32>(n);
+  }
+
+  // Replaces the elements by n copies of value.
+  void assign(size_t n, const T& value, Arena* arena) {
+    size_ = 0;
+    reserve(n, arena);
+    std::fill(data_, data_ + n, value);
+    size_ = static_cast<uint32>(n);
+  }
+
+  // There must be room for the element (see reserve).
+  void push_back(const T& value) {
+    DCHECK_LT(size_, capacity_);
+    data_[size_++] = value;
+  }
+
+  // Moves the elements to an array of their size in arena, e.g. to compact the old arena.
+  void reallocate(Arena* arena) {
+    const T* old_data = data_;
+    const uint32 size = size_;
+    reset();
+    reserve(size, arena);
+    std::copy(old_data, old_data + size, data_);
+    size_ = size;
+  }
+
+  // Removes the elements and keeps their memory for new ones.
+  void clear() {
+    size_ = 0;
+  }
+
+  // Forgets the elements without freeing them.
+  void reset() {
+    data_ = nullptr;
+    size_ = capacity_ = 0;
+  }
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+  bool empty() const { return size_ == 0; }
+  T* data() { return data_; }
+  const T* data() const { return data_; }
+  T& operator[](size_t i) { return data_[i]; }
+  const T& operator[](size_t i) const { return data_[i]; }
+  iterator begin() { return data_; }
+  iterator end() { return data_ + size_; }
+  const_iterator begin() const { return data_; }
+  const_iterator end() const { return data_ + size_; }
+
+  bool operator==(const ArenaArray& o) const {
+    return size_ == o.size_ && std::equal(begin(), end(), o.begin());
+  }
+  bool operator!=(const ArenaArray& o) const {
+    return !(*this == o);
+  }
+
+private:
+  T* data_;
+  uint32 size_;
+  uint32 capacity_;
+};
+
+#endif /* BASE_ARENA_H_ */
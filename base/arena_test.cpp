@@ -0,0 +1,202 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "base/arena.h"
+
+#include "external/gtest/googletest/include/gtest/gtest.h"
+
+namespace {
+
+struct Allocation {
+  char* data;
+  size_t bytes;
+  char fill;
+
+  bool operator<(const Allocation& o) const { return data < o.data; }
+};
+
+}  // namespace
+
+TEST(ArenaTest, AllocateTest) {
+  Arena arena(1 << 12);
+  EXPECT_EQ(nullptr, arena.AllocateArray<int>(0));
+  std::vector<Allocation> allocations;
+  size_t used_bytes = 0;
+  for (int i = 1; i < 200; ++i) {
+    Allocation c = {arena.AllocateArray<char>(i % 7 + 1), static_cast<size_t>(i % 7 + 1), static_cast<char>(i)};
+    double* d = arena.AllocateArray<double>(i % 5 + 1);
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(d) % alignof(double));
+    Allocation a = {reinterpret_cast<char*>(d), (i % 5 + 1) * sizeof(double), static_cast<char>(-i)};
+    for (const Allocation& allocation : {c, a}) {
+      memset(allocation.data, allocation.fill, allocation.bytes);
+      allocations.push_back(allocation);
+      used_bytes += allocation.bytes;
+    }
+  }
+  EXPECT_EQ(used_bytes, arena.UsedBytes());
+  EXPECT_LE(arena.UsedBytes(), arena.MemoryBytes());
+  // Blocks are at most 4 KB, so little is wasted on alignment and the ends of blocks.
+  EXPECT_LE(arena.MemoryBytes(), 2 * used_bytes);
+
+  // The arrays do not overlap, so they keep their contents.
+  std::sort(allocations.begin(), allocations.end());
+  for (size_t i = 0; i < allocations.size(); ++i) {
+    if (i > 0) {
+      EXPECT_LE(allocations[i - 1].data + allocations[i - 1].bytes, allocations[i].data);
+    }
+    for (size_t j = 0; j < allocations[i].bytes; ++j) {
+      EXPECT_EQ(allocations[i].fill, allocations[i].data[j]);
+    }
+  }
+
+  arena.Clear();
+  EXPECT_EQ(0, arena.UsedBytes());
+  EXPECT_EQ(0, arena.MemoryBytes());
+}
+
+TEST(ArenaTest, LargeAllocationTest) {
+  Arena arena(1 << 12);
+  int* small = arena.AllocateArray<int>(10);
+  const size_t memory_bytes = arena.MemoryBytes();
+  // A large array gets a block of its own, and later small arrays still come from the current block.
+  int* large = arena.AllocateArray<int>(10000);
+  EXPECT_LE(memory_bytes + 10000 * sizeof(int), arena.MemoryBytes());
+  const size_t with_large_bytes = arena.MemoryBytes();
+  int* next_small = arena.AllocateArray<int>(10);
+  EXPECT_EQ(with_large_bytes, arena.MemoryBytes());
+  EXPECT_EQ(small + 10, next_small);
+  large[9999] = 1;
+}
+
+TEST(ArenaTest, MergeTest) {
+  Arena arena, other;
+  int* a = arena.AllocateArray<int>(100);
+  int* b = other.AllocateArray<int>(100);
+  for (int i = 0; i < 100; ++i) {
+    a[i] = i;
+    b[i] = -i;
+  }
+  const size_t used_bytes = arena.UsedBytes() + other.UsedBytes();
+  const size_t memory_bytes = arena.MemoryBytes() + other.MemoryBytes();
+  arena.Merge(&other);
+  EXPECT_EQ(used_bytes, arena.UsedBytes());
+  EXPECT_EQ(memory_bytes, arena.MemoryBytes());
+  EXPECT_EQ(0, other.MemoryBytes());
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(i, a[i]);
+    EXPECT_EQ(-i, b[i]);
+  }
+
+  Arena moved(std::move(arena));
+  EXPECT_EQ(memory_bytes, moved.MemoryBytes());
+  EXPECT_EQ(0, arena.MemoryBytes());
+  EXPECT_EQ(99, a[99]);
+}
+
+TEST(ArenaTest, ArenaArrayTest) {
+  Arena arena;
+  ArenaArray<int> array;
+  EXPECT_TRUE(array.empty());
+  EXPECT_EQ(0, array.capacity());
+  array.reserve(4, &arena);
+  EXPECT_EQ(4, array.capacity());
+  for (int i = 0; i < 4; ++i) {
+    array.push_back(i);
+  }
+  // Growing copies the elements.
+  array.reserve(10, &arena);
+  EXPECT_EQ(10, array.capacity());
+  array.push_back(4);
+  ASSERT_EQ(5, array.size());
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(i, array[i]);
+  }
+
+  // Copies share the elements.
+  ArenaArray<int> copy = array;
+  EXPECT_TRUE(copy == array);
+  copy[0] = 100;
+  EXPECT_EQ(100, array[0]);
+
+  array.assign(3, 7, &arena);
+  EXPECT_EQ(3, array.size());
+  EXPECT_EQ(10, array.capacity());
+  for (int v : array) {
+    EXPECT_EQ(7, v);
+  }
+  EXPECT_TRUE(copy != array);
+}
+
+TEST(ArenaTest, ArenaArrayClearTest) {
+  // clear keeps the memory of the elements, so refilling the array allocates nothing.
+  Arena arena;
+  ArenaArray<int> array;
+  array.reserve(8, &arena);
+  for (int i = 0; i < 8; ++i) {
+    array.push_back(i);
+  }
+  const int* data = array.data();
+  const size_t used_bytes = arena.UsedBytes();
+  array.clear();
+  EXPECT_TRUE(array.empty());
+  EXPECT_EQ(8, array.capacity());
+  array.reserve(8, &arena);
+  for (int i = 0; i < 8; ++i) {
+    array.push_back(-i);
+  }
+  EXPECT_EQ(data, array.data());
+  EXPECT_EQ(used_bytes, arena.UsedBytes());
+  EXPECT_EQ(-7, array[7]);
+
+  // reset forgets the elements and their memory.
+  array.reset();
+  EXPECT_TRUE(array.empty());
+  EXPECT_EQ(0, array.capacity());
+  EXPECT_EQ(nullptr, array.data());
+}
+
+TEST(ArenaTest, ArenaArrayReallocateTest) {
+  Arena arena;
+  ArenaArray<int> array;
+  array.reserve(100, &arena);
+  for (int i = 0; i < 10; ++i) {
+    array.push_back(i);
+  }
+  // Moves the elements to an array of their size in another arena, which outlives the old one.
+  Arena compacted;
+  array.reallocate(&compacted);
+  arena.Clear();
+  EXPECT_EQ(10, array.capacity());
+  EXPECT_EQ(10 * sizeof(int), compacted.UsedBytes());
+  ASSERT_EQ(10, array.size());
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(i, array[i]);
+  }
+}
+
+int main(int argc, char **argv) {
+  google::InstallFailureSignalHandler();
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
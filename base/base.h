@@ -19,6 +19,10 @@
 
 #include <stddef.h>
 
+typedef signed char int8;
+typedef unsigned char uint8;
+typedef unsigned short uint16;
+typedef unsigned int uint32;
 typedef long long int64;
 typedef unsigned long long uint64;
 
@@ -28,6 +32,18 @@ inline unsigned FingerprintCat(unsigned a, unsigned b) {
   return a * 6037 + ((b * 17) ^ (b >> 16));
 }
 
+// 64-bit variant of FingerprintCat for keys that must not collide on very large inputs. The
+// result is passed through the MurmurHash3 finalizer, so all bits depend on both inputs.
+inline uint64 FingerprintCat64(uint64 a, uint64 b) {
+  uint64 h = a * 0x9E3779B97F4A7C15ULL + b;
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
 inline size_t FingerprintMem(const void* memory, unsigned size) {
   size /= sizeof(uint64);
   const uint64* mem = static_cast<const uint64*>(memory);
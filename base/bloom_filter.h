@@ -0,0 +1,138 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_BLOOM_FILTER_H_
+#define BASE_BLOOM_FILTER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "base.h"
+#include "fileutil.h"
+
+// Blocked Bloom filter over 64-bit keys. A key sets one bit in each of the 8 words of one 32-byte
+// block, so that a lookup reads a single cache line. With 10 bits per key, about 1% of the keys
+// that were not added are reported as maybe contained.
+class BlockedBloomFilter {
+public:
+  BlockedBloomFilter() : num_blocks_(0), offset_(0) {}
+
+  // Drops all keys and sizes the filter for num_keys keys.
+  void Init(size_t num_keys, int bits_per_key) {
+    CHECK_GT(bits_per_key, 0);
+    num_blocks_ = std::max<size_t>(1, (num_keys * bits_per_key + kBlockBits - 1) / kBlockBits);
+    Allocate();
+  }
+
+  bool empty() const {
+    return num_blocks_ == 0;
+  }
+
+  // Frees the filter.
+  void clear() {
+    std::vector<uint32>().swap(words_);
+    num_blocks_ = 0;
+    offset_ = 0;
+  }
+
+  void Add(uint64 key) {
+    DCHECK(!empty());
+    const uint64 h = FingerprintCat64(key, 0);
+    uint32* block = Block(h);
+    for (int i = 0; i < kWordsPerBlock; ++i) {
+      block[i] |= BitInWord(h, i);
+    }
+  }
+
+  // False if the key was definitely not added.
+  bool MayContain(uint64 key) const {
+    const uint64 h = FingerprintCat64(key, 0);
+    const uint32* block = Block(h);
+    uint32 missing = 0;
+    for (int i = 0; i < kWordsPerBlock; ++i) {
+      missing |= ~block[i] & BitInWord(h, i);
+    }
+    return missing == 0;
+  }
+
+  size_t MemoryBytes() const {
+    return words_.capacity() * sizeof(uint32);
+  }
+
+  void WriteToFileOrDie(FILE* f) const {
+    uint64 num_blocks = num_blocks_;
+    CHECK_EQ(1, fwrite(&num_blocks, sizeof(uint64), 1, f));
+    if (num_blocks_ > 0) {
+      CHECK_EQ(num_blocks_ * kWordsPerBlock, fwrite(Block(0), sizeof(uint32), num_blocks_ * kWordsPerBlock, f));
+    }
+  }
+
+  void ReadFromFileOrDie(FILE* f) {
+    uint64 num_blocks = 0;
+    CHECK_EQ(1, fread(&num_blocks, sizeof(uint64), 1, f));
+    num_blocks_ = num_blocks;
+    if (num_blocks_ == 0) {
+      clear();
+      return;
+    }
+    Allocate();
+    CHECK_EQ(num_blocks_ * kWordsPerBlock, fread(&words_[offset_], sizeof(uint32), num_blocks_ * kWordsPerBlock, f));
+  }
+
+private:
+  static const int kWordsPerBlock = 8;
+  static const size_t kBlockBits = kWordsPerBlock * 32;
+  static const size_t kBlockBytes = kWordsPerBlock * sizeof(uint32);
+
+  // Allocates num_blocks_ empty blocks aligned to their size.
+  void Allocate() {
+    words_.assign(num_blocks_ * kWordsPerBlock + kWordsPerBlock, 0);
+    words_.shrink_to_fit();
+    const uintptr_t address = reinterpret_cast<uintptr_t>(words_.data());
+    offset_ = ((kBlockBytes - address % kBlockBytes) % kBlockBytes) / sizeof(uint32);
+  }
+
+  size_t BlockIndex(uint64 h) const {
+    return ((h >> 32) * num_blocks_) >> 32;
+  }
+
+  uint32* Block(uint64 h) {
+    return &words_[offset_ + BlockIndex(h) * kWordsPerBlock];
+  }
+
+  const uint32* Block(uint64 h) const {
+    return &words_[offset_ + BlockIndex(h) * kWordsPerBlock];
+  }
+
+  // One bit per word, chosen by the low half of the hash times an odd salt per word.
+  static uint32 BitInWord(uint64 h, int word) {
+    static const uint32 kSalts[kWordsPerBlock] = {
+        0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+        0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+    return 1U << ((static_cast<uint32>(h) * kSalts[word]) >> 27);
+  }
+
+  size_t num_blocks_;
+  // num_blocks_ blocks starting at words_[offset_].
+  std::vector<uint32> words_;
+  size_t offset_;
+};
+
+#endif /* BASE_BLOOM_FILTER_H_ */
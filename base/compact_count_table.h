@@ -0,0 +1,120 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_COMPACT_COUNT_TABLE_H_
+#define BASE_COMPACT_COUNT_TABLE_H_
+
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "base.h"
+#include "huge_pages.h"
+
+// Frozen hash table from 64-bit keys to positive counts. Counts are stored as CountT (uint8 or
+// uint16) and the few counts that do not fit are kept in an overflow side table. The table is
+// filled once after Reserve and uses linear probing; a slot with count 0 is empty.
+template<class CountT>
+class CompactCountTable {
+public:
+  CompactCountTable() : size_(0) {}
+
+  // Drops all keys and makes room for num_keys keys at a load factor of about 0.8.
+  void Reserve(size_t num_keys) {
+    size_ = 0;
+    overflow_.clear();
+    size_t capacity = num_keys + num_keys / 4 + 1;
+    keys_.assign(capacity, 0);
+    keys_.shrink_to_fit();
+    counts_.assign(capacity, 0);
+    counts_.shrink_to_fit();
+  }
+
+  // Adds a key that is not in the table yet. Keys with a non-positive count are not stored.
+  void Add(uint64 key, int count) {
+    if (count <= 0) return;
+    CHECK_LT(size_, keys_.size()) << "Reserve was not called with the number of keys";
+    size_t pos = Slot(key);
+    while (counts_[pos] != 0) {
+      DCHECK(keys_[pos] != key);
+      pos = NextSlot(pos);
+    }
+    keys_[pos] = key;
+    if (count >= kOverflowCount) {
+      counts_[pos] = kOverflowCount;
+      overflow_[key] = count;
+    } else {
+      counts_[pos] = static_cast<CountT>(count);
+    }
+    size_++;
+  }
+
+  // Returns the count of the key or 0 if the key is not in the table.
+  int Get(uint64 key) const {
+    if (keys_.empty()) return 0;
+    for (size_t pos = Slot(key); counts_[pos] != 0; pos = NextSlot(pos)) {
+      if (keys_[pos] == key) {
+        if (counts_[pos] == kOverflowCount) {
+          return overflow_.find(key)->second;
+        }
+        return counts_[pos];
+      }
+    }
+    return 0;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  // Number of slots, of which size() are used.
+  size_t capacity() const {
+    return keys_.size();
+  }
+
+  size_t NumOverflowed() const {
+    return overflow_.size();
+  }
+
+  // Approximate heap memory used by the table.
+  size_t MemoryBytes() const {
+    return keys_.capacity() * sizeof(uint64) + counts_.capacity() * sizeof(CountT) +
+        overflow_.size() * (sizeof(std::pair<const uint64, int>) + 2 * sizeof(void*)) +
+        overflow_.bucket_count() * sizeof(void*);
+  }
+
+private:
+  static constexpr int kOverflowCount = std::numeric_limits<CountT>::max();
+
+  size_t Slot(uint64 key) const {
+    // Maps the mixed key to [0, capacity) without a modulo.
+    uint64 h = FingerprintCat64(key, 0);
+    return static_cast<size_t>((static_cast<unsigned __int128>(h) * keys_.size()) >> 64);
+  }
+
+  size_t NextSlot(size_t pos) const {
+    return (pos + 1 == keys_.size()) ? 0 : pos + 1;
+  }
+
+  std::vector<uint64, HugePageAllocator<uint64> > keys_;
+  std::vector<CountT, HugePageAllocator<CountT> > counts_;
+  std::unordered_map<uint64, int> overflow_;
+  size_t size_;
+};
+
+#endif /* BASE_COMPACT_COUNT_TABLE_H_ */
@@ -0,0 +1,101 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_COUNT_MIN_SKETCH_H_
+#define BASE_COUNT_MIN_SKETCH_H_
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "base.h"
+
+// Count-min sketch with conservative update over 64-bit keys. Estimates never undercount. With
+// width w, an estimate exceeds the true count by more than e*N/w (N being the total count added)
+// with probability at most e^-depth; conservative update makes the error much smaller in practice.
+class CountMinSketch {
+public:
+  CountMinSketch() : width_(0), depth_(0) {}
+
+  // Drops all counts and allocates depth rows of counters taking about num_bytes in total.
+  void Init(size_t num_bytes, int depth = 4) {
+    CHECK(depth > 0 && depth <= kMaxDepth) << "Unsupported depth " << depth;
+    depth_ = depth;
+    width_ = std::max<size_t>(1, num_bytes / (depth * sizeof(uint32)));
+    counters_.assign(width_ * depth_, 0);
+    counters_.shrink_to_fit();
+  }
+
+  bool empty() const {
+    return counters_.empty();
+  }
+
+  // Frees the counters.
+  void clear() {
+    std::vector<uint32>().swap(counters_);
+    width_ = 0;
+    depth_ = 0;
+  }
+
+  // Adds count to the key and returns its new estimate. Only the counters below the new estimate
+  // are raised (conservative update).
+  uint32 Add(uint64 key, uint32 count) {
+    DCHECK(!empty());
+    size_t slots[kMaxDepth];
+    uint32 estimate = std::numeric_limits<uint32>::max();
+    for (int row = 0; row < depth_; ++row) {
+      slots[row] = Slot(key, row);
+      estimate = std::min(estimate, counters_[slots[row]]);
+    }
+    // Saturates instead of wrapping around.
+    estimate = (estimate > std::numeric_limits<uint32>::max() - count) ?
+        std::numeric_limits<uint32>::max() : estimate + count;
+    for (int row = 0; row < depth_; ++row) {
+      counters_[slots[row]] = std::max(counters_[slots[row]], estimate);
+    }
+    return estimate;
+  }
+
+  uint32 Estimate(uint64 key) const {
+    if (empty()) return 0;
+    uint32 estimate = std::numeric_limits<uint32>::max();
+    for (int row = 0; row < depth_; ++row) {
+      estimate = std::min(estimate, counters_[Slot(key, row)]);
+    }
+    return estimate;
+  }
+
+  size_t MemoryBytes() const {
+    return counters_.capacity() * sizeof(uint32);
+  }
+
+private:
+  static const int kMaxDepth = 8;
+
+  size_t Slot(uint64 key, int row) const {
+    // Maps an independent hash per row to [0, width) without a modulo.
+    uint64 h = FingerprintCat64(key, row + 1);
+    return row * width_ + static_cast<size_t>((static_cast<unsigned __int128>(h) * width_) >> 64);
+  }
+
+  size_t width_;
+  int depth_;
+  std::vector<uint32> counters_;
+};
+
+#endif /* BASE_COUNT_MIN_SKETCH_H_ */
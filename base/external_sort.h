@@ -0,0 +1,186 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_EXTERNAL_SORT_H_
+#define BASE_EXTERNAL_SORT_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <queue>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+
+// Sorts more records than fit in memory. Records are buffered up to a fixed number of bytes; a
+// full buffer is sorted, its equal records are combined and it is written to a temporary run file.
+// Merge then streams all records in order with a k-way merge of the runs.
+//
+// Less is a strict weak order on T and Combine(T* into, const T& from) merges two equal records.
+// T must be trivially copyable since runs are written as raw bytes.
+template<class T, class Less, class Combine>
+class ExternalSorter {
+public:
+  // Run files are created in dir and deleted when the sorter is destroyed.
+  ExternalSorter(const std::string& dir, size_t buffer_bytes)
+      : dir_(dir), max_buffered_(std::max<size_t>(1, buffer_bytes / sizeof(T))), num_spilled_(0) {
+    static_assert(std::is_trivially_copyable<T>::value, "Records are written as raw bytes");
+    buffer_.reserve(max_buffered_);
+  }
+
+  ~ExternalSorter() {
+    for (FILE* run : runs_) {
+      fclose(run);
+    }
+  }
+
+  void Add(const T& record) {
+    if (buffer_.size() == max_buffered_) {
+      Spill();
+    }
+    buffer_.push_back(record);
+  }
+
+  // Adds a run that was sorted and combined elsewhere, e.g. written by another process: the records
+  // from the current position of run to its end. The sorter closes the file when it is destroyed.
+  void AddRun(FILE* run) {
+    runs_.push_back(run);
+    run_starts_.push_back(ftell(run));
+  }
+
+  // Number of runs written to disk so far.
+  size_t NumRuns() const {
+    return runs_.size();
+  }
+
+  // Number of records written to the runs (after combining).
+  size_t NumSpilled() const {
+    return num_spilled_;
+  }
+
+  // Calls cb(const T&) for all records in sorted order, each group of equal records combined into
+  // one. Uses about the same memory as the buffer. Can only be called once.
+  template<class CB>
+  void Merge(const CB& cb) {
+    SortAndCombine();
+    if (runs_.empty()) {
+      for (const T& record : buffer_) {
+        cb(record);
+      }
+      std::vector<T>().swap(buffer_);
+      return;
+    }
+    if (!buffer_.empty()) {
+      Spill();
+    }
+    std::vector<T>().swap(buffer_);
+
+    // Each run is read in chunks so that all chunks together fit in the buffer size.
+    const size_t chunk_size = std::max<size_t>(1, max_buffered_ / runs_.size());
+    std::vector<RunReader> readers(runs_.size());
+    typedef std::pair<T, size_t> HeapItem;
+    const auto greater = [](const HeapItem& a, const HeapItem& b) { return Less()(b.first, a.first); };
+    std::priority_queue<HeapItem, std::vector<HeapItem>, decltype(greater)> heap(greater);
+    for (size_t i = 0; i < runs_.size(); ++i) {
+      CHECK_EQ(0, fseek(runs_[i], run_starts_[i], SEEK_SET));
+      readers[i].run = runs_[i];
+      readers[i].chunk.resize(chunk_size);
+      T record;
+      if (readers[i].Next(&record)) heap.push(HeapItem(record, i));
+    }
+
+    bool has_current = false;
+    T current;
+    while (!heap.empty()) {
+      HeapItem top = heap.top();
+      heap.pop();
+      T record;
+      if (readers[top.second].Next(&record)) heap.push(HeapItem(record, top.second));
+      if (has_current && !Less()(current, top.first)) {
+        Combine()(&current, top.first);
+      } else {
+        if (has_current) cb(current);
+        current = top.first;
+        has_current = true;
+      }
+    }
+    if (has_current) cb(current);
+  }
+
+private:
+  struct RunReader {
+    RunReader() : run(nullptr), pos(0), size(0) {}
+
+    bool Next(T* record) {
+      if (pos == size) {
+        size = fread(chunk.data(), sizeof(T), chunk.size(), run);
+        pos = 0;
+        if (size == 0) return false;
+      }
+      *record = chunk[pos++];
+      return true;
+    }
+
+    FILE* run;
+    std::vector<T> chunk;
+    size_t pos;
+    size_t size;
+  };
+
+  void SortAndCombine() {
+    std::sort(buffer_.begin(), buffer_.end(), Less());
+    size_t out = 0;
+    for (size_t i = 0; i < buffer_.size(); ++i) {
+      if (out > 0 && !Less()(buffer_[out - 1], buffer_[i])) {
+        Combine()(&buffer_[out - 1], buffer_[i]);
+      } else {
+        buffer_[out++] = buffer_[i];
+      }
+    }
+    buffer_.resize(out);
+  }
+
+  void Spill() {
+    SortAndCombine();
+    std::string path = dir_ + "/phog_run_XXXXXX";
+    int fd = mkstemp(&path[0]);
+    CHECK_GE(fd, 0) << "Could not create a run file in " << dir_;
+    // The file is deleted as soon as it is closed.
+    unlink(path.c_str());
+    FILE* run = fdopen(fd, "w+b");
+    CHECK(run != nullptr);
+    CHECK_EQ(buffer_.size(), fwrite(buffer_.data(), sizeof(T), buffer_.size(), run)) << "Could not write " << path;
+    CHECK_EQ(0, fflush(run));
+    runs_.push_back(run);
+    run_starts_.push_back(0);
+    num_spilled_ += buffer_.size();
+    buffer_.clear();
+  }
+
+  const std::string dir_;
+  const size_t max_buffered_;
+  std::vector<T> buffer_;
+  std::vector<FILE*> runs_;
+  // Offset of the first record in each run.
+  std::vector<long> run_starts_;
+  size_t num_spilled_;
+};
+
+#endif /* BASE_EXTERNAL_SORT_H_ */
@@ -0,0 +1,145 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "base/external_sort.h"
+
+#include "external/gtest/googletest/include/gtest/gtest.h"
+
+namespace {
+
+struct Record {
+  int key;
+  int count;
+};
+
+struct RecordLess {
+  bool operator()(const Record& a, const Record& b) const { return a.key < b.key; }
+};
+
+struct RecordCombine {
+  void operator()(Record* into, const Record& from) const { into->count += from.count; }
+};
+
+typedef ExternalSorter<Record, RecordLess, RecordCombine> RecordSorter;
+
+std::string TempDir() {
+  const char* dir = getenv("TEST_TMPDIR");
+  return dir != nullptr ? dir : "/tmp";
+}
+
+std::vector<Record> MergeAll(RecordSorter* sorter) {
+  std::vector<Record> result;
+  sorter->Merge([&result](const Record& r) { result.push_back(r); });
+  return result;
+}
+
+// Adds random records with keys below max_key and returns the expected counts per key.
+std::map<int, int> AddRandomRecords(int num_records, int max_key, RecordSorter* sorter) {
+  std::mt19937 rand(1);
+  std::map<int, int> expected;
+  for (int i = 0; i < num_records; ++i) {
+    Record r;
+    r.key = rand() % max_key;
+    r.count = 1 + rand() % 3;
+    expected[r.key] += r.count;
+    sorter->Add(r);
+  }
+  return expected;
+}
+
+void ExpectMerged(const std::map<int, int>& expected, const std::vector<Record>& merged) {
+  ASSERT_EQ(expected.size(), merged.size());
+  size_t i = 0;
+  for (const auto& entry : expected) {
+    EXPECT_EQ(entry.first, merged[i].key) << i;
+    EXPECT_EQ(entry.second, merged[i].count) << entry.first;
+    ++i;
+  }
+}
+
+}  // namespace
+
+TEST(ExternalSortTest, InMemoryTest) {
+  RecordSorter sorter(TempDir(), 1 << 20);
+  const std::map<int, int> expected = AddRandomRecords(1000, 100, &sorter);
+  EXPECT_EQ(0, sorter.NumRuns());
+  ExpectMerged(expected, MergeAll(&sorter));
+}
+
+TEST(ExternalSortTest, MultiRunTest) {
+  // Buffers 64 records, so each run combines at most 64 records and the merge reads the runs in
+  // chunks of a few records.
+  RecordSorter sorter(TempDir(), 64 * sizeof(Record));
+  const std::map<int, int> expected = AddRandomRecords(10000, 500, &sorter);
+  EXPECT_LE(100, sorter.NumRuns());
+  EXPECT_LE(sorter.NumSpilled(), 10000);
+  ExpectMerged(expected, MergeAll(&sorter));
+}
+
+TEST(ExternalSortTest, CombineWithinRunTest) {
+  // Equal records are combined before they are written, so runs of few keys stay small.
+  RecordSorter sorter(TempDir(), 64 * sizeof(Record));
+  const std::map<int, int> expected = AddRandomRecords(6400, 4, &sorter);
+  EXPECT_EQ(99, sorter.NumRuns());
+  EXPECT_GE(99 * 4, sorter.NumSpilled());
+  ExpectMerged(expected, MergeAll(&sorter));
+}
+
+TEST(ExternalSortTest, AddRunTest) {
+  // A run written elsewhere after a header, from which it is read.
+  FILE* run = tmpfile();
+  ASSERT_TRUE(run != nullptr);
+  const int header = 12345;
+  ASSERT_EQ(1, fwrite(&header, sizeof(header), 1, run));
+  const long run_start = ftell(run);
+  std::map<int, int> expected;
+  for (int key = 0; key < 100; key += 3) {
+    Record r;
+    r.key = key;
+    r.count = 10;
+    ASSERT_EQ(1, fwrite(&r, sizeof(r), 1, run));
+    expected[key] += r.count;
+  }
+  ASSERT_EQ(0, fseek(run, run_start, SEEK_SET));
+
+  RecordSorter sorter(TempDir(), 16 * sizeof(Record));
+  sorter.AddRun(run);
+  std::mt19937 rand(2);
+  for (int i = 0; i < 200; ++i) {
+    Record r;
+    r.key = rand() % 100;
+    r.count = 1;
+    expected[r.key] += r.count;
+    sorter.Add(r);
+  }
+  EXPECT_LE(2, sorter.NumRuns());
+  ExpectMerged(expected, MergeAll(&sorter));
+}
+
+int main(int argc, char **argv) {
+  google::InstallFailureSignalHandler();
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include <string>
+#include <vector>
 
 #include "glog/logging.h"
 
@@ -26,4 +27,24 @@ void ReadFileToStringOrDie(const char* filename, std::string* r);
 void WriteStringToFileOrDie(const char* filename, const std::string& s);
 bool FileExists(const char* filename);
 
+// Writes/reads a vector of trivially copyable values as its size followed by the raw elements.
+template<class T, class A>
+void WriteVectorToFileOrDie(const std::vector<T, A>& v, FILE* f) {
+  unsigned long long size = v.size();
+  CHECK_EQ(1, fwrite(&size, sizeof(size), 1, f));
+  if (size > 0) {
+    CHECK_EQ(size, fwrite(v.data(), sizeof(T), size, f));
+  }
+}
+
+template<class T, class A>
+void ReadVectorFromFileOrDie(std::vector<T, A>* v, FILE* f) {
+  unsigned long long size = 0;
+  CHECK_EQ(1, fread(&size, sizeof(size), 1, f));
+  v->resize(size);
+  if (size > 0) {
+    CHECK_EQ(size, fread(v->data(), sizeof(T), size, f));
+  }
+}
+
 #endif /* BASE_FILEUTIL_H_ */
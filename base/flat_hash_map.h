@@ -0,0 +1,394 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_FLAT_HASH_MAP_H_
+#define BASE_FLAT_HASH_MAP_H_
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "glog/logging.h"
+
+#include "base.h"
+#include "huge_pages.h"
+
+// Open-addressing hash map with a control byte per slot ("Swiss table" layout). The control byte
+// of a full slot holds 7 bits of the hash of its key, so a probe compares a group of 16 control
+// bytes at once (one SSE2 compare) and only looks at the keys whose bits match. A lookup of a
+// missing key usually ends at the first group, since it has an empty slot.
+//
+// The interface is the subset of google::dense_hash_map used in this code base, so it can replace
+// it: no empty or deleted keys are needed (set_empty_key and set_deleted_key are accepted and
+// ignored), and erasing during iteration is allowed. Inserting invalidates iterators.
+template<class K, class V, class H = std::hash<K> >
+class FlatHashMap {
+public:
+  typedef K key_type;
+  typedef V mapped_type;
+  typedef std::pair<const K, V> value_type;
+
+  template<class Map, class Value>
+  class Iterator {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef typename std::remove_const<Value>::type value_type;
+    typedef ptrdiff_t difference_type;
+    typedef Value* pointer;
+    typedef Value& reference;
+
+    Iterator() : map_(nullptr), pos_(0) {}
+    Iterator(Map* map, size_t pos) : map_(map), pos_(pos) { SkipEmpty(); }
+    // Conversion from iterator to const_iterator.
+    template<class OtherMap, class OtherValue>
+    Iterator(const Iterator<OtherMap, OtherValue>& o) : map_(o.map_), pos_(o.pos_) {}
+
+    Value& operator*() const { return *map_->slot(pos_); }
+    Value* operator->() const { return map_->slot(pos_); }
+    Iterator& operator++() {
+      ++pos_;
+      SkipEmpty();
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator result = *this;
+      ++*this;
+      return result;
+    }
+    bool operator==(const Iterator& o) const { return pos_ == o.pos_; }
+    bool operator!=(const Iterator& o) const { return pos_ != o.pos_; }
+
+  private:
+    template<class, class> friend class Iterator;
+    friend class FlatHashMap;
+
+    void SkipEmpty() {
+      while (pos_ < map_->capacity_ && !IsFull(map_->ctrl_[pos_])) ++pos_;
+    }
+
+    Map* map_;
+    size_t pos_;
+  };
+  typedef Iterator<FlatHashMap, value_type> iterator;
+  typedef Iterator<const FlatHashMap, const value_type> const_iterator;
+
+  FlatHashMap() : ctrl_(EmptyGroup()), slots_(nullptr), capacity_(0), size_(0), growth_left_(0) {}
+
+  FlatHashMap(const FlatHashMap& o) : FlatHashMap() {
+    resize(o.size());
+    for (const value_type& v : o) {
+      insert(v);
+    }
+  }
+
+  FlatHashMap(FlatHashMap&& o) : FlatHashMap() {
+    swap(o);
+  }
+
+  FlatHashMap& operator=(FlatHashMap o) {
+    swap(o);
+    return *this;
+  }
+
+  ~FlatHashMap() {
+    Destroy();
+  }
+
+  void swap(FlatHashMap& o) {
+    std::swap(ctrl_, o.ctrl_);
+    std::swap(slots_, o.slots_);
+    std::swap(capacity_, o.capacity_);
+    std::swap(size_, o.size_);
+    std::swap(growth_left_, o.growth_left_);
+  }
+
+  // For compatibility with google::dense_hash_map.
+  void set_empty_key(const K&) {}
+  void set_deleted_key(const K&) {}
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, capacity_); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, capacity_); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t bucket_count() const { return capacity_; }
+
+  // Removes all elements and frees the memory.
+  void clear() {
+    Destroy();
+    ctrl_ = EmptyGroup();
+    slots_ = nullptr;
+    capacity_ = 0;
+    size_ = 0;
+    growth_left_ = 0;
+  }
+
+  // Makes room for n elements without growing. Like in google::dense_hash_map, a smaller n shrinks
+  // the table to fit the current elements.
+  void resize(size_t n) {
+    Rehash(CapacityFor(std::max(n, size_)));
+  }
+
+  void reserve(size_t n) {
+    if (n > size_ + growth_left_) resize(n);
+  }
+
+  iterator find(const K& key) {
+    return iterator(this, FindPos(key));
+  }
+
+  const_iterator find(const K& key) const {
+    return const_iterator(this, FindPos(key));
+  }
+
+  size_t count(const K& key) const {
+    return FindPos(key) != capacity_ ? 1 : 0;
+  }
+
+  V& operator[](const K& key) {
+    return Insert(key).first->second;
+  }
+
+  std::pair<iterator, bool> insert(const value_type& v) {
+    std::pair<iterator, bool> result = Insert(v.first);
+    if (result.second) result.first->second = v.second;
+    return result;
+  }
+
+  std::pair<iterator, bool> insert(value_type&& v) {
+    std::pair<iterator, bool> result = Insert(v.first);
+    if (result.second) result.first->second = std::move(v.second);
+    return result;
+  }
+
+  template<class InputIterator>
+  void insert(InputIterator first, InputIterator last) {
+    for (; first != last; ++first) {
+      insert(value_type(first->first, first->second));
+    }
+  }
+
+  // The iterator stays valid and can be incremented.
+  void erase(iterator it) {
+    DCHECK(IsFull(ctrl_[it.pos_]));
+    slot(it.pos_)->~value_type();
+    SetCtrl(it.pos_, kDeleted);
+    --size_;
+  }
+
+  size_t erase(const K& key) {
+    const size_t pos = FindPos(key);
+    if (pos == capacity_) return 0;
+    erase(iterator(this, pos));
+    return 1;
+  }
+
+private:
+  static const int kGroupWidth = 16;
+  static const int8 kEmpty = -128;
+  static const int8 kDeleted = -2;
+
+  // Control bytes: kEmpty, kDeleted or 7 bits of the hash for a full slot. The first group is
+  // repeated after the last slot so that a group can be loaded at any position.
+  static bool IsFull(int8 c) { return c >= 0; }
+
+  // A group of empty control bytes for the empty map, so that lookups need no special case.
+  static int8* EmptyGroup() {
+    alignas(16) static int8 empty_group[kGroupWidth] = {
+        kEmpty, kEmpty, kEmpty, kEmpty, kEmpty, kEmpty, kEmpty, kEmpty,
+        kEmpty, kEmpty, kEmpty, kEmpty, kEmpty, kEmpty, kEmpty, kEmpty};
+    return empty_group;
+  }
+
+  // Bit i is set if byte i of the group at ctrl equals c.
+  static uint32 MatchByte(const int8* ctrl, int8 c) {
+#ifdef __SSE2__
+    const __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+    uint32 mask = 0;
+    for (int i = 0; i < kGroupWidth; ++i) {
+      if (ctrl[i] == c) mask |= 1u << i;
+    }
+    return mask;
+#endif
+  }
+
+  // Bit i is set if byte i of the group at ctrl is kEmpty.
+  static uint32 MatchEmpty(const int8* ctrl) {
+    return MatchByte(ctrl, kEmpty);
+  }
+
+  // Bit i is set if byte i of the group at ctrl is kEmpty or kDeleted.
+  static uint32 MatchEmptyOrDeleted(const int8* ctrl) {
+#ifdef __SSE2__
+    // Both have the sign bit set, full slots do not.
+    const __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+    return _mm_movemask_epi8(group);
+#else
+    uint32 mask = 0;
+    for (int i = 0; i < kGroupWidth; ++i) {
+      if (!IsFull(ctrl[i])) mask |= 1u << i;
+    }
+    return mask;
+#endif
+  }
+
+  static uint64 Hash(const K& key) {
+    // std::hash is the identity for integers, so the hash is mixed before it is split.
+    uint64 h = static_cast<uint64>(H()(key)) * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 32);
+  }
+
+  static int8 H2(uint64 hash) { return hash & 0x7F; }
+
+  value_type* slot(size_t pos) { return slots_ + pos; }
+  const value_type* slot(size_t pos) const { return slots_ + pos; }
+
+  void SetCtrl(size_t pos, int8 c) {
+    ctrl_[pos] = c;
+    if (pos < kGroupWidth) ctrl_[capacity_ + pos] = c;
+  }
+
+  // Smallest power-of-two capacity that holds n elements at a load factor of at most 7/8.
+  static size_t CapacityFor(size_t n) {
+    if (n == 0) return 0;
+    size_t capacity = kGroupWidth;
+    while (capacity - capacity / 8 < n) capacity *= 2;
+    return capacity;
+  }
+
+  // Probes the groups starting at the position of the hash (quadratically, by whole groups) and
+  // calls probe(pos, group_ctrl) for each group until it returns true.
+  template<class Probe>
+  void ProbeGroups(uint64 hash, const Probe& probe) const {
+    const size_t mask = capacity_ - 1;
+    size_t pos = (hash >> 7) & mask;
+    for (size_t step = kGroupWidth; ; step += kGroupWidth) {
+      if (probe(pos)) return;
+      pos = (pos + step) & mask;
+    }
+  }
+
+  size_t FindPos(const K& key) const {
+    if (capacity_ == 0) return 0;
+    const uint64 hash = Hash(key);
+    const int8 h2 = H2(hash);
+    size_t result = capacity_;
+    ProbeGroups(hash, [this, &key, h2, &result](size_t pos) {
+      const int8* group = ctrl_ + pos;
+      for (uint32 match = MatchByte(group, h2); match != 0; match &= match - 1) {
+        const size_t i = (pos + __builtin_ctz(match)) & (capacity_ - 1);
+        if (slot(i)->first == key) {
+          result = i;
+          return true;
+        }
+      }
+      return MatchEmpty(group) != 0;
+    });
+    return result;
+  }
+
+  // Finds the first empty or deleted slot on the probe sequence of the hash.
+  size_t FindInsertPos(uint64 hash) const {
+    size_t result = 0;
+    ProbeGroups(hash, [this, &result](size_t pos) {
+      const uint32 match = MatchEmptyOrDeleted(ctrl_ + pos);
+      if (match == 0) return false;
+      result = (pos + __builtin_ctz(match)) & (capacity_ - 1);
+      return true;
+    });
+    return result;
+  }
+
+  std::pair<iterator, bool> Insert(const K& key) {
+    size_t pos = FindPos(key);
+    if (pos != capacity_) return std::make_pair(iterator(this, pos), false);
+    const uint64 hash = Hash(key);
+    pos = capacity_ == 0 ? 0 : FindInsertPos(hash);
+    if (capacity_ == 0 || (growth_left_ == 0 && ctrl_[pos] != kDeleted)) {
+      // Rehashing in place drops the deleted slots if they take a large part of the table.
+      Rehash(capacity_ == 0 ? CapacityFor(1) : size_ * 2 >= capacity_ - capacity_ / 8 ? capacity_ * 2 : capacity_);
+      pos = FindInsertPos(hash);
+    }
+    if (ctrl_[pos] == kEmpty) --growth_left_;
+    new (slot(pos)) value_type(key, V());
+    SetCtrl(pos, H2(hash));
+    ++size_;
+    return std::make_pair(iterator(this, pos), true);
+  }
+
+  void Rehash(size_t new_capacity) {
+    int8* old_ctrl = ctrl_;
+    value_type* old_slots = slots_;
+    const size_t old_capacity = capacity_;
+
+    capacity_ = new_capacity;
+    if (new_capacity == 0) {
+      ctrl_ = EmptyGroup();
+      slots_ = nullptr;
+    } else {
+      ctrl_ = static_cast<int8*>(AllocateHugePageBacked(new_capacity + kGroupWidth));
+      memset(ctrl_, kEmpty, new_capacity + kGroupWidth);
+      slots_ = static_cast<value_type*>(AllocateHugePageBacked(new_capacity * sizeof(value_type)));
+    }
+    growth_left_ = new_capacity - new_capacity / 8 - size_;
+
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (!IsFull(old_ctrl[i])) continue;
+      const uint64 hash = Hash(old_slots[i].first);
+      const size_t pos = FindInsertPos(hash);
+      new (slot(pos)) value_type(std::move(old_slots[i]));
+      old_slots[i].~value_type();
+      SetCtrl(pos, H2(hash));
+    }
+    if (old_capacity > 0) {
+      FreeHugePageBacked(old_ctrl, old_capacity + kGroupWidth);
+      FreeHugePageBacked(old_slots, old_capacity * sizeof(value_type));
+    }
+  }
+
+  void Destroy() {
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (IsFull(ctrl_[i])) slot(i)->~value_type();
+    }
+    if (capacity_ > 0) {
+      FreeHugePageBacked(ctrl_, capacity_ + kGroupWidth);
+      FreeHugePageBacked(slots_, capacity_ * sizeof(value_type));
+    }
+  }
+
+  int8* ctrl_;
+  value_type* slots_;
+  size_t capacity_;
+  size_t size_;
+  // Number of empty slots that can still be filled before the table must grow.
+  size_t growth_left_;
+};
+
+#endif /* BASE_FLAT_HASH_MAP_H_ */
@@ -0,0 +1,245 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <random>
+#include <unordered_map>
+
+#include "glog/logging.h"
+
+#include "base/flat_hash_map.h"
+
+#include "external/gtest/googletest/include/gtest/gtest.h"
+
+namespace {
+
+// Puts all keys on the same probe sequence with the same control byte.
+struct ConstantHash {
+  size_t operator()(int) const { return 0; }
+};
+
+// Hashes all keys to a value that can be set.
+struct SettableHash {
+  size_t operator()(int) const { return value; }
+  static size_t value;
+};
+size_t SettableHash::value = 0;
+
+template<class Map>
+void ExpectSameContents(const std::unordered_map<int, int>& expected, int max_key, const Map& map) {
+  EXPECT_EQ(expected.size(), map.size());
+  for (int key = 0; key < max_key; ++key) {
+    auto it = expected.find(key);
+    auto map_it = map.find(key);
+    if (it == expected.end()) {
+      EXPECT_EQ(0, map.count(key)) << key;
+      EXPECT_TRUE(map_it == map.end()) << key;
+    } else {
+      ASSERT_TRUE(map_it != map.end()) << key;
+      EXPECT_EQ(key, map_it->first);
+      EXPECT_EQ(it->second, map_it->second) << key;
+    }
+  }
+  size_t num_iterated = 0;
+  for (const auto& entry : map) {
+    EXPECT_EQ(1, expected.count(entry.first)) << entry.first;
+    ++num_iterated;
+  }
+  EXPECT_EQ(expected.size(), num_iterated);
+}
+
+}  // namespace
+
+TEST(FlatHashMapTest, EmptyMapTest) {
+  FlatHashMap<int, int> map;
+  EXPECT_TRUE(map.empty());
+  EXPECT_EQ(0, map.bucket_count());
+  EXPECT_TRUE(map.find(1) == map.end());
+  EXPECT_EQ(0, map.erase(1));
+  EXPECT_TRUE(map.begin() == map.end());
+}
+
+// Few keys are inserted and erased many times, so deleted slots are reused and the table is rehashed
+// in place.
+TEST(FlatHashMapTest, RandomInsertEraseTest) {
+  const int kMaxKey = 12;
+  std::mt19937 rand(1);
+  FlatHashMap<int, int> map;
+  std::unordered_map<int, int> expected;
+  for (int i = 0; i < 5000; ++i) {
+    const int key = rand() % kMaxKey;
+    if (rand() % 2 == 0) {
+      map[key] = i;
+      expected[key] = i;
+    } else {
+      EXPECT_EQ(expected.erase(key), map.erase(key));
+    }
+    ExpectSameContents(expected, kMaxKey, map);
+  }
+  EXPECT_LE(map.bucket_count(), 32);
+}
+
+// The probe sequence of the keys starts at the last slot of the table and continues at the first one,
+// so the groups it loads end in the copy of the first control bytes after the last slot.
+TEST(FlatHashMapTest, MirroredControlBytesTest) {
+  typedef FlatHashMap<int, int, SettableHash> Map;
+  // Fills a table of 16 slots.
+  const int kNumKeys = 14;
+  // The first key takes the start of the probe sequence, so it is iterated last if that is the last slot.
+  bool found = false;
+  for (SettableHash::value = 0; SettableHash::value < 1000; ++SettableHash::value) {
+    Map map;
+    for (int i = 0; i < kNumKeys; ++i) {
+      map[i] = i;
+    }
+    int last_key = -1;
+    for (const auto& entry : map) {
+      last_key = entry.first;
+    }
+    if (map.bucket_count() == 16 && last_key == 0) {
+      found = true;
+      break;
+    }
+  }
+  ASSERT_TRUE(found);
+
+  Map map;
+  std::unordered_map<int, int> expected;
+  for (int i = 0; i < kNumKeys; ++i) {
+    map[i] = i;
+    expected[i] = i;
+    ExpectSameContents(expected, 128, map);
+  }
+  // Deletes the keys in the first slots, which the later keys are found through.
+  for (int i = 1; i < 8; ++i) {
+    EXPECT_EQ(1, map.erase(i));
+    expected.erase(i);
+  }
+  ExpectSameContents(expected, 128, map);
+  for (int i = 100; i < 107; ++i) {
+    map[i] = i;
+    expected[i] = i;
+  }
+  EXPECT_EQ(16, map.bucket_count());
+  ExpectSameContents(expected, 128, map);
+}
+
+TEST(FlatHashMapTest, TombstonesTest) {
+  FlatHashMap<int, int, ConstantHash> map;
+  for (int i = 0; i < 24; ++i) {
+    map[i] = i;
+  }
+  EXPECT_EQ(32, map.bucket_count());
+  // The erased keys were inserted first, so they are before the others on the probe sequence, which
+  // must not end at their deleted slots.
+  std::unordered_map<int, int> expected;
+  for (int i = 0; i < 24; ++i) {
+    if (i < 12) {
+      EXPECT_EQ(1, map.erase(i));
+    } else {
+      expected[i] = i;
+    }
+  }
+  ExpectSameContents(expected, 48, map);
+
+  // New keys reuse the deleted slots.
+  for (int i = 24; i < 36; ++i) {
+    EXPECT_TRUE(map.insert(std::make_pair(i, i)).second);
+    expected[i] = i;
+  }
+  EXPECT_FALSE(map.insert(std::make_pair(30, 0)).second);
+  EXPECT_EQ(32, map.bucket_count());
+  ExpectSameContents(expected, 48, map);
+}
+
+TEST(FlatHashMapTest, ChurnTest) {
+  // Deleted slots are dropped by rehashing in place instead of growing the table.
+  FlatHashMap<int, int> map;
+  for (int i = 0; i < 10000; ++i) {
+    map[i] = i;
+    if (i >= 10) {
+      EXPECT_EQ(1, map.erase(i - 10));
+    }
+  }
+  EXPECT_EQ(10, map.size());
+  EXPECT_LE(map.bucket_count(), 32);
+  for (int i = 9990; i < 10000; ++i) {
+    EXPECT_EQ(i, map.find(i)->second);
+  }
+}
+
+TEST(FlatHashMapTest, GrowthTest) {
+  FlatHashMap<int, int> map;
+  std::unordered_map<int, int> expected;
+  for (int i = 0; i < 1000; ++i) {
+    map[i] = -i;
+    expected[i] = -i;
+    const size_t buckets = map.bucket_count();
+    EXPECT_EQ(0, buckets & (buckets - 1)) << buckets;
+    EXPECT_LE(map.size(), buckets - buckets / 8);
+  }
+  ExpectSameContents(expected, 2000, map);
+
+  // Copies and moves keep the elements.
+  FlatHashMap<int, int> copy(map);
+  ExpectSameContents(expected, 2000, copy);
+  FlatHashMap<int, int> moved(std::move(copy));
+  ExpectSameContents(expected, 2000, moved);
+  EXPECT_TRUE(copy.empty());
+
+  // resize shrinks the table to the remaining elements.
+  for (int i = 10; i < 1000; ++i) {
+    map.erase(i);
+    expected.erase(i);
+  }
+  map.resize(0);
+  EXPECT_EQ(16, map.bucket_count());
+  ExpectSameContents(expected, 2000, map);
+
+  map.clear();
+  EXPECT_EQ(0, map.bucket_count());
+  EXPECT_TRUE(map.find(1) == map.end());
+}
+
+TEST(FlatHashMapTest, ReserveTest) {
+  FlatHashMap<int, int> map;
+  map.reserve(1000);
+  const size_t buckets = map.bucket_count();
+  EXPECT_LE(1000, buckets - buckets / 8);
+  for (int i = 0; i < 1000; ++i) {
+    map[i] = i;
+  }
+  EXPECT_EQ(buckets, map.bucket_count());
+}
+
+TEST(FlatHashMapTest, EraseWhileIteratingTest) {
+  FlatHashMap<int, int> map;
+  for (int i = 0; i < 100; ++i) {
+    map[i] = i;
+  }
+  for (auto it = map.begin(); it != map.end(); ++it) {
+    if (it->first % 2 == 0) map.erase(it);
+  }
+  EXPECT_EQ(50, map.size());
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(i % 2, map.count(i)) << i;
+  }
+}
+
+int main(int argc, char **argv) {
+  google::InstallFailureSignalHandler();
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
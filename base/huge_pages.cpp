@@ -0,0 +1,170 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include "base/huge_pages.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#include "glog/logging.h"
+
+#include "base/stringprintf.h"
+
+DEFINE_int32(huge_pages, 0, "Back the large model tables with huge pages to reduce TLB misses of lookups. "
+    "0: off, 1: transparent huge pages (madvise), 2: explicit huge pages (MAP_HUGETLB, needs "
+    "/proc/sys/vm/nr_hugepages), falling back to transparent ones.");
+
+namespace {
+
+const size_t kHugePageBytes = 2 << 20;
+
+struct Region {
+  size_t bytes;
+  bool is_explicit;
+};
+
+// Live allocations mapped by AllocateHugePageBacked, by start address.
+std::mutex regions_mutex;
+std::map<uintptr_t, Region> regions;
+size_t num_fallbacks = 0;
+
+// Maps bytes (a multiple of kHugePageBytes) at a huge page boundary, such that transparent huge
+// pages can back all of it.
+void* MapAligned(size_t bytes) {
+  void* mapped = mmap(nullptr, bytes + kHugePageBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapped == MAP_FAILED) return nullptr;
+  char* start = static_cast<char*>(mapped);
+  char* aligned = reinterpret_cast<char*>(
+      (reinterpret_cast<uintptr_t>(start) + kHugePageBytes - 1) & ~(kHugePageBytes - 1));
+  if (aligned > start) {
+    munmap(start, aligned - start);
+  }
+  char* end = start + bytes + kHugePageBytes;
+  if (end > aligned + bytes) {
+    munmap(aligned + bytes, end - (aligned + bytes));
+  }
+  return aligned;
+}
+
+}  // namespace
+
+void* AllocateHugePageBacked(size_t bytes) {
+  if (FLAGS_huge_pages <= 0 || bytes < kHugePageMinBytes) {
+    void* p = malloc(bytes);
+    CHECK(p != nullptr || bytes == 0) << "Out of memory allocating " << bytes << " bytes";
+    return p;
+  }
+  const size_t size = (bytes + kHugePageBytes - 1) / kHugePageBytes * kHugePageBytes;
+  void* p = nullptr;
+  bool is_explicit = false;
+#ifdef MAP_HUGETLB
+  if (FLAGS_huge_pages >= 2) {
+    p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+      p = nullptr;
+    } else {
+      is_explicit = true;
+    }
+  }
+#endif
+  if (p == nullptr) {
+    p = MapAligned(size);
+    CHECK(p != nullptr) << "Could not map " << size << " bytes";
+#ifdef MADV_HUGEPAGE
+    // Fails if transparent huge pages are not available, which GetHugePageUsage then shows.
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+  }
+  std::lock_guard<std::mutex> lock(regions_mutex);
+  if (FLAGS_huge_pages >= 2 && !is_explicit) {
+    LOG_IF(WARNING, num_fallbacks == 0) << "No explicit huge pages left, using transparent huge pages";
+    num_fallbacks++;
+  }
+  regions[reinterpret_cast<uintptr_t>(p)] = Region{size, is_explicit};
+  return p;
+}
+
+void FreeHugePageBacked(void* p, size_t bytes) {
+  if (p == nullptr) return;
+  if (bytes >= kHugePageMinBytes) {
+    std::lock_guard<std::mutex> lock(regions_mutex);
+    auto it = regions.find(reinterpret_cast<uintptr_t>(p));
+    // Not found if the allocation was made with --huge_pages=0.
+    if (it != regions.end()) {
+      CHECK_EQ(0, munmap(p, it->second.bytes));
+      regions.erase(it);
+      return;
+    }
+  }
+  free(p);
+}
+
+HugePageUsage GetHugePageUsage() {
+  HugePageUsage usage;
+  std::lock_guard<std::mutex> lock(regions_mutex);
+  usage.num_fallbacks = num_fallbacks;
+  for (const auto& region : regions) {
+    usage.mapped_bytes += region.second.bytes;
+    if (region.second.is_explicit) usage.explicit_bytes += region.second.bytes;
+  }
+  if (regions.empty()) return usage;
+
+  FILE* f = fopen("/proc/self/smaps", "r");
+  if (f == nullptr) return usage;
+  // The kernel may merge adjacent mappings, so every mapping is matched by its overlap with the
+  // regions and its huge page bytes are capped by the overlap.
+  size_t overlap = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), f) != nullptr) {
+    unsigned long long start, end;
+    unsigned long long kb;
+    if (sscanf(line, "%llx-%llx ", &start, &end) == 2) {
+      // Header line of a mapping.
+      overlap = 0;
+      auto it = regions.upper_bound(start);
+      if (it != regions.begin()) --it;
+      for (; it != regions.end() && it->first < end; ++it) {
+        const uintptr_t region_end = it->first + it->second.bytes;
+        if (region_end > start) {
+          overlap += std::min<uintptr_t>(region_end, end) - std::max<uintptr_t>(it->first, start);
+        }
+      }
+    } else if (overlap > 0 && sscanf(line, "AnonHugePages: %llu kB", &kb) == 1) {
+      usage.huge_page_bytes += std::min<size_t>(kb << 10, overlap);
+    } else if (overlap > 0 && (sscanf(line, "Private_Hugetlb: %llu kB", &kb) == 1 ||
+                               sscanf(line, "Shared_Hugetlb: %llu kB", &kb) == 1)) {
+      usage.huge_page_bytes += std::min<size_t>(kb << 10, overlap);
+    }
+  }
+  fclose(f);
+  return usage;
+}
+
+std::string HugePageUsageString() {
+  const HugePageUsage usage = GetHugePageUsage();
+  std::string result;
+  StringAppendF(&result, "Huge pages: %.1f of %.1f MB of large tables backed (%.1f MB explicit",
+      usage.huge_page_bytes / 1048576.0, usage.mapped_bytes / 1048576.0, usage.explicit_bytes / 1048576.0);
+  if (usage.num_fallbacks > 0) {
+    StringAppendF(&result, ", %zu fallbacks to transparent", usage.num_fallbacks);
+  }
+  result.append(")");
+  return result;
+}
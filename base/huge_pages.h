@@ -0,0 +1,106 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_HUGE_PAGES_H_
+#define BASE_HUGE_PAGES_H_
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <limits>
+#include <new>
+#include <string>
+
+#include "gflags/gflags.h"
+
+DECLARE_int32(huge_pages);
+
+// Large tables with random access (hash tables, count arrays) spend much of their lookup time in
+// TLB misses with 4KB pages. With --huge_pages, allocations of at least kHugePageMinBytes are
+// mapped separately, aligned to 2MB and backed by huge pages:
+//   1: transparent huge pages requested with madvise(MADV_HUGEPAGE).
+//   2: explicit huge pages (MAP_HUGETLB) from the pool in /proc/sys/vm/nr_hugepages, with a
+//      fallback to 1 if the pool is exhausted.
+// Smaller allocations and --huge_pages=0 (the default) use malloc.
+static const size_t kHugePageMinBytes = 1 << 20;
+
+void* AllocateHugePageBacked(size_t bytes);
+// bytes must be the size given to AllocateHugePageBacked.
+void FreeHugePageBacked(void* p, size_t bytes);
+
+// How much of the memory allocated above kHugePageMinBytes is backed by huge pages, from
+// /proc/self/smaps. Only meaningful on Linux.
+struct HugePageUsage {
+  HugePageUsage() : mapped_bytes(0), huge_page_bytes(0), explicit_bytes(0), num_fallbacks(0) {}
+
+  size_t mapped_bytes;     // Live separately mapped allocations.
+  size_t huge_page_bytes;  // Of these, backed by huge pages (transparent or explicit).
+  size_t explicit_bytes;   // Of these, explicit huge pages.
+  size_t num_fallbacks;    // Explicit huge page requests that fell back to transparent ones.
+};
+
+HugePageUsage GetHugePageUsage();
+std::string HugePageUsageString();
+
+// STL allocator that allocates through AllocateHugePageBacked. Also usable as the allocator of
+// google::dense_hash_map.
+template<class T>
+class HugePageAllocator {
+public:
+  typedef T value_type;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+
+  template<class U> struct rebind {
+    typedef HugePageAllocator<U> other;
+  };
+
+  HugePageAllocator() {}
+  template<class U> HugePageAllocator(const HugePageAllocator<U>&) {}
+
+  pointer address(reference r) const { return &r; }
+  const_pointer address(const_reference r) const { return &r; }
+
+  pointer allocate(size_type n, const void* = nullptr) {
+    return static_cast<pointer>(AllocateHugePageBacked(n * sizeof(T)));
+  }
+
+  void deallocate(pointer p, size_type n) {
+    FreeHugePageBacked(p, n * sizeof(T));
+  }
+
+  size_type max_size() const {
+    return std::numeric_limits<size_type>::max() / sizeof(T);
+  }
+
+  template<class U, class... Args>
+  void construct(U* p, Args&&... args) {
+    new (p) U(std::forward<Args>(args)...);
+  }
+
+  template<class U>
+  void destroy(U* p) {
+    p->~U();
+  }
+
+  template<class U> bool operator==(const HugePageAllocator<U>&) const { return true; }
+  template<class U> bool operator!=(const HugePageAllocator<U>&) const { return false; }
+};
+
+#endif /* BASE_HUGE_PAGES_H_ */
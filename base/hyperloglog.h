@@ -0,0 +1,128 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_HYPERLOGLOG_H_
+#define BASE_HYPERLOGLOG_H_
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "base.h"
+
+// HyperLogLog estimate of the number of distinct 64-bit keys added. Uses 2^precision one-byte
+// registers; the standard error is about 1.04 / sqrt(2^precision), e.g. 1.6% for precision 12.
+// Small sets are kept exactly as a list of hashes until they would take about as much memory as
+// the registers, so that many mostly small sketches stay cheap.
+class HyperLogLog {
+public:
+  explicit HyperLogLog(int precision = 12) : precision_(precision) {
+    CHECK(precision >= 4 && precision <= 18) << "Unsupported precision " << precision;
+  }
+
+  void Add(uint64 key) {
+    // Keys such as feature hashes are not uniformly distributed, so they are mixed first.
+    AddHash(FingerprintCat64(key, 0));
+  }
+
+  // Adds the keys of another sketch of the same precision, as if they had been added to this one.
+  void Merge(const HyperLogLog& o) {
+    CHECK_EQ(precision_, o.precision_);
+    if (o.registers_.empty()) {
+      for (uint64 h : o.sparse_) {
+        AddHash(h);
+      }
+      return;
+    }
+    UseRegisters();
+    for (size_t i = 0; i < registers_.size(); ++i) {
+      registers_[i] = std::max(registers_[i], o.registers_[i]);
+    }
+  }
+
+  double Estimate() const {
+    if (registers_.empty()) {
+      std::vector<uint64> hashes(sparse_);
+      Deduplicate(&hashes);
+      return hashes.size();
+    }
+    const double m = registers_.size();
+    double sum = 0;
+    int num_zero = 0;
+    for (uint8 r : registers_) {
+      sum += ldexp(1.0, -r);
+      if (r == 0) num_zero++;
+    }
+    const double alpha = 0.7213 / (1 + 1.079 / m);
+    const double estimate = alpha * m * m / sum;
+    // Linear counting is more accurate for small cardinalities.
+    if (estimate <= 2.5 * m && num_zero > 0) {
+      return m * log(m / num_zero);
+    }
+    return estimate;
+  }
+
+private:
+  size_t MaxSparse() const {
+    return (1 << precision_) / 16;
+  }
+
+  void AddHash(uint64 h) {
+    if (!registers_.empty()) {
+      AddToRegisters(h);
+      return;
+    }
+    sparse_.push_back(h);
+    if (sparse_.size() >= 2 * MaxSparse()) {
+      Deduplicate(&sparse_);
+      if (sparse_.size() > MaxSparse()) {
+        UseRegisters();
+      }
+    }
+  }
+
+  // Moves the hashes of the sparse list to the registers.
+  void UseRegisters() {
+    if (!registers_.empty()) return;
+    registers_.assign(1 << precision_, 0);
+    for (uint64 sparse_hash : sparse_) {
+      AddToRegisters(sparse_hash);
+    }
+    std::vector<uint64>().swap(sparse_);
+  }
+
+  void AddToRegisters(uint64 h) {
+    const size_t index = h >> (64 - precision_);
+    // Position of the first set bit in the remaining bits (1-based); a guard bit bounds it.
+    const uint64 rest = (h << precision_) | (1ULL << (precision_ - 1));
+    const uint8 rank = __builtin_clzll(rest) + 1;
+    registers_[index] = std::max(registers_[index], rank);
+  }
+
+  static void Deduplicate(std::vector<uint64>* hashes) {
+    std::sort(hashes->begin(), hashes->end());
+    hashes->erase(std::unique(hashes->begin(), hashes->end()), hashes->end());
+  }
+
+  int precision_;
+  // Hashes of the keys (with duplicates) while the set is small, then the registers.
+  std::vector<uint64> sparse_;
+  std::vector<uint8> registers_;
+};
+
+#endif /* BASE_HYPERLOGLOG_H_ */
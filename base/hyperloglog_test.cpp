@@ -0,0 +1,90 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <algorithm>
+
+#include "glog/logging.h"
+
+#include "base/hyperloglog.h"
+
+#include "external/gtest/googletest/include/gtest/gtest.h"
+
+TEST(HyperLogLogTest, SmallSetIsExactTest) {
+  HyperLogLog hll;
+  EXPECT_EQ(0, hll.Estimate());
+  // Up to (2^12)/16 distinct keys stay in the exact list, duplicates included.
+  for (int repeat = 0; repeat < 3; ++repeat) {
+    for (uint64 key = 0; key < 200; ++key) {
+      hll.Add(key);
+    }
+  }
+  EXPECT_EQ(200, hll.Estimate());
+}
+
+TEST(HyperLogLogTest, EstimateTest) {
+  // The standard error at precision 12 is 1.6%.
+  for (uint64 n : {1000, 10000, 100000, 1000000}) {
+    HyperLogLog hll;
+    for (uint64 key = 0; key < n; ++key) {
+      hll.Add(key);
+      hll.Add(key);
+    }
+    EXPECT_NEAR(n, hll.Estimate(), 0.05 * n) << n;
+  }
+}
+
+TEST(HyperLogLogTest, PrecisionTest) {
+  HyperLogLog hll(16);
+  for (uint64 key = 0; key < 100000; ++key) {
+    hll.Add(key * 7919);
+  }
+  // The standard error at precision 16 is 0.4%.
+  EXPECT_NEAR(100000, hll.Estimate(), 1500);
+}
+
+// Merging gives the sketch of the union, whether the sketches are still exact lists or registers.
+TEST(HyperLogLogTest, MergeTest) {
+  const uint64 kSizes[] = {10, 100, 5000, 50000};
+  for (uint64 a_size : kSizes) {
+    for (uint64 b_size : kSizes) {
+      HyperLogLog a, b, both;
+      // The keys of a and b overlap by half of the smaller set.
+      const uint64 b_start = a_size - std::min(a_size, b_size) / 2;
+      for (uint64 key = 0; key < a_size; ++key) {
+        a.Add(key);
+        both.Add(key);
+      }
+      for (uint64 key = b_start; key < b_start + b_size; ++key) {
+        b.Add(key);
+        both.Add(key);
+      }
+      const double b_estimate = b.Estimate();
+      a.Merge(b);
+      EXPECT_EQ(both.Estimate(), a.Estimate()) << a_size << " " << b_size;
+      EXPECT_EQ(b_estimate, b.Estimate());
+
+      // Merging again adds nothing.
+      a.Merge(b);
+      EXPECT_EQ(both.Estimate(), a.Estimate()) << a_size << " " << b_size;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  google::InstallFailureSignalHandler();
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,106 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include "minimal_perfect_hash.h"
+
+#include <algorithm>
+
+#include "glog/logging.h"
+
+#include "fileutil.h"
+
+void MinimalPerfectHash::Build(const std::vector<uint64>& keys, double gamma) {
+  bits_.clear();
+  block_ranks_.clear();
+  levels_.clear();
+  fallback_.clear();
+  size_ = keys.size();
+
+  std::vector<uint64> remaining(keys);
+  std::vector<uint64> next;
+  uint64 bit_offset = 0;
+  for (int level_id = 0; level_id < kMaxLevels && !remaining.empty(); ++level_id) {
+    Level level;
+    level.bit_offset = bit_offset;
+    level.num_bits = std::max<uint64>(64, (static_cast<uint64>(gamma * remaining.size()) + 63) / 64 * 64);
+    level.seed = level_id + 1;
+
+    // Positions hit by exactly one remaining key are kept; keys on the other positions go to the
+    // next level.
+    std::vector<uint64> hit(level.num_bits / 64, 0), collision(level.num_bits / 64, 0);
+    for (uint64 key : remaining) {
+      const uint64 pos = Reduce(FingerprintCat64(key, level.seed), level.num_bits);
+      const uint64 mask = 1ULL << (pos & 63);
+      if (hit[pos >> 6] & mask) {
+        collision[pos >> 6] |= mask;
+      } else {
+        hit[pos >> 6] |= mask;
+      }
+    }
+    next.clear();
+    for (uint64 key : remaining) {
+      const uint64 pos = Reduce(FingerprintCat64(key, level.seed), level.num_bits);
+      if ((collision[pos >> 6] >> (pos & 63)) & 1) {
+        next.push_back(key);
+      }
+    }
+    for (size_t i = 0; i < hit.size(); ++i) {
+      hit[i] &= ~collision[i];
+    }
+    bits_.insert(bits_.end(), hit.begin(), hit.end());
+    levels_.push_back(level);
+    bit_offset += level.num_bits;
+    remaining.swap(next);
+  }
+
+  size_t rank = 0;
+  for (size_t i = 0; i < bits_.size(); ++i) {
+    if (i % kWordsPerBlock == 0) block_ranks_.push_back(rank);
+    rank += __builtin_popcountll(bits_[i]);
+  }
+  for (uint64 key : remaining) {
+    CHECK(fallback_.insert(std::make_pair(key, rank++)).second) << "Duplicate key " << key;
+  }
+  CHECK_EQ(rank, size_);
+}
+
+size_t MinimalPerfectHash::MemoryBytes() const {
+  return bits_.capacity() * sizeof(uint64) + block_ranks_.capacity() * sizeof(uint64) +
+      levels_.capacity() * sizeof(Level) + fallback_.size() * (sizeof(std::pair<const uint64, size_t>) + 2 * sizeof(void*));
+}
+
+void MinimalPerfectHash::WriteToFileOrDie(FILE* f) const {
+  uint64 size = size_;
+  CHECK_EQ(1, fwrite(&size, sizeof(size), 1, f));
+  WriteVectorToFileOrDie(levels_, f);
+  WriteVectorToFileOrDie(bits_, f);
+  WriteVectorToFileOrDie(block_ranks_, f);
+  std::vector<std::pair<uint64, uint64> > fallback(fallback_.begin(), fallback_.end());
+  WriteVectorToFileOrDie(fallback, f);
+}
+
+void MinimalPerfectHash::ReadFromFileOrDie(FILE* f) {
+  uint64 size = 0;
+  CHECK_EQ(1, fread(&size, sizeof(size), 1, f));
+  size_ = size;
+  ReadVectorFromFileOrDie(&levels_, f);
+  ReadVectorFromFileOrDie(&bits_, f);
+  ReadVectorFromFileOrDie(&block_ranks_, f);
+  std::vector<std::pair<uint64, uint64> > fallback;
+  ReadVectorFromFileOrDie(&fallback, f);
+  fallback_.clear();
+  fallback_.insert(fallback.begin(), fallback.end());
+}
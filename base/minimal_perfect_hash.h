@@ -0,0 +1,100 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_MINIMAL_PERFECT_HASH_H_
+#define BASE_MINIMAL_PERFECT_HASH_H_
+
+#include <stdio.h>
+#include <unordered_map>
+#include <vector>
+
+#include "base.h"
+#include "huge_pages.h"
+
+// Minimal perfect hash function over a fixed set of distinct 64-bit keys (BBHash construction).
+// Every key of the set maps to a distinct index in [0, size()); other keys map to an arbitrary
+// index or to size(), so callers must verify the key (e.g. with a stored fingerprint). Uses
+// about 3.5 bits per key with the default gamma of 2.
+class MinimalPerfectHash {
+public:
+  MinimalPerfectHash() : size_(0) {}
+
+  // Builds the function for the given keys, which must be distinct. A larger gamma builds faster
+  // and makes lookups touch fewer levels at the cost of more bits per key.
+  void Build(const std::vector<uint64>& keys, double gamma = 2.0);
+
+  // Index of the key in [0, size()], see above.
+  size_t Lookup(uint64 key) const {
+    for (const Level& level : levels_) {
+      const uint64 pos = level.bit_offset + Reduce(FingerprintCat64(key, level.seed), level.num_bits);
+      if ((bits_[pos >> 6] >> (pos & 63)) & 1) {
+        return Rank(pos);
+      }
+    }
+    if (!fallback_.empty()) {
+      const auto it = fallback_.find(key);
+      if (it != fallback_.end()) return it->second;
+    }
+    return size_;
+  }
+
+  // Number of keys.
+  size_t size() const {
+    return size_;
+  }
+
+  size_t MemoryBytes() const;
+
+  void WriteToFileOrDie(FILE* f) const;
+  void ReadFromFileOrDie(FILE* f);
+
+private:
+  struct Level {
+    uint64 bit_offset;
+    uint64 num_bits;
+    uint64 seed;
+  };
+
+  // Maps a hash to [0, n) without a modulo.
+  static uint64 Reduce(uint64 hash, uint64 n) {
+    return static_cast<uint64>((static_cast<unsigned __int128>(hash) * n) >> 64);
+  }
+
+  // Number of set bits before position pos.
+  size_t Rank(uint64 pos) const {
+    const uint64 word = pos >> 6;
+    size_t rank = block_ranks_[word / kWordsPerBlock];
+    for (uint64 w = word - word % kWordsPerBlock; w < word; ++w) {
+      rank += __builtin_popcountll(bits_[w]);
+    }
+    return rank + __builtin_popcountll(bits_[word] & ((1ULL << (pos & 63)) - 1));
+  }
+
+  static const int kWordsPerBlock = 8;
+  static const int kMaxLevels = 32;
+
+  // The bits of all levels, concatenated. A key is placed at the first level where its position
+  // is not shared with another remaining key.
+  std::vector<uint64, HugePageAllocator<uint64> > bits_;
+  // Number of set bits before each block of kWordsPerBlock words.
+  std::vector<uint64> block_ranks_;
+  std::vector<Level> levels_;
+  // Keys that still collided after kMaxLevels levels.
+  std::unordered_map<uint64, size_t> fallback_;
+  size_t size_;
+};
+
+#endif /* BASE_MINIMAL_PERFECT_HASH_H_ */
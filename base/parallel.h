@@ -0,0 +1,65 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_PARALLEL_H_
+#define BASE_PARALLEL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Returns num_threads if it is positive and the number of cores otherwise.
+inline int NumThreadsOrDefault(int num_threads) {
+  if (num_threads > 0) return num_threads;
+  return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+// Calls fn(i) for every i in [0, n) on up to num_threads threads, including the calling one.
+// Indices are handed out in small chunks, so uneven work per index is balanced. Returns when
+// all calls are done.
+template<class Fn>
+void ParallelFor(size_t n, int num_threads, const Fn& fn) {
+  if (num_threads <= 1 || n <= 1) {
+    for (size_t i = 0; i < n; ++i) {
+      fn(i);
+    }
+    return;
+  }
+  num_threads = static_cast<int>(std::min<size_t>(num_threads, n));
+  const size_t chunk = std::max<size_t>(1, n / (num_threads * 16));
+  std::atomic<size_t> next(0);
+  const auto worker = [&]() {
+    for (;;) {
+      size_t begin = next.fetch_add(chunk);
+      if (begin >= n) break;
+      size_t end = std::min(n, begin + chunk);
+      for (size_t i = begin; i < end; ++i) {
+        fn(i);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; ++i) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+#endif /* BASE_PARALLEL_H_ */
@@ -37,7 +37,11 @@ public:
         : ss_(ss) {
   }
 
+#ifdef PHOG_FEATURE_HASH64
+  typedef SequenceHash64Feature Feature;
+#else
   typedef SequenceHashFeature Feature;
+#endif
   typedef std::mt19937 RandomGen;
 
   enum class OpCmd {
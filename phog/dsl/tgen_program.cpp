@@ -97,6 +97,7 @@ size_t TGenProgram::AddProgram(const BranchCondProgram& prog) {
   e.type = ProgramType::BRANCHED_PROGRAM;
   e.program_internal_index = branched_progs_.size();
   entries_.push_back(e);
+  recursive_sizes_.clear();
   branched_progs_.push_back(prog);
   return entries_.size() - 1;
 }
@@ -106,30 +107,69 @@ size_t TGenProgram::AddProgram(const SimpleCondProgram& prog) {
   e.type = ProgramType::SIMPLE_PROGRAM;
   e.program_internal_index = simple_progs_.size();
   entries_.push_back(e);
+  recursive_sizes_.clear();
   simple_progs_.push_back(prog);
   return entries_.size() - 1;
 }
 
 size_t TGenProgram::GetProgramRecursiveSize(int pos) const {
-  if (program_type(pos) == ProgramType::BRANCHED_PROGRAM) {
-    const BranchCondProgram& program = branched_prog(pos);
-
-    int size = program.cond.program.size();
-    std::set<int> programs_set;
-    program.GetReferencedPrograms(&programs_set);
-    for (int prog : programs_set) {
-      size += GetProgramRecursiveSize(prog);
+  CHECK((size_t) pos < entries_.size());
+  return GetAllProgramRecursiveSizes()[pos];
+}
+
+const std::vector<size_t>& TGenProgram::GetAllProgramRecursiveSizes() const {
+  if (recursive_sizes_.size() == entries_.size()) {
+    return recursive_sizes_;
+  }
+
+  // Iterative post-order traversal of the call graph, such that deep switch chains do not
+  // overflow the stack. Each program is expanded once and its size is reused by all callers.
+  enum { NOT_VISITED, IN_PROGRESS, DONE };
+  std::vector<char> state(entries_.size(), NOT_VISITED);
+  std::vector<size_t> sizes(entries_.size(), 0);
+  std::vector<int> stack;
+  std::set<int> programs_set;
+  for (size_t root = 0; root < entries_.size(); ++root) {
+    if (state[root] != NOT_VISITED) continue;
+    stack.push_back(root);
+    while (!stack.empty()) {
+      int pos = stack.back();
+      if (program_type(pos) == ProgramType::SIMPLE_PROGRAM) {
+        sizes[pos] = simple_prog(pos).size();
+        state[pos] = DONE;
+        stack.pop_back();
+        continue;
+      }
+      const BranchCondProgram& program = branched_prog(pos);
+      program.GetReferencedPrograms(&programs_set);
+      if (state[pos] == NOT_VISITED) {
+        state[pos] = IN_PROGRESS;
+        for (int prog : programs_set) {
+          CHECK((size_t) prog < entries_.size()) << "Program " << pos << " calls missing program " << prog;
+          CHECK(state[prog] != IN_PROGRESS) << "Recursive call to program " << prog << " from " << pos;
+          if (state[prog] == NOT_VISITED) stack.push_back(prog);
+        }
+        continue;
+      }
+      if (state[pos] == IN_PROGRESS) {
+        size_t size = program.cond.program.size();
+        for (int prog : programs_set) {
+          size += sizes[prog];
+        }
+        sizes[pos] = size;
+        state[pos] = DONE;
+      }
+      stack.pop_back();
     }
-    return size;
-  } else {
-    CHECK(program_type(pos) == ProgramType::SIMPLE_PROGRAM);
-    return simple_prog(pos).size();
   }
-}
 
+  recursive_sizes_.swap(sizes);
+  return recursive_sizes_;
+}
 
 void TGenProgram::Clear() {
   entries_.clear();
+  recursive_sizes_.clear();
   branched_progs_.clear();
   simple_progs_.clear();
 }
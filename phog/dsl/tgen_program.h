@@ -64,8 +64,14 @@ public:
 
   void Clear();
 
+  // Returns the size of the program at pos together with the sizes of all programs it may call.
   size_t GetProgramRecursiveSize(int pos) const;
 
+  // Returns GetProgramRecursiveSize for every position. The table is computed in one bottom-up
+  // pass over the program DAG (shared subprograms are visited once) and is cached until the
+  // TGenProgram is modified. Not thread-safe on the first call after a modification.
+  const std::vector<size_t>& GetAllProgramRecursiveSizes() const;
+
   size_t size() const {
     return entries_.size();
   }
@@ -77,6 +83,7 @@ public:
   BranchCondProgram* mutable_branched_prog(int pos) {
     CHECK((size_t) pos < entries_.size());
     CHECK(entries_[pos].type == ProgramType::BRANCHED_PROGRAM);
+    recursive_sizes_.clear();
     return &branched_progs_[entries_[pos].program_internal_index];
   }
   const BranchCondProgram& branched_prog(int pos) const {
@@ -88,6 +95,7 @@ public:
   SimpleCondProgram* mutable_simple_prog(int pos) {
     CHECK((size_t) pos < entries_.size());
     CHECK(entries_[pos].type == ProgramType::SIMPLE_PROGRAM);
+    recursive_sizes_.clear();
     return &simple_progs_[entries_[pos].program_internal_index];
   }
   const SimpleCondProgram& simple_prog(int pos) const {
@@ -114,6 +122,9 @@ private:
   std::vector<InternalEntry> entries_;
   std::vector<BranchCondProgram> branched_progs_;
   std::vector<SimpleCondProgram> simple_progs_;
+
+  // Cache for GetAllProgramRecursiveSizes(). Empty if not computed.
+  mutable std::vector<size_t> recursive_sizes_;
 };
 
 namespace TGen {
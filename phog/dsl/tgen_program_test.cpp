@@ -46,6 +46,31 @@ TEST(TGenProgramTest, LoadSave) {
   EXPECT_TRUE(TGenProgram::ProgramType::BRANCHED_PROGRAM == p.program_type(6));
 }
 
+TEST(TGenProgramTest, RecursiveSize) {
+  std::string prog =
+      "WRITE_TYPE LEFT WRITE_TYPE\n"
+      "UP WRITE_TYPE\n"
+      "switch WRITE_TYPE: on \"Property\" goto 1; else goto 0\n"
+      "switch UP WRITE_TYPE: on \"Expr\" goto 2; else goto 0\n"
+      "switch UP UP WRITE_TYPE: on \"Expr\" goto 2; else goto 3\n";
+
+  StringSet ss;
+  TCondLanguage lang(&ss);
+  TGenProgram p;
+  p.LoadFromStringOrDie(&lang, prog);
+
+  // Shared subprograms are counted once per reference.
+  std::vector<size_t> expected{3, 2, 1 + 2 + 3, 2 + 6 + 3, 3 + 6 + 11};
+  EXPECT_EQ(expected, p.GetAllProgramRecursiveSizes());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(expected[i], p.GetProgramRecursiveSize(i));
+  }
+
+  p.AddProgram(p.simple_prog(0));
+  EXPECT_EQ(6u, p.GetAllProgramRecursiveSizes().size());
+  EXPECT_EQ(3u, p.GetProgramRecursiveSize(5));
+}
+
 int main(int argc, char **argv) {
   google::InstallFailureSignalHandler();
   testing::InitGoogleTest(&argc, argv);
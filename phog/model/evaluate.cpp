@@ -15,6 +15,9 @@
  */
 
 
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <bitset>
 #include <iomanip>
 #include <memory>
@@ -25,8 +28,12 @@
 #include "glog/logging.h"
 #include "json/json.h"
 
+#include "base/base.h"
+#include "base/parallel.h"
 #include "base/readerutil.h"
+#include "base/stringprintf.h"
 #include "base/stringset.h"
+#include "base/strutil.h"
 #include "base/treeprinter.h"
 
 #include "phog/tree/tree.h"
@@ -34,59 +41,529 @@
 #include "phog/dsl/tgen_program.h"
 #include "phog/model/model.h"
 
+DECLARE_bool(lazy_model_sections);
+DECLARE_string(spill_dir);
+
 DEFINE_int32(num_training_asts, 100000, "Maximun number of training ASTs to load.");
 DEFINE_int32(num_eval_asts, 50000, "Maximun number of evaluation ASTs to load.");
 DEFINE_string(training_data, "", "A file with the training data.");
 DEFINE_string(evaluation_data, "", "A file with the training data.");
 DEFINE_string(tgen_program, "", "A file with a TGen program.");
+DEFINE_string(incremental_training_data, "", "Optional file with more training data that is added to the model "
+    "after it was trained on --training_data. Only the statistics touched by it are recomputed.");
 DEFINE_bool(is_for_node_type, false, "Whether the predictions are for node type (if false it is for node value).");
+DEFINE_string(type_tgen_program, "", "With --value_tgen_program, replaces --tgen_program and --is_for_node_type: "
+    "a type model and a value model are trained and evaluated together in one pass over the data. The strings are "
+    "indexed in a different order than in separate runs, which changes the feature hashes, so the metrics may differ "
+    "slightly from separate runs unless all runs use the same --strings_file.");
+DEFINE_string(value_tgen_program, "", "TGen program of the value model, see --type_tgen_program.");
+DEFINE_double(presize_sample_rate, 0, "If positive, a first pass over this fraction of the training trees estimates "
+    "the number of distinct features and feature values, and the model tables are sized for them before training. "
+    "Avoids rehashing the tables while training (and the memory peak it causes).");
+DEFINE_string(save_model, "", "If set, the trained model is frozen (see --frozen_counts) and saved to this file.");
+DEFINE_string(load_model, "", "If set, the model is loaded from a file written with --save_model instead of being "
+    "trained. The same --tgen_program and --is_for_node_type (or --type_tgen_program and --value_tgen_program) "
+    "must be used.");
+DEFINE_string(strings_file, "", "If set, the strings are loaded from this file (written with --save_strings) before "
+    "anything else adds strings, so that separate processes index the strings in the same way.");
+DEFINE_string(save_strings, "", "If set, the TGen program is loaded and --training_data parsed, then the strings are "
+    "saved to this file for --strings_file and nothing else is done.");
+DEFINE_string(count_shard, "", "If set, the raw counts of training on the part of --training_data given by --shard_id "
+    "and --num_shards are written to this file instead of evaluating the model. All shards must be trained with the "
+    "same --strings_file (that has all strings of --training_data); merge_counts sums them into a model for --load_model.");
+DEFINE_int32(num_shards, 1, "Number of parts --training_data is split into, see --shard_id.");
+DEFINE_int32(shard_id, 0, "Only the records of --training_data whose 1-based index modulo --num_shards is --shard_id "
+    "are used for training.");
+DEFINE_string(smoothing_sweep, "", "If set, the counts are trained once and evaluated with each of these comma-separated "
+    "smoothing settings instead of --smoothing_type and --kneser_ney_d. A setting is a smoothing type, optionally "
+    "followed by ':' and a Kneser-Ney delta, e.g. --smoothing_sweep=0,1,1:0.5,1:0.8,2. Prints one table of the metrics.");
+DEFINE_string(pruning_sweep, "", "If set, the counts are trained once without pruning and evaluated after pruning "
+    "them with each of these semicolon-separated settings of --prune_min_counts in turn, e.g. "
+    "--pruning_sweep='1,2;2;2,3'. Every setting must prune at least as much as the one before. Prints one table of "
+    "the pruned pairs by order, the model size and the metrics.");
+DEFINE_int32(sweep_threads, 0, "Threads evaluating each setting of --smoothing_sweep or --pruning_sweep, 0 for one "
+    "per core.");
+DEFINE_string(checkpoint_file, "", "If set, the counts of the training so far are saved to this file every "
+    "--checkpoint_every_trees training trees, so that an interrupted training can be continued with --resume_from. "
+    "The checkpoints are written by a forked process while the training goes on.");
+DEFINE_int32(checkpoint_every_trees, 10000, "Number of training trees between two checkpoints, see --checkpoint_file.");
+DEFINE_string(resume_from, "", "If set, the strings and counts are loaded from a file written with --checkpoint_file "
+    "(instead of --strings_file) and the training continues after the last training tree it covers. The other flags "
+    "and --training_data must be the same as in the interrupted run.");
+DEFINE_string(memory_report, "", "If set, a JSON report of the model memory by program and feature order is written "
+    "to this file once the model is trained or loaded (and frozen with --save_model).");
+DEFINE_string(working_set_report, "", "If set with --load_model and --lazy_model_sections, a JSON report of the "
+    "programs whose model sections the evaluation loaded and how often each was looked up is written to this file.");
+
+// A model trained and evaluated by Eval, with the TGen program it was built from.
+struct EvaluatedModel {
+  EvaluatedModel(const std::string& name, TCondLanguage* lang, const std::string& tgen_file, bool is_for_node_type)
+      : name(name) {
+    TGen::LoadTGen(lang, &tgen_program, tgen_file);
+    model.reset(new TGenModel(tgen_program, is_for_node_type));
+  }
+
+  std::string name;  // Prefix of the printed metrics, empty for a single model.
+  TGenProgram tgen_program;
+  std::unique_ptr<TGenModel> model;
+};
+
+// Written at the start of training checkpoints, followed by a format version.
+static const char kCheckpointMagic[] = "PHOGCKPT";
+static const int kCheckpointVersion = 1;
+
+// Writes the checkpoints of --checkpoint_file: a header with the number of trained trees, the
+// strings and the counts of every model. A checkpoint is written by a forked child process from a
+// copy-on-write snapshot of the models, so the training only stops for the fork. The child writes
+// to a temporary file that replaces the previous checkpoint once it is complete.
+class TrainingCheckpointer {
+public:
+  TrainingCheckpointer() : pid_(-1) {}
+
+  ~TrainingCheckpointer() {
+    Wait();
+  }
+
+  // Must be called when no other thread is running, since only the calling thread is forked.
+  void Write(const StringSet& ss, const std::vector<std::unique_ptr<EvaluatedModel> >& models, uint64 num_trees) {
+    // At most one checkpoint is written at a time.
+    Wait();
+    fflush(nullptr);
+    pid_ = fork();
+    CHECK(pid_ >= 0) << "Could not fork to write a checkpoint";
+    if (pid_ > 0) {
+      LOG(INFO) << "Writing a checkpoint after " << num_trees << " trees in process " << pid_;
+      return;
+    }
+    const std::string temp_file = FLAGS_checkpoint_file + ".tmp";
+    FILE* f = fopen(temp_file.c_str(), "wb");
+    CHECK(f != nullptr) << "Could not open " << temp_file;
+    CHECK_EQ(1, fwrite(kCheckpointMagic, sizeof(kCheckpointMagic), 1, f));
+    CHECK_EQ(1, fwrite(&kCheckpointVersion, sizeof(int), 1, f));
+    CHECK_EQ(1, fwrite(&num_trees, sizeof(uint64), 1, f));
+    ss.saveToFile(f);
+    for (const auto& m : models) {
+      m->model->WriteCheckpointOrDie(ss, f);
+    }
+    CHECK_EQ(0, fclose(f)) << "Could not write " << temp_file;
+    CHECK(rename(temp_file.c_str(), FLAGS_checkpoint_file.c_str()) == 0) << "Could not rename " << temp_file;
+    // Skips the destructors and exit handlers, which belong to the parent.
+    _exit(0);
+  }
+
+  // Waits until the checkpoint being written, if any, is complete.
+  void Wait() {
+    if (pid_ <= 0) return;
+    int status = 0;
+    CHECK(waitpid(pid_, &status, 0) == pid_);
+    LOG_IF(WARNING, !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        << "Writing the checkpoint failed in process " << pid_ << ", " << FLAGS_checkpoint_file << " is unchanged";
+    pid_ = -1;
+  }
+
+private:
+  pid_t pid_;
+};
+
+// Reads the header and the strings of a checkpoint written by TrainingCheckpointer and returns the
+// number of trained trees. The counts follow, one model after the other.
+uint64 ReadCheckpointHeaderOrDie(StringSet* ss, FILE* f) {
+  char magic[sizeof(kCheckpointMagic)];
+  CHECK_EQ(1, fread(magic, sizeof(magic), 1, f));
+  CHECK(memcmp(magic, kCheckpointMagic, sizeof(magic)) == 0) << FLAGS_resume_from << " is not a checkpoint";
+  int version = 0;
+  CHECK_EQ(1, fread(&version, sizeof(int), 1, f));
+  CHECK_EQ(kCheckpointVersion, version) << "Unsupported checkpoint version in " << FLAGS_resume_from;
+  uint64 num_trees = 0;
+  CHECK_EQ(1, fread(&num_trees, sizeof(uint64), 1, f));
+  CHECK(ss->loadFromFile(f)) << "Could not read the strings from " << FLAGS_resume_from;
+  return num_trees;
+}
+
+std::vector<SmoothingParams> ParseSmoothingSweep(const std::string& sweep) {
+  std::vector<SmoothingParams> result;
+  std::vector<std::string> settings;
+  SplitStringUsing(sweep, ',', &settings);
+  for (const std::string& setting : settings) {
+    std::vector<std::string> parts;
+    SplitStringUsing(setting, ':', &parts);
+    int type = -1;
+    double kneser_ney_d = -1;
+    CHECK(!parts.empty() && parts.size() <= 2 && ParseInt32(parts[0], &type) && type >= WittenBell && type <= Laplace &&
+          (parts.size() == 1 || ParseDouble(parts[1], &kneser_ney_d)))
+        << "Invalid setting '" << setting << "' in --smoothing_sweep=" << sweep;
+    result.push_back(SmoothingParams(static_cast<SmoothingTypes>(type), kneser_ney_d));
+  }
+  return result;
+}
+
+// Executes the programs of the models on the evaluation trees, so that the samples can be scored
+// under several settings of the models.
+std::vector<std::vector<TGenModel::ExtractedSample> > ExtractEvaluationSamples(
+    StringSet* ss, const std::vector<TreeStorage>& eval_trees,
+    const std::vector<std::unique_ptr<EvaluatedModel> >& models) {
+  LOG(INFO) << "Extracting the evaluation samples...";
+  std::vector<std::vector<TGenModel::ExtractedSample> > samples(models.size());
+  for (size_t tree_id = 0; tree_id < eval_trees.size(); ++tree_id) {
+    const TreeStorage& tree = eval_trees[tree_id];
+    TCondLanguage::ExecutionForTree exec(ss, &tree);
+    for (unsigned node_id = 0; node_id < tree.NumAllocatedNodes(); ++node_id) {
+      for (size_t i = 0; i < models.size(); ++i) {
+        const TGenModel& model = *models[i]->model;
+        TreeSlice slice(&tree, node_id, !model.is_for_node_type());
+        samples[i].emplace_back();
+        model.ExtractSample(model.start_program_id(), exec, FullTreeTraversal(&tree, node_id), &slice, &samples[i].back());
+      }
+    }
+  }
+  return samples;
+}
+
+// Scores the extracted samples in parallel and returns the metric.
+double ComputeMetricOnSamples(
+    const TGenModel* model, const std::vector<TGenModel::ExtractedSample>& samples, Metric metric, int num_threads) {
+  const size_t num_slices = std::min<size_t>(samples.size(), static_cast<size_t>(num_threads) * 4);
+  std::vector<TGenModelEvaluationMetricComputation> per_slice(num_slices, TGenModelEvaluationMetricComputation(metric));
+  ParallelFor(num_slices, num_threads, [&samples, &per_slice, model, num_slices](size_t slice) {
+    for (size_t j = slice * samples.size() / num_slices; j < (slice + 1) * samples.size() / num_slices; ++j) {
+      per_slice[slice].AddSample(model, samples[j]);
+    }
+  });
+  TGenModelEvaluationMetricComputation total(metric);
+  for (const auto& computation : per_slice) {
+    total.Merge(computation);
+  }
+  return total.GetComputedValue();
+}
+
+// Evaluates the trained models with every smoothing setting. The programs are executed on the
+// evaluation trees once; each setting then only recomputes the smoothing coefficients and scores
+// the extracted samples in parallel.
+void EvalSmoothingSweep(
+    StringSet* ss, const std::vector<TreeStorage>& eval_trees,
+    const std::vector<std::unique_ptr<EvaluatedModel> >& models,
+    const std::vector<Metric>& metrics, const std::vector<std::string>& metric_names) {
+  const std::vector<SmoothingParams> settings = ParseSmoothingSweep(FLAGS_smoothing_sweep);
+  const std::vector<std::vector<TGenModel::ExtractedSample> > samples = ExtractEvaluationSamples(ss, eval_trees, models);
+
+  static const char* const kSmoothingNames[] = { "WittenBell", "KneserNey", "Laplace" };
+  printf("%-12s %8s", "smoothing", "delta");
+  for (const auto& m : models) {
+    for (size_t metric_id = 0; metric_id < metrics.size(); ++metric_id) {
+      printf(" %20s", (m->name + metric_names[metric_id]).c_str());
+    }
+  }
+  printf("\n");
+  const int num_threads = NumThreadsOrDefault(FLAGS_sweep_threads);
+  for (const SmoothingParams& smoothing : settings) {
+    LOG(INFO) << "Evaluating --smoothing_type=" << smoothing.type << " --kneser_ney_d=" << smoothing.kneser_ney_d << "...";
+    if (smoothing.type == KneserNey && smoothing.kneser_ney_d != -1) {
+      printf("%-12s %8.3f", kSmoothingNames[smoothing.type], smoothing.kneser_ney_d);
+    } else {
+      printf("%-12s %8s", kSmoothingNames[smoothing.type], smoothing.type == KneserNey ? "auto" : "-");
+    }
+    for (size_t i = 0; i < models.size(); ++i) {
+      models[i]->model->SetSmoothing(smoothing);
+      for (Metric metric : metrics) {
+        printf(" %20.4f", ComputeMetricOnSamples(models[i]->model.get(), samples[i], metric, num_threads));
+      }
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+}
+
+// The number of pruned pairs of the orders 1, 2, ..., separated by '/'.
+std::string PrunedByOrderString(const std::vector<size_t>& num_pruned) {
+  std::string result;
+  for (size_t order = 1; order < num_pruned.size(); ++order) {
+    if (!result.empty()) result += "/";
+    result += StringPrintf("%zu", num_pruned[order]);
+  }
+  return result.empty() ? "0" : result;
+}
+
+// Evaluates the trained models unpruned and after pruning them with every setting of
+// --pruning_sweep, which trades the size of the model for its accuracy. Every setting prunes the
+// pairs left by the one before, so the pruned pairs and the sizes of a row are those of the model
+// it evaluates.
+void EvalPruningSweep(
+    StringSet* ss, const std::vector<TreeStorage>& eval_trees,
+    const std::vector<std::unique_ptr<EvaluatedModel> >& models,
+    const std::vector<Metric>& metrics, const std::vector<std::string>& metric_names) {
+  std::vector<std::string> settings;
+  SplitStringUsing(FLAGS_pruning_sweep, ';', &settings);
+  std::vector<PruningParams> pruning(1);
+  for (const std::string& setting : settings) {
+    pruning.push_back(PruningParams::Parse(setting));
+    CHECK(pruning[pruning.size() - 2].PrunesAtMost(pruning.back()))
+        << "The setting '" << setting << "' of --pruning_sweep=" << FLAGS_pruning_sweep
+        << " prunes less than the one before";
+  }
+  const std::vector<std::vector<TGenModel::ExtractedSample> > samples = ExtractEvaluationSamples(ss, eval_trees, models);
+
+  printf("%-16s", "min counts");
+  for (const auto& m : models) {
+    printf(" %24s %14s %14s", (m->name + "pruned pairs").c_str(), (m->name + "pairs").c_str(),
+           (m->name + "bytes").c_str());
+    for (size_t metric_id = 0; metric_id < metrics.size(); ++metric_id) {
+      printf(" %20s", (m->name + metric_names[metric_id]).c_str());
+    }
+  }
+  printf("\n");
+  const int num_threads = NumThreadsOrDefault(FLAGS_sweep_threads);
+  for (size_t setting_id = 0; setting_id < pruning.size(); ++setting_id) {
+    const std::string name = setting_id == 0 ? "none" : settings[setting_id - 1];
+    LOG(INFO) << "Evaluating --prune_min_counts=" << name << "...";
+    printf("%-16s", name.c_str());
+    for (size_t i = 0; i < models.size(); ++i) {
+      TGenModel* model = models[i]->model.get();
+      if (setting_id > 0) {
+        model->SetPruning(pruning[setting_id]);
+      }
+      printf(" %24s %14zu %14llu", PrunedByOrderString(model->NumPrunedByOrder()).c_str(), model->NumFeatureValues(),
+             static_cast<unsigned long long>(model->MemoryReport()["total_bytes"].asUInt64()));
+      for (Metric metric : metrics) {
+        printf(" %20.4f", ComputeMetricOnSamples(model, samples[i], metric, num_threads));
+      }
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+}
+
+void WriteJsonFileOrDie(const Json::Value& value, const std::string& file) {
+  FILE* f = fopen(file.c_str(), "w");
+  CHECK(f != nullptr) << "Could not open " << file;
+  const std::string json = Json::StyledWriter().write(value);
+  CHECK_EQ(json.size(), fwrite(json.data(), 1, json.size(), f));
+  CHECK_EQ(0, fclose(f)) << "Could not write " << file;
+}
 
 void Eval() {
   StringSet ss;
+  // Labels in a saved model are indices in the StringSet, so it is saved with the model and loaded
+  // before anything else adds strings to it.
+  FILE* model_file = nullptr;
+  FILE* checkpoint_file = nullptr;
+  // The training trees covered by the checkpoint to resume from.
+  uint64 first_tree = 0;
+  if (!FLAGS_load_model.empty()) {
+    model_file = fopen(FLAGS_load_model.c_str(), "rb");
+    CHECK(model_file != nullptr) << "Could not open " << FLAGS_load_model;
+    CHECK(ss.loadFromFile(model_file)) << "Could not read the strings from " << FLAGS_load_model;
+  } else if (!FLAGS_resume_from.empty()) {
+    checkpoint_file = fopen(FLAGS_resume_from.c_str(), "rb");
+    CHECK(checkpoint_file != nullptr) << "Could not open " << FLAGS_resume_from;
+    first_tree = ReadCheckpointHeaderOrDie(&ss, checkpoint_file);
+  } else if (!FLAGS_strings_file.empty()) {
+    FILE* f = fopen(FLAGS_strings_file.c_str(), "rb");
+    CHECK(f != nullptr) << "Could not open " << FLAGS_strings_file;
+    CHECK(ss.loadFromFile(f)) << "Could not read the strings from " << FLAGS_strings_file;
+    fclose(f);
+  }
+  const int num_loaded_strings = ss.numEntries();
   TCondLanguage lang(&ss);
-  TGenProgram tgen_program;
-  TGen::LoadTGen(&lang, &tgen_program, FLAGS_tgen_program);
+  // With --type_tgen_program and --value_tgen_program both models share the parsed trees and the
+  // per-tree indexes of every pass below. Strings are added to ss in a different order than when the
+  // models are trained separately (see --type_tgen_program).
+  std::vector<std::unique_ptr<EvaluatedModel> > models;
+  if (!FLAGS_type_tgen_program.empty()) {
+    models.emplace_back(new EvaluatedModel("values: ", &lang, FLAGS_value_tgen_program, false));
+    models.emplace_back(new EvaluatedModel("types: ", &lang, FLAGS_type_tgen_program, true));
+  } else {
+    models.emplace_back(new EvaluatedModel("", &lang, FLAGS_tgen_program, FLAGS_is_for_node_type));
+  }
 
   std::vector<TreeStorage> trees, eval_trees;
-  LOG(INFO) << "Loading training data...";
-  ParseTreesInFileWithParallelJSONParse(
-      &ss, FLAGS_training_data.c_str(), 0, FLAGS_num_training_asts, true, &trees);
-  LOG(INFO) << "Training data with " << trees.size() << " trees loaded.";
+  if (model_file == nullptr) {
+    LOG(INFO) << "Loading training data...";
+    ParseTreesInFileWithParallelJSONParse(
+        &ss, FLAGS_training_data.c_str(), 0, FLAGS_num_training_asts, true, &trees, FLAGS_shard_id, FLAGS_num_shards);
+    LOG(INFO) << "Training data with " << trees.size() << " trees loaded.";
+  }
+
+  // Trains on the trees from first_tree on, with checkpoints if a checkpointer is given.
+  const auto add_samples = [&ss, &models](
+      const std::vector<TreeStorage>& trees, size_t first_tree, TrainingCheckpointer* checkpointer) {
+    for (size_t tree_id = first_tree; tree_id < trees.size(); ++tree_id) {
+      const TreeStorage& tree = trees[tree_id];
+      TCondLanguage::ExecutionForTree exec(&ss, &tree);
+      for (unsigned node_id = 0; node_id < tree.NumAllocatedNodes(); ++node_id) {
+        for (const auto& m : models) {
+          m->model->GenerativeTrainOneSample(m->model->start_program_id(), exec, FullTreeTraversal(&tree, node_id));
+        }
+        LOG_EVERY_N(INFO, FLAGS_num_training_asts * 100)
+            << "Training... (logged every " << FLAGS_num_training_asts * 100 << " samples).";
+      }
+      if (checkpointer != nullptr && (tree_id + 1) % FLAGS_checkpoint_every_trees == 0 && tree_id + 1 < trees.size()) {
+        checkpointer->Write(ss, models, tree_id + 1);
+      }
+    }
+  };
+  const auto train = [&add_samples, &models](
+      const std::vector<TreeStorage>& trees, size_t first_tree, TrainingCheckpointer* checkpointer) {
+    add_samples(trees, first_tree, checkpointer);
+    for (const auto& m : models) {
+      m->model->GenerativeEndTraining();
+    }
+  };
+  // Adds the counts of --resume_from to the models, before the training continues with first_tree.
+  const auto resume = [&ss, &models, &trees, num_loaded_strings, first_tree, checkpoint_file]() {
+    if (checkpoint_file == nullptr) return;
+    // The strings of the checkpoint were saved during the training, after parsing all of
+    // --training_data and (unless training a --count_shard) --evaluation_data, so the resumed run
+    // adds no strings to them if its data is the same.
+    CHECK_EQ(num_loaded_strings, ss.numEntries())
+        << "--training_data, --evaluation_data or the TGen program has strings that are not in "
+        << FLAGS_resume_from << "; they must be the same as in the interrupted run";
+    CHECK_LE(first_tree, trees.size()) << FLAGS_resume_from << " covers more trees than --training_data has";
+    for (const auto& m : models) {
+      m->model->ReadCheckpointOrDie(ss, checkpoint_file);
+    }
+    fclose(checkpoint_file);
+    LOG(INFO) << "Resuming the training after " << first_tree << " of " << trees.size() << " trees.";
+  };
+  std::unique_ptr<TrainingCheckpointer> checkpointer;
+  if (!FLAGS_checkpoint_file.empty()) {
+    checkpointer.reset(new TrainingCheckpointer());
+  }
+
+  if (!FLAGS_save_strings.empty()) {
+    FILE* f = fopen(FLAGS_save_strings.c_str(), "wb");
+    CHECK(f != nullptr) << "Could not open " << FLAGS_save_strings;
+    ss.saveToFile(f);
+    fclose(f);
+    LOG(INFO) << ss.numEntries() << " strings saved to " << FLAGS_save_strings;
+    return;
+  }
+  if (!FLAGS_count_shard.empty()) {
+    // New strings would get different indices in every shard.
+    CHECK_EQ(num_loaded_strings, ss.numEntries())
+        << "--training_data or the TGen program has strings that are not in --strings_file";
+    LOG(INFO) << "Training shard " << FLAGS_shard_id << " of " << FLAGS_num_shards << "...";
+    resume();
+    add_samples(trees, first_tree, checkpointer.get());
+    FILE* f = fopen(FLAGS_count_shard.c_str(), "wb");
+    CHECK(f != nullptr) << "Could not open " << FLAGS_count_shard;
+    models[0]->model->WriteCountShardOrDie(ss, f);
+    CHECK_EQ(0, fclose(f)) << "Could not write " << FLAGS_count_shard;
+    LOG(INFO) << "Counts saved to " << FLAGS_count_shard;
+    return;
+  }
 
   LOG(INFO) << "Loading evaluation data...";
   ParseTreesInFileWithParallelJSONParse(
       &ss, FLAGS_evaluation_data.c_str(), 0, FLAGS_num_eval_asts, true, &eval_trees);
   LOG(INFO) << "Evaluation data with " << eval_trees.size() << " trees loaded.";
 
-  LOG(INFO) << "Training...";
-  TGenModel model(tgen_program, FLAGS_is_for_node_type);
-  for (size_t tree_id = 0; tree_id < trees.size(); ++tree_id) {
-    const TreeStorage& tree = trees[tree_id];
-    TCondLanguage::ExecutionForTree exec(&ss, &tree);
-    for (unsigned node_id = 0; node_id < tree.NumAllocatedNodes(); ++node_id) {
-      model.GenerativeTrainOneSample(model.start_program_id(), exec, FullTreeTraversal(&tree, node_id));
-      LOG_EVERY_N(INFO, FLAGS_num_training_asts * 100)
-          << "Training... (logged every " << FLAGS_num_training_asts * 100 << " samples).";
+  if (model_file != nullptr) {
+    LOG(INFO) << "Loading the model...";
+    for (const auto& m : models) {
+      m->model->ReadFromFileOrDie(model_file);
+    }
+    fclose(model_file);
+    LOG(INFO) << "Model loaded.";
+  } else {
+    if (FLAGS_presize_sample_rate > 0 && !trees.empty()) {
+      LOG(INFO) << "Estimating the model size...";
+      const size_t step = std::max<size_t>(1, lround(1 / std::min(1.0, FLAGS_presize_sample_rate)));
+      size_t num_sampled = 0;
+      for (size_t tree_id = 0; tree_id < trees.size(); tree_id += step) {
+        const TreeStorage& tree = trees[tree_id];
+        TCondLanguage::ExecutionForTree exec(&ss, &tree);
+        for (unsigned node_id = 0; node_id < tree.NumAllocatedNodes(); ++node_id) {
+          for (const auto& m : models) {
+            m->model->PresizingOneSample(m->model->start_program_id(), exec, FullTreeTraversal(&tree, node_id),
+                                         num_sampled % 2);
+          }
+        }
+        num_sampled++;
+      }
+      for (const auto& m : models) {
+        m->model->EndPresizing(static_cast<double>(trees.size()) / num_sampled);
+      }
+    }
+    resume();
+    LOG(INFO) << "Training...";
+    train(trees, first_tree, checkpointer.get());
+    LOG(INFO) << "Training done.";
+  }
+
+  if (!FLAGS_incremental_training_data.empty()) {
+    std::vector<TreeStorage> incremental_trees;
+    ParseTreesInFileWithParallelJSONParse(
+        &ss, FLAGS_incremental_training_data.c_str(), 0, FLAGS_num_training_asts, true, &incremental_trees);
+    LOG(INFO) << "Adding " << incremental_trees.size() << " trees to the trained model...";
+    int64 start_time = GetCurrentTimeMicros();
+    train(incremental_trees, 0, nullptr);
+    LOG(INFO) << "Incremental training done in " << (GetCurrentTimeMicros() - start_time) / 1000 << "ms.";
+  }
+
+  if (!FLAGS_save_model.empty()) {
+    FILE* f = fopen(FLAGS_save_model.c_str(), "wb");
+    CHECK(f != nullptr) << "Could not open " << FLAGS_save_model;
+    ss.saveToFile(f);
+    for (const auto& m : models) {
+      m->model->Freeze();
+      m->model->WriteToFileOrDie(f);
     }
+    fclose(f);
+    LOG(INFO) << "Model saved to " << FLAGS_save_model;
+  }
+
+  if (!FLAGS_memory_report.empty()) {
+    Json::Value report(Json::objectValue);
+    for (const auto& m : models) {
+      report[m->model->is_for_node_type() ? "types" : "values"] = m->model->MemoryReport();
+    }
+    WriteJsonFileOrDie(report, FLAGS_memory_report);
+    LOG(INFO) << "Memory report written to " << FLAGS_memory_report;
   }
-  model.GenerativeEndTraining();
-  LOG(INFO) << "Training done.";
 
   std::vector<Metric> metrics{ Metric::ERROR_RATE };  // , Metric::ENTROPY, Metric::CONFIDENCE50 };
   std::vector<std::string> metric_names{ "error rate", "entropy", "confidence >50%" };
 
-  for (size_t metric_id = 0; metric_id < metrics.size(); ++metric_id) {
-    TGenModelEvaluationMetricComputation metric(metrics[metric_id]);
-    LOG(INFO) << "Evaluating " << metric_names[metric_id] << "...";
-    for (size_t tree_id = 0; tree_id < eval_trees.size(); ++tree_id) {
-      const TreeStorage& tree = eval_trees[tree_id];
-      TCondLanguage::ExecutionForTree exec(&ss, &tree);
-      for (unsigned node_id = 0; node_id < tree.NumAllocatedNodes(); ++node_id) {
-        metric.AddSample(&model, exec, node_id);
+  if (!FLAGS_smoothing_sweep.empty()) {
+    EvalSmoothingSweep(&ss, eval_trees, models, metrics, metric_names);
+  } else if (!FLAGS_pruning_sweep.empty()) {
+    EvalPruningSweep(&ss, eval_trees, models, metrics, metric_names);
+  } else {
+    for (size_t metric_id = 0; metric_id < metrics.size(); ++metric_id) {
+      std::vector<TGenModelEvaluationMetricComputation> metric(models.size(), TGenModelEvaluationMetricComputation(metrics[metric_id]));
+      LOG(INFO) << "Evaluating " << metric_names[metric_id] << "...";
+      for (size_t tree_id = 0; tree_id < eval_trees.size(); ++tree_id) {
+        const TreeStorage& tree = eval_trees[tree_id];
+        TCondLanguage::ExecutionForTree exec(&ss, &tree);
+        for (unsigned node_id = 0; node_id < tree.NumAllocatedNodes(); ++node_id) {
+          for (size_t i = 0; i < models.size(); ++i) {
+            metric[i].AddSample(models[i]->model.get(), exec, node_id);
+          }
+        }
+      }
+      LOG(INFO) << "Evaluation " << metric_names[metric_id] << " done.";
+      for (size_t i = 0; i < models.size(); ++i) {
+        printf("%s%s = %.4f\n", models[i]->name.c_str(), metric_names[metric_id].c_str(), metric[i].GetComputedValue());
+      }
+    }
+  }
+  if (!FLAGS_working_set_report.empty()) {
+    Json::Value report(Json::objectValue);
+    for (const auto& m : models) {
+      report[m->model->is_for_node_type() ? "types" : "values"] = m->model->WorkingSetReport();
+    }
+    WriteJsonFileOrDie(report, FLAGS_working_set_report);
+    LOG(INFO) << "Working set report written to " << FLAGS_working_set_report;
+  }
+  // Model size, to compare the metrics under different --prune_min_counts settings (see also
+  // --pruning_sweep).
+  if (FLAGS_pruning_sweep.empty()) {
+    for (const auto& m : models) {
+      printf("%sfeature values = %zu\n", m->name.c_str(), m->model->NumFeatureValues());
+      if (!FLAGS_prune_min_counts.empty()) {
+        printf("%spruned pairs by order = %s\n", m->name.c_str(), PrunedByOrderString(m->model->NumPrunedByOrder()).c_str());
       }
     }
-    LOG(INFO) << "Evaluation " << metric_names[metric_id] << " done.";
-    printf("%s = %.4f\n", metric_names[metric_id].c_str(), metric.GetComputedValue());
   }
 
   LOG(INFO) << "Done.";
@@ -97,9 +574,34 @@ int main(int argc, char** argv) {
   google::InstallFailureSignalHandler();
   google::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
-  CHECK(!FLAGS_training_data.empty()) << "--training_data is a required parameter.";
-  CHECK(!FLAGS_evaluation_data.empty()) << "--evaluation_data is a required parameter.";
-  CHECK(!FLAGS_tgen_program.empty()) << "--tgen_program is a required parameter.";
+  CHECK(!FLAGS_training_data.empty() || !FLAGS_load_model.empty())
+      << "--training_data is a required parameter unless --load_model is given.";
+  CHECK(!FLAGS_evaluation_data.empty() || !FLAGS_save_strings.empty() || !FLAGS_count_shard.empty())
+      << "--evaluation_data is a required parameter unless --save_strings or --count_shard is given.";
+  CHECK(FLAGS_type_tgen_program.empty() == FLAGS_value_tgen_program.empty())
+      << "--type_tgen_program and --value_tgen_program must be given together.";
+  CHECK(FLAGS_count_shard.empty() ||
+        (FLAGS_type_tgen_program.empty() && (!FLAGS_strings_file.empty() || !FLAGS_resume_from.empty())))
+      << "--count_shard needs --strings_file and a single --tgen_program.";
+  CHECK(FLAGS_resume_from.empty() || (FLAGS_load_model.empty() && FLAGS_strings_file.empty()))
+      << "--resume_from cannot be combined with --load_model or --strings_file.";
+  CHECK((FLAGS_checkpoint_file.empty() && FLAGS_resume_from.empty()) || (FLAGS_spill_dir.empty() && FLAGS_count_sketch_mb == 0))
+      << "--checkpoint_file and --resume_from are not available with --spill_dir or --count_sketch_mb.";
+  CHECK_GT(FLAGS_checkpoint_every_trees, 0);
+  CHECK(FLAGS_working_set_report.empty() || (!FLAGS_load_model.empty() && FLAGS_lazy_model_sections))
+      << "--working_set_report needs --load_model and --lazy_model_sections.";
+  CHECK(FLAGS_smoothing_sweep.empty() ||
+        (FLAGS_load_model.empty() && FLAGS_save_model.empty() && !FLAGS_frozen_counts && !FLAGS_compact_counts))
+      << "--smoothing_sweep needs a trained model that is not frozen or compacted, it cannot be saved or loaded "
+      << "and cannot be used with --frozen_counts or --compact_counts.";
+  CHECK(FLAGS_pruning_sweep.empty() ||
+        (FLAGS_smoothing_sweep.empty() && FLAGS_prune_min_counts.empty() && FLAGS_load_model.empty() &&
+         FLAGS_save_model.empty() && !FLAGS_frozen_counts && !FLAGS_compact_counts && FLAGS_spill_dir.empty()))
+      << "--pruning_sweep needs a trained model that is not pruned, frozen or compacted, it cannot be saved or "
+      << "loaded and cannot be used with --smoothing_sweep, --prune_min_counts, --frozen_counts, --compact_counts "
+      << "or --spill_dir.";
+  CHECK(!FLAGS_tgen_program.empty() || !FLAGS_type_tgen_program.empty())
+      << "--tgen_program is a required parameter unless --type_tgen_program and --value_tgen_program are given.";
   Eval();
   return 0;
 }
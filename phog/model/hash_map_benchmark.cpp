@@ -0,0 +1,228 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+// Compares the hash maps usable for the model tables (see PHOG_SWISS_TABLE in pbox.h) on the
+// features of a real model: the keys of a model trained on --training_data are looked up with the
+// keys of the same program on --evaluation_data, which gives the hits and misses of evaluation.
+// Also reports how many feature lookups a Bloom filter with --filter_bits_per_key avoids.
+
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "base/base.h"
+#include "base/bloom_filter.h"
+#include "base/flat_hash_map.h"
+#include "base/readerutil.h"
+#include "base/sparsehash/dense_hash_map.h"
+#include "base/stringset.h"
+
+#include "phog/dsl/tcond_language.h"
+#include "phog/dsl/tgen_program.h"
+#include "phog/model/model.h"
+
+DEFINE_int32(num_training_asts, 100000, "Maximun number of training ASTs to load.");
+DEFINE_int32(num_eval_asts, 50000, "Maximun number of evaluation ASTs to load.");
+DEFINE_string(training_data, "", "A file with the training data.");
+DEFINE_string(evaluation_data, "", "A file with the evaluation data.");
+DEFINE_string(tgen_program, "", "A file with a TGen program.");
+DEFINE_bool(is_for_node_type, false, "Whether the predictions are for node type (if false it is for node value).");
+DEFINE_int32(repetitions, 10, "Number of times all lookups are repeated.");
+DEFINE_int32(filter_bits_per_key, 10, "Bits per feature of the benchmarked feature filter.");
+
+typedef TGenModel::Feature Feature;
+typedef std::pair<Feature, int> FeatureValue;
+
+template<> struct empty_key<FeatureValue> {
+  FeatureValue operator()() const { return FeatureValue(empty_key<Feature>()(), empty_key<int>()()); }
+};
+
+template<> struct deleted_key<FeatureValue> {
+  FeatureValue operator()() const { return FeatureValue(deleted_key<Feature>()(), deleted_key<int>()()); }
+};
+
+// A lookup in the table of a program.
+template<class Key>
+struct Query {
+  int program_id;
+  Key key;
+};
+
+template<class Key, class Map>
+struct MapInit {
+  static void Init(Map*) {}
+};
+
+template<class Key>
+struct MapInit<Key, google::dense_hash_map<Key, int, std::hash<Key> > > {
+  static void Init(google::dense_hash_map<Key, int, std::hash<Key> >* map) {
+    map->set_empty_key(empty_key<Key>()());
+    map->set_deleted_key(deleted_key<Key>()());
+  }
+};
+
+// Builds one map per program from the training keys and prints the time per lookup of the hits
+// and misses.
+template<class Key, class Map>
+void Benchmark(const char* name, size_t num_programs,
+    const std::vector<Query<Key> >& keys, const std::vector<Query<Key> >& queries) {
+  std::vector<Map> maps(num_programs);
+  for (Map& map : maps) {
+    MapInit<Key, Map>::Init(&map);
+  }
+  int64 start_time = GetCurrentTimeMicros();
+  for (const Query<Key>& key : keys) {
+    maps[key.program_id][key.key] = 1;
+  }
+  int64 build_time = GetCurrentTimeMicros() - start_time;
+
+  std::vector<Query<Key> > hits, misses;
+  for (const Query<Key>& query : queries) {
+    const Map& map = maps[query.program_id];
+    (map.find(query.key) != map.end() ? hits : misses).push_back(query);
+  }
+
+  int64 found = 0;
+  const auto time_lookups = [&maps, &found](const std::vector<Query<Key> >& lookups) -> double {
+    int64 start_time = GetCurrentTimeMicros();
+    for (int repetition = 0; repetition < FLAGS_repetitions; ++repetition) {
+      for (const Query<Key>& query : lookups) {
+        const Map& map = maps[query.program_id];
+        found += map.find(query.key) != map.end();
+      }
+    }
+    return lookups.empty() ? 0.0 :
+        1000.0 * (GetCurrentTimeMicros() - start_time) / (static_cast<double>(lookups.size()) * FLAGS_repetitions);
+  };
+  double hit_ns = time_lookups(hits);
+  double miss_ns = time_lookups(misses);
+  printf("%-24s build %7.1f ms   hit %6.1f ns (%zu)   miss %6.1f ns (%zu)\n",
+      name, build_time / 1000.0, hit_ns, hits.size(), miss_ns, misses.size());
+  CHECK_EQ(found, static_cast<int64>(hits.size()) * FLAGS_repetitions);
+}
+
+// Builds a feature filter per program and prints the share of the missing features it rejects and
+// the time per lookup of the hits and misses with and without the filter in front of the table.
+void BenchmarkFeatureFilter(size_t num_programs,
+    const std::vector<Query<Feature> >& keys, const std::vector<Query<Feature> >& queries) {
+  std::vector<size_t> num_keys(num_programs, 0);
+  for (const Query<Feature>& key : keys) {
+    num_keys[key.program_id]++;
+  }
+  std::vector<FeatureHashMap<Feature, int> > maps(num_programs);
+  std::vector<BlockedBloomFilter> filters(num_programs);
+  size_t filter_bytes = 0;
+  for (size_t i = 0; i < num_programs; ++i) {
+    filters[i].Init(num_keys[i], FLAGS_filter_bits_per_key);
+    filter_bytes += filters[i].MemoryBytes();
+  }
+  for (const Query<Feature>& key : keys) {
+    maps[key.program_id][key.key] = 1;
+    filters[key.program_id].Add(std::hash<Feature>()(key.key));
+  }
+
+  std::vector<Query<Feature> > hits, misses;
+  size_t num_rejected = 0;
+  for (const Query<Feature>& query : queries) {
+    const bool found = maps[query.program_id].count(query.key) != 0;
+    const bool may_contain = filters[query.program_id].MayContain(std::hash<Feature>()(query.key));
+    CHECK(may_contain || !found) << "The filter rejected a feature of the model";
+    (found ? hits : misses).push_back(query);
+    if (!may_contain) num_rejected++;
+  }
+
+  int64 found = 0;
+  const auto time_lookups = [&maps, &filters, &found](const std::vector<Query<Feature> >& lookups, bool use_filter) -> double {
+    int64 start_time = GetCurrentTimeMicros();
+    for (int repetition = 0; repetition < FLAGS_repetitions; ++repetition) {
+      for (const Query<Feature>& query : lookups) {
+        if (use_filter && !filters[query.program_id].MayContain(std::hash<Feature>()(query.key))) continue;
+        const auto& map = maps[query.program_id];
+        found += map.find(query.key) != map.end();
+      }
+    }
+    return lookups.empty() ? 0.0 :
+        1000.0 * (GetCurrentTimeMicros() - start_time) / (static_cast<double>(lookups.size()) * FLAGS_repetitions);
+  };
+  const double hit_ns = time_lookups(hits, false), filtered_hit_ns = time_lookups(hits, true);
+  const double miss_ns = time_lookups(misses, false), filtered_miss_ns = time_lookups(misses, true);
+  printf("Feature filter (%d bits/key, %.1f KB): %zu of %zu missing feature lookups avoided (%.2f%%)\n",
+      FLAGS_filter_bits_per_key, filter_bytes / 1024.0, num_rejected, misses.size(),
+      misses.empty() ? 0.0 : 100.0 * num_rejected / misses.size());
+  printf("  hit %6.1f -> %6.1f ns   miss %6.1f -> %6.1f ns\n", hit_ns, filtered_hit_ns, miss_ns, filtered_miss_ns);
+  CHECK_EQ(found, static_cast<int64>(hits.size()) * FLAGS_repetitions * 2);
+}
+
+// Trains a model on the trees and returns the keys of its features and feature values.
+void CollectKeys(const StringSet* ss, const TGenProgram& tgen_program, const std::vector<TreeStorage>& trees,
+    std::vector<Query<Feature> >* features, std::vector<Query<FeatureValue> >* feature_values) {
+  TGenModel model(tgen_program, FLAGS_is_for_node_type);
+  for (const TreeStorage& tree : trees) {
+    TCondLanguage::ExecutionForTree exec(ss, &tree);
+    for (unsigned node_id = 0; node_id < tree.NumAllocatedNodes(); ++node_id) {
+      model.GenerativeTrainOneSample(model.start_program_id(), exec, FullTreeTraversal(&tree, node_id));
+    }
+  }
+  std::vector<std::unordered_map<Feature, int> > seen(tgen_program.size());
+  model.ForEachFeatureValue([features, feature_values, &seen](int program_id, const Feature& f, int label, int) {
+    if (seen[program_id].insert(std::make_pair(f, 0)).second) {
+      features->push_back(Query<Feature>{program_id, f});
+    }
+    feature_values->push_back(Query<FeatureValue>{program_id, FeatureValue(f, label)});
+  });
+}
+
+template<class Key>
+void RunBenchmarks(const char* key_name, size_t num_programs,
+    std::vector<Query<Key> >* keys, std::vector<Query<Key> >* queries) {
+  std::mt19937 random(1);
+  std::shuffle(keys->begin(), keys->end(), random);
+  std::shuffle(queries->begin(), queries->end(), random);
+  printf("%s: %zu keys, %zu queries\n", key_name, keys->size(), queries->size());
+  Benchmark<Key, std::unordered_map<Key, int> >("  std::unordered_map", num_programs, *keys, *queries);
+  Benchmark<Key, google::dense_hash_map<Key, int, std::hash<Key> > >("  google::dense_hash_map", num_programs, *keys, *queries);
+  Benchmark<Key, FlatHashMap<Key, int> >("  FlatHashMap", num_programs, *keys, *queries);
+}
+
+int main(int argc, char** argv) {
+  google::InstallFailureSignalHandler();
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  CHECK(!FLAGS_training_data.empty()) << "--training_data is a required parameter.";
+  CHECK(!FLAGS_evaluation_data.empty()) << "--evaluation_data is a required parameter.";
+  CHECK(!FLAGS_tgen_program.empty()) << "--tgen_program is a required parameter.";
+
+  StringSet ss;
+  TCondLanguage lang(&ss);
+  TGenProgram tgen_program;
+  TGen::LoadTGen(&lang, &tgen_program, FLAGS_tgen_program);
+  std::vector<TreeStorage> trees, eval_trees;
+  ParseTreesInFileWithParallelJSONParse(&ss, FLAGS_training_data.c_str(), 0, FLAGS_num_training_asts, true, &trees);
+  ParseTreesInFileWithParallelJSONParse(&ss, FLAGS_evaluation_data.c_str(), 0, FLAGS_num_eval_asts, true, &eval_trees);
+
+  std::vector<Query<Feature> > features, eval_features;
+  std::vector<Query<FeatureValue> > feature_values, eval_feature_values;
+  CollectKeys(&ss, tgen_program, trees, &features, &feature_values);
+  CollectKeys(&ss, tgen_program, eval_trees, &eval_features, &eval_feature_values);
+
+  RunBenchmarks("Features", tgen_program.size(), &features, &eval_features);
+  RunBenchmarks("Feature values", tgen_program.size(), &feature_values, &eval_feature_values);
+  BenchmarkFeatureFilter(tgen_program.size(), features, eval_features);
+  return 0;
+}
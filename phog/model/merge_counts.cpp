@@ -0,0 +1,74 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+// Sums the count shards written by evaluate --count_shard into a model for evaluate --load_model:
+//
+//   evaluate --save_strings=strings --training_data=train.json --tgen_program=p.tgen
+//   evaluate --strings_file=strings --count_shard=shard0 --shard_id=0 --num_shards=2 ...   (and shard 1)
+//   merge_counts --strings_file=strings --tgen_program=p.tgen --output=model shard0 shard1
+//
+// The shards are merged as a stream, so they do not have to fit in memory together.
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "base/base.h"
+#include "base/stringset.h"
+
+#include "phog/dsl/tcond_language.h"
+#include "phog/dsl/tgen_program.h"
+#include "phog/model/model.h"
+
+DEFINE_string(strings_file, "", "The strings the shards were trained with (see evaluate --save_strings).");
+DEFINE_string(tgen_program, "", "The TGen program the shards were trained with.");
+DEFINE_bool(is_for_node_type, false, "Whether the predictions are for node type (if false it is for node value).");
+DEFINE_string(output, "", "The merged model is saved to this file, as with evaluate --save_model.");
+
+int main(int argc, char** argv) {
+  google::InstallFailureSignalHandler();
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  CHECK(!FLAGS_strings_file.empty()) << "--strings_file is a required parameter.";
+  CHECK(!FLAGS_tgen_program.empty()) << "--tgen_program is a required parameter.";
+  CHECK(!FLAGS_output.empty()) << "--output is a required parameter.";
+  CHECK_GT(argc, 1) << "No count shards given.";
+  const std::vector<std::string> shard_files(argv + 1, argv + argc);
+
+  StringSet ss;
+  FILE* f = fopen(FLAGS_strings_file.c_str(), "rb");
+  CHECK(f != nullptr) << "Could not open " << FLAGS_strings_file;
+  CHECK(ss.loadFromFile(f)) << "Could not read the strings from " << FLAGS_strings_file;
+  fclose(f);
+  TCondLanguage lang(&ss);
+  TGenProgram tgen_program;
+  TGen::LoadTGen(&lang, &tgen_program, FLAGS_tgen_program);
+
+  TGenModel model(tgen_program, FLAGS_is_for_node_type);
+  model.MergeCountShardsOrDie(ss, shard_files);
+  LOG(INFO) << "Merged model with " << model.NumFeatureValues() << " feature values.";
+
+  f = fopen(FLAGS_output.c_str(), "wb");
+  CHECK(f != nullptr) << "Could not open " << FLAGS_output;
+  ss.saveToFile(f);
+  model.WriteToFileOrDie(f);
+  CHECK_EQ(0, fclose(f)) << "Could not write " << FLAGS_output;
+  LOG(INFO) << "Model saved to " << FLAGS_output;
+  return 0;
+}
@@ -17,10 +17,28 @@
 
 #include "model.h"
 
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
 #include "glog/logging.h"
 
+#include "base/huge_pages.h"
+#include "base/parallel.h"
+#include "base/stringprintf.h"
+
 DEFINE_bool(enable_teq, true, "Enable using TEq programs");
 DEFINE_int32(beam_size, 4, "Number of best labels to try at each model order.");
+DEFINE_string(spill_dir, "", "If set, training counts are not kept in memory but sorted externally: they are "
+    "buffered, spilled to sorted run files in this directory and merged at the end of training straight into a "
+    "frozen model (see --frozen_counts). Bounds the training memory for corpora that do not fit in RAM.");
+DEFINE_int32(spill_buffer_mb, 256, "Size of the buffer for training counts with --spill_dir.");
+DEFINE_bool(lazy_model_sections, false, "Load the counter of a program from the model file only when it is first "
+    "looked up, instead of loading the whole model up front.");
+DEFINE_int32(feature_collision_audit_sampling, 0,
+    "If positive, records the full value sequences of one in N feature fingerprints during training and reports "
+    "the fingerprint collision rate.");
 
 const int TEQ_LABEL_INDEX_START = -10;
 const int TEQ_MAX_LABEL_INDEX = 10;
@@ -80,6 +98,37 @@ void TGenModelEvaluationMetricComputation::AddSample(
   }
 }
 
+void TGenModelEvaluationMetricComputation::AddSample(
+    const TGenModel* model, const TGenModel::ExtractedSample& sample) {
+  ++num_samples_;
+  switch (metric_) {
+  case Metric::ENTROPY:
+    value_ -= model->GetLabelLogProb(sample);
+    break;
+
+  case Metric::ERROR_RATE:
+    if (!model->IsLabelBestPrediction(sample)) {
+      value_ = value_ + 1;
+    }
+    break;
+
+  case Metric::CONFIDENCE50:
+    if (model->GetLabelLogProb(sample) <= -1) {
+      value_ = value_ + 1;
+    }
+    break;
+
+  case Metric::DEFAULT:
+    LOG(FATAL) << "Unresolved evaluation metric.";
+  }
+}
+
+void TGenModelEvaluationMetricComputation::Merge(const TGenModelEvaluationMetricComputation& o) {
+  CHECK(metric_ == o.metric_);
+  value_ += o.value_;
+  num_samples_ += o.num_samples_;
+}
+
 double TGenModelEvaluationMetricComputation::GetComputedValue() const {
   switch (metric_) {
   case Metric::ENTROPY:
@@ -93,17 +142,69 @@ double TGenModelEvaluationMetricComputation::GetComputedValue() const {
 }
 
 
-TGenModel::TGenModel(const TGenProgram& program, bool is_for_node_type)
-    : program_(program), is_for_node_type_(is_for_node_type), counts_(program.size()) {
+FeatureCollisionAudit::FeatureCollisionAudit(int num_programs, int sampling_rate)
+    : sampling_rate_(sampling_rate), per_program_(num_programs), num_collided_(0) {
+  CHECK_GT(sampling_rate_, 0);
+}
+
+void FeatureCollisionAudit::Record(int program_id, const Feature& f, const std::vector<int>& sequence) {
+  auto inserted = per_program_[program_id].insert(std::make_pair(f, Entry()));
+  Entry& entry = inserted.first->second;
+  if (inserted.second) {
+    entry.sequence = sequence;
+    entry.collided = false;
+  } else if (!entry.collided && entry.sequence != sequence) {
+    entry.collided = true;
+    ++num_collided_;
+  }
+}
+
+int64 FeatureCollisionAudit::NumSampled() const {
+  int64 result = 0;
+  for (const auto& features : per_program_) {
+    result += features.size();
+  }
+  return result;
+}
+
+std::string FeatureCollisionAudit::Report() const {
+  int64 sampled = NumSampled();
+  return StringPrintf("%lld of %lld sampled feature fingerprints (1 in %d) collide (%.6f%%).",
+      num_collided_, sampled, sampling_rate_, sampled == 0 ? 0.0 : 100.0 * num_collided_ / sampled);
+}
+
+
+TGenModel::TGenModel(const TGenProgram& program, bool is_for_node_type, const SmoothingParams& smoothing)
+    : program_(program), is_for_node_type_(is_for_node_type), smoothing_(smoothing), counts_(program.size()) {
+  const SketchParams sketch = SketchParams::FromFlags(counts_.size());
+  const PruningParams pruning = PruningParams::FromFlags();
+  const StorageParams storage = StorageParams::FromFlags();
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    counts_[i].set_smoothing(smoothing_);
+    counts_[i].set_sketch(sketch);
+    counts_[i].set_pruning(pruning);
+    counts_[i].set_storage(storage);
+  }
+  if (!FLAGS_spill_dir.empty()) {
+    spilled_counts_.reset(new SpilledCounts(FLAGS_spill_dir, static_cast<size_t>(FLAGS_spill_buffer_mb) << 20));
+  }
+  if (FLAGS_feature_collision_audit_sampling > 0) {
+    collision_audit_.reset(new FeatureCollisionAudit(program.size(), FLAGS_feature_collision_audit_sampling));
+  }
 }
 
 TGenModel::~TGenModel() {
+  if (lazy_sections_ != nullptr) {
+    close(lazy_sections_->fd);
+  }
 }
 
-void TGenModel::GenerativeTrainOneSample(
+template<class Callback>
+void TGenModel::ForEachTrainingFeature(
     int program_id,
     const TCondLanguage::ExecutionForTree& exec,
-    FullTreeTraversal sample) {
+    FullTreeTraversal sample,
+    const Callback& cb) {
 
   TreeSlice slice(sample.tree_storage(), sample.position(), !is_for_node_type_);
 
@@ -118,20 +219,92 @@ void TGenModel::GenerativeTrainOneSample(
 
   Feature f;
   // Record unconditioned feature:
-  counts_[program_id].AddValue(f, label, 1);
+  cb(program_id, label, f, 0);
   // Use conditioned features:
   SlicedTreeTraversal traversal(sample.tree_storage(), sample.position(), &slice);
   ExecuteContextProgramByIdInAll(
       &exec,
       &traversal, nullptr,
       program_id, &program_,
-      [this, label, program_id, &f](int op_added)->bool {
+      [label, program_id, &f, &cb](int op_added)->bool {
     f.PushBack(op_added);
-    counts_[program_id].AddValue(f, label, 1);
+    cb(program_id, label, f, op_added);
     return true;
   });
 }
 
+void TGenModel::GenerativeTrainOneSample(
+    int program_id,
+    const TCondLanguage::ExecutionForTree& exec,
+    FullTreeTraversal sample) {
+  thread_local std::vector<int> sequence;
+  sequence.clear();
+  ForEachTrainingFeature(program_id, exec, sample,
+      [this](int program_id, int label, const Feature& f, int op_added) {
+    AddTrainingCount(program_id, f, label);
+    if (collision_audit_ != nullptr && f.size() > 0) {
+      sequence.push_back(op_added);
+      if (collision_audit_->IsSampled(f)) {
+        collision_audit_->Record(program_id, f, sequence);
+      }
+    }
+  });
+}
+
+void TGenModel::PresizingOneSample(
+    int program_id,
+    const TCondLanguage::ExecutionForTree& exec,
+    FullTreeTraversal sample,
+    int part) {
+  CHECK(part == 0 || part == 1);
+  if (presizing_.empty()) {
+    presizing_.resize(counts_.size());
+  }
+  ForEachTrainingFeature(program_id, exec, sample,
+      [this, part](int program_id, int label, const Feature& f, int) {
+    const uint64 feature_hash = std::hash<Feature>()(f);
+    presizing_[program_id].features[part].Add(feature_hash);
+    presizing_[program_id].feature_values[part].Add(FingerprintCat64(feature_hash, label));
+  });
+}
+
+// Extrapolates the number of distinct keys in scale times the data of two halves of a sample. The
+// number of distinct features grows sublinearly with the data (Heaps' law, d(n) = k * n^beta), so
+// beta is fitted to the growth from one half to both and the estimate is
+// d(sample) * scale^beta. It is at most the linear d(sample) * scale.
+static size_t ExtrapolateDistinct(const HyperLogLog* halves, double scale) {
+  HyperLogLog sample = halves[0];
+  sample.Merge(halves[1]);
+  const double distinct = sample.Estimate();
+  const double half_distinct = (halves[0].Estimate() + halves[1].Estimate()) / 2;
+  double beta = 1;
+  if (half_distinct > 0 && distinct > half_distinct) {
+    beta = std::min(1.0, log2(distinct / half_distinct));
+  } else if (half_distinct > 0) {
+    beta = 0;
+  }
+  return static_cast<size_t>(std::min(distinct * pow(scale, beta), distinct * scale));
+}
+
+void TGenModel::EndPresizing(double scale) {
+  if (spilled_counts_ != nullptr) {
+    // The counts are not kept in memory.
+    std::vector<PresizingSketches>().swap(presizing_);
+    return;
+  }
+  double num_features = 0, num_feature_values = 0;
+  for (size_t i = 0; i < presizing_.size(); ++i) {
+    const size_t features = ExtrapolateDistinct(presizing_[i].features, scale);
+    const size_t feature_values = ExtrapolateDistinct(presizing_[i].feature_values, scale);
+    counts_[i].Presize(feature_values, features);
+    num_features += features;
+    num_feature_values += feature_values;
+  }
+  LOG(INFO) << "Presized the counts for an estimated " << static_cast<size_t>(num_feature_values)
+            << " feature values of " << static_cast<size_t>(num_features) << " features.";
+  std::vector<PresizingSketches>().swap(presizing_);
+}
+
 int TGenModel::GetLabelAtPosition(
     int program_id,
     const TCondLanguage::ExecutionForTree& exec,
@@ -172,12 +345,533 @@ int TGenModel::GetLabelAtPosition(
 }
 
 
+void TGenModel::AddTrainingCount(int program_id, const Feature& f, int label) {
+  if (spilled_counts_ == nullptr) {
+    counts_[program_id].AddValue(f, label, 1);
+    return;
+  }
+  // Value-initialized, so that the padding written to the runs is zero.
+  SpilledCount count = SpilledCount();
+  count.program_id = program_id;
+  count.label = label;
+  count.feature = f;
+  count.count = 1;
+  spilled_counts_->Add(count);
+}
+
+// Counters with fewer pairs are not worth splitting across threads.
+static const size_t kMinFeatureValuesForParallelEndAdding = 1 << 16;
+
+void TGenModel::EndTrainingWithSortedCounts(SpilledCounts* counts, int num_threads) {
+  // The merged counts come grouped by program, so each counter is finished as soon as the
+  // counts of the next program start and only one counter holds unfrozen stats at a time.
+  int program_id = -1;
+  counts->Merge([this, &program_id, num_threads](const SpilledCount& count) {
+    if (count.program_id != program_id) {
+      if (program_id >= 0) counts_[program_id].EndAddingFinalCounts(num_threads);
+      program_id = count.program_id;
+    }
+    counts_[count.program_id].AddFinalCount(count.feature, count.label, count.count);
+  });
+  if (program_id >= 0) counts_[program_id].EndAddingFinalCounts(num_threads);
+  // Programs without any samples.
+  for (Counter& counter : counts_) {
+    if (!counter.IsFrozen()) counter.EndAddingFinalCounts();
+  }
+}
+
 void TGenModel::GenerativeEndTraining() {
+  const int num_threads = NumThreadsOrDefault(FLAGS_finalization_threads);
+  if (spilled_counts_ != nullptr) {
+    LOG(INFO) << "Merging " << spilled_counts_->NumRuns() << " runs of training counts...";
+    EndTrainingWithSortedCounts(spilled_counts_.get(), num_threads);
+    spilled_counts_.reset();
+  } else {
+    // Counters with many pairs are finalized one after another with all threads, the others in
+    // parallel with one thread each.
+    std::vector<size_t> small_counters;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      if (counts_[i].NumFeatureValues() >= kMinFeatureValuesForParallelEndAdding) {
+        counts_[i].EndAdding(num_threads);
+      } else {
+        small_counters.push_back(i);
+      }
+    }
+    ParallelFor(small_counters.size(), num_threads, [this, &small_counters](size_t i) {
+      counts_[small_counters[i]].EndAdding();
+    });
+    // The format the counters keep after training (merged counts are frozen already).
+    if (FLAGS_frozen_counts || FLAGS_compact_counts) {
+      ParallelFor(counts_.size(), num_threads, [this](size_t i) {
+        if (FLAGS_frozen_counts) {
+          counts_[i].Freeze();
+        } else {
+          counts_[i].Compact();
+        }
+      });
+    }
+  }
+
+  size_t num_pruned = 0, num_promoted = 0, num_rejected = 0;
   for (size_t i = 0; i < counts_.size(); ++i) {
-    counts_[i].EndAdding();
+    num_pruned += counts_[i].NumPruned();
+    num_promoted += counts_[i].NumPromotedFromSketch();
+    num_rejected += counts_[i].NumRejectedIncrements();
+  }
+  LOG(INFO) << num_pruned << " feature-value pairs pruned.";
+  if (FLAGS_count_sketch_mb > 0) {
+    LOG(INFO) << "Count sketch: " << num_promoted << " feature-value pairs promoted to exact counts, "
+              << num_rejected << " increments of pairs at the minimum count dropped because the exact counts "
+              << "were full.";
+  }
+  LogMemoryUsage();
+  if (collision_audit_ != nullptr) {
+    LOG(INFO) << "Feature collision audit: " << collision_audit_->Report();
+  }
+}
+
+void TGenModel::LogMemoryUsage() const {
+  size_t num_features = 0, feature_index_bytes = 0, feature_label_bytes = 0, feature_value_bytes = 0;
+  for (const Counter& counter : counts_) {
+    num_features += counter.Size();
+    feature_index_bytes += counter.FeatureIndexBytes();
+    feature_label_bytes += counter.FeatureLabelBytes();
+    feature_value_bytes += counter.FeatureValueBytes();
+  }
+  const Counter* counter = counts_.empty() ? nullptr : &counts_[0];
+  const char* format = (counter != nullptr && counter->IsFrozen()) ? " (frozen)" :
+      (counter != nullptr && counter->IsCompact()) ? " (compact)" : "";
+  LOG(INFO) << "Features: " << num_features << " in " << feature_index_bytes << " index bytes and "
+            << feature_label_bytes << " label bytes, "
+            << "feature-value counts: " << NumFeatureValues() << " in " << feature_value_bytes << " bytes" << format;
+  if (FLAGS_huge_pages > 0) {
+    LOG(INFO) << HugePageUsageString();
+  }
+}
+
+namespace {
+
+Json::Value OrderMemoryReportToJson(const OrderMemoryReport& o) {
+  Json::Value result(Json::objectValue);
+  result["num_features"] = Json::UInt64(o.num_features);
+  result["num_pairs"] = Json::UInt64(o.num_pairs);
+  result["feature_table_bytes"] = Json::UInt64(o.feature_table_bytes);
+  result["label_bytes"] = Json::UInt64(o.label_bytes);
+  result["pair_table_bytes"] = Json::UInt64(o.pair_table_bytes);
+  result["kneser_ney_bytes"] = Json::UInt64(o.kneser_ney_bytes);
+  result["total_bytes"] = Json::UInt64(o.TotalBytes());
+  return result;
+}
+
+void AddOrderMemoryReport(const OrderMemoryReport& o, OrderMemoryReport* into) {
+  into->num_features += o.num_features;
+  into->num_pairs += o.num_pairs;
+  into->feature_table_bytes += o.feature_table_bytes;
+  into->label_bytes += o.label_bytes;
+  into->pair_table_bytes += o.pair_table_bytes;
+  into->kneser_ney_bytes += o.kneser_ney_bytes;
+}
+
+Json::Value CounterMemoryReportToJson(const CounterMemoryReport& r) {
+  Json::Value result(Json::objectValue);
+  result["num_features"] = Json::UInt64(r.num_features);
+  result["num_pairs"] = Json::UInt64(r.num_pairs);
+  result["feature_slots"] = Json::UInt64(r.feature_slots);
+  result["pair_slots"] = Json::UInt64(r.pair_slots);
+  result["feature_load_factor"] = r.FeatureLoadFactor();
+  result["pair_load_factor"] = r.PairLoadFactor();
+  result["feature_table_bytes"] = Json::UInt64(r.feature_table_bytes);
+  result["feature_filter_bytes"] = Json::UInt64(r.feature_filter_bytes);
+  result["label_bytes"] = Json::UInt64(r.label_bytes);
+  result["pair_table_bytes"] = Json::UInt64(r.pair_table_bytes);
+  result["kneser_ney_bytes"] = Json::UInt64(r.kneser_ney_bytes);
+  result["dense_label_bytes"] = Json::UInt64(r.dense_label_bytes);
+  result["total_bytes"] = Json::UInt64(r.TotalBytes());
+  Json::Value& orders = result["orders"] = Json::Value(Json::arrayValue);
+  for (const OrderMemoryReport& o : r.orders) {
+    orders.append(OrderMemoryReportToJson(o));
+  }
+  return result;
+}
+
+}  // namespace
+
+Json::Value TGenModel::MemoryReport() const {
+  CounterMemoryReport total;
+  Json::Value programs(Json::arrayValue);
+  uint64 num_unloaded = 0, unloaded_bytes = 0;
+  for (size_t program_id = 0; program_id < counts_.size(); ++program_id) {
+    // Sections that were not loaded yet take no memory but their size in the model file.
+    if (lazy_sections_ != nullptr && !lazy_sections_->is_loaded[program_id]) {
+      ++num_unloaded;
+      unloaded_bytes += lazy_sections_->sections[program_id].bytes;
+      continue;
+    }
+    const CounterMemoryReport r = counts_[program_id].GetMemoryReport();
+    // Programs without features only have the overhead of their empty tables, which is in the totals.
+    if (r.num_features > 0 || r.num_pairs > 0) {
+      Json::Value program = CounterMemoryReportToJson(r);
+      program["program_id"] = Json::UInt64(program_id);
+      programs.append(program);
+    }
+
+    total.num_features += r.num_features;
+    total.num_pairs += r.num_pairs;
+    total.feature_slots += r.feature_slots;
+    total.pair_slots += r.pair_slots;
+    total.feature_table_bytes += r.feature_table_bytes;
+    total.feature_filter_bytes += r.feature_filter_bytes;
+    total.label_bytes += r.label_bytes;
+    total.pair_table_bytes += r.pair_table_bytes;
+    total.kneser_ney_bytes += r.kneser_ney_bytes;
+    total.dense_label_bytes += r.dense_label_bytes;
+    if (r.orders.size() > total.orders.size()) {
+      total.orders.resize(r.orders.size());
+    }
+    for (size_t order = 0; order < r.orders.size(); ++order) {
+      AddOrderMemoryReport(r.orders[order], &total.orders[order]);
+    }
+  }
+  const Counter* counter = counts_.empty() ? nullptr : &counts_[0];
+  Json::Value result = CounterMemoryReportToJson(total);
+  result["is_for_node_type"] = is_for_node_type_;
+  result["num_programs"] = Json::UInt64(counts_.size());
+  result["format"] = ((counter != nullptr && counter->IsFrozen()) || lazy_sections_ != nullptr) ? "frozen" :
+      (counter != nullptr && counter->IsCompact()) ? "compact" : "hash_map";
+  if (lazy_sections_ != nullptr) {
+    result["num_unloaded_programs"] = Json::UInt64(num_unloaded);
+    result["unloaded_section_bytes"] = Json::UInt64(unloaded_bytes);
   }
+  result["programs"] = programs;
+  return result;
 }
 
+void TGenModel::Freeze() {
+  // Loaded sections are frozen already.
+  if (lazy_sections_ != nullptr) return;
+  ParallelFor(counts_.size(), NumThreadsOrDefault(FLAGS_finalization_threads), [this](size_t i) {
+    counts_[i].Freeze();
+  });
+  LogMemoryUsage();
+}
+
+void TGenModel::SetSmoothing(const SmoothingParams& smoothing) {
+  smoothing_ = smoothing;
+  const int num_threads = NumThreadsOrDefault(FLAGS_finalization_threads);
+  std::vector<size_t> small_counters;
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    if (counts_[i].NumFeatureValues() >= kMinFeatureValuesForParallelEndAdding) {
+      counts_[i].Resmooth(smoothing_, num_threads);
+    } else {
+      small_counters.push_back(i);
+    }
+  }
+  ParallelFor(small_counters.size(), num_threads, [this, &small_counters](size_t i) {
+    counts_[small_counters[i]].Resmooth(smoothing_);
+  });
+}
+
+void TGenModel::SetPruning(const PruningParams& pruning) {
+  const int num_threads = NumThreadsOrDefault(FLAGS_finalization_threads);
+  std::vector<size_t> small_counters;
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    if (counts_[i].NumFeatureValues() >= kMinFeatureValuesForParallelEndAdding) {
+      counts_[i].Reprune(pruning, num_threads);
+    } else {
+      small_counters.push_back(i);
+    }
+  }
+  ParallelFor(small_counters.size(), num_threads, [this, &small_counters, &pruning](size_t i) {
+    counts_[small_counters[i]].Reprune(pruning);
+  });
+}
+
+std::vector<size_t> TGenModel::NumPrunedByOrder() const {
+  std::vector<size_t> result;
+  for (const Counter& counter : counts_) {
+    const std::vector<size_t>& num_pruned = counter.NumPrunedByOrder();
+    if (num_pruned.size() > result.size()) {
+      result.resize(num_pruned.size());
+    }
+    for (size_t order = 0; order < num_pruned.size(); ++order) {
+      result[order] += num_pruned[order];
+    }
+  }
+  return result;
+}
+
+// Written at the start of model files, followed by a format version.
+static const char kModelFileMagic[] = "PHOGMODL";
+static const int kModelFileVersion = 7;
+
+void TGenModel::WriteToFileOrDie(FILE* f) const {
+  CHECK_EQ(1, fwrite(kModelFileMagic, sizeof(kModelFileMagic), 1, f));
+  CHECK_EQ(1, fwrite(&kModelFileVersion, sizeof(int), 1, f));
+  int num_counters = counts_.size();
+  CHECK_EQ(1, fwrite(&num_counters, sizeof(int), 1, f));
+  int is_for_node_type = is_for_node_type_;
+  CHECK_EQ(1, fwrite(&is_for_node_type, sizeof(int), 1, f));
+  // The section table is filled in once the sizes of the sections are known. The offsets are
+  // relative to the end of the table.
+  std::vector<ModelSection> sections(counts_.size());
+  const long table_pos = ftell(f);
+  CHECK_GE(table_pos, 0) << "Model files must be seekable";
+  WriteVectorToFileOrDie(sections, f);
+  const long sections_pos = ftell(f);
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    const long pos = ftell(f);
+    const Counter& counter = GetCounter(i);
+    counter.WriteFrozenToFileOrDie(f);
+    sections[i].offset = pos - sections_pos;
+    sections[i].bytes = ftell(f) - pos;
+    sections[i].num_feature_values = counter.NumFeatureValues();
+  }
+  CHECK_EQ(0, fseek(f, table_pos, SEEK_SET));
+  WriteVectorToFileOrDie(sections, f);
+  CHECK_EQ(0, fseek(f, 0, SEEK_END));
+}
+
+void TGenModel::ReadFromFileOrDie(FILE* f) {
+  char magic[sizeof(kModelFileMagic)];
+  CHECK_EQ(1, fread(magic, sizeof(magic), 1, f));
+  CHECK(memcmp(magic, kModelFileMagic, sizeof(magic)) == 0) << "Not a model file";
+  int version = 0;
+  CHECK_EQ(1, fread(&version, sizeof(int), 1, f));
+  CHECK_EQ(kModelFileVersion, version) << "Unsupported model file version";
+  int num_counters = 0;
+  CHECK_EQ(1, fread(&num_counters, sizeof(int), 1, f));
+  CHECK_EQ(static_cast<int>(counts_.size()), num_counters) << "The model was saved for a different TGen program";
+  int is_for_node_type = 0;
+  CHECK_EQ(1, fread(&is_for_node_type, sizeof(int), 1, f));
+  CHECK_EQ(is_for_node_type_, is_for_node_type != 0) << "The model was saved with a different --is_for_node_type";
+  std::vector<ModelSection> sections;
+  ReadVectorFromFileOrDie(&sections, f);
+  CHECK_EQ(counts_.size(), sections.size());
+  const long sections_pos = ftell(f);
+  CHECK_GE(sections_pos, 0) << "Model files must be seekable";
+  const uint64 sections_bytes = sections.empty() ? 0 : sections.back().offset + sections.back().bytes;
+
+  if (!FLAGS_lazy_model_sections) {
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      counts_[i].ReadFrozenFromFileOrDie(f);
+      CHECK_EQ(sections_pos + sections[i].offset + sections[i].bytes, static_cast<uint64>(ftell(f)))
+          << "Corrupt section of program " << i;
+    }
+    LogMemoryUsage();
+    return;
+  }
+  lazy_sections_.reset(new LazySections(counts_.size()));
+  lazy_sections_->fd = dup(fileno(f));
+  CHECK_GE(lazy_sections_->fd, 0) << "Could not keep the model file open";
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    lazy_sections_->sections[i] = sections[i];
+    lazy_sections_->sections[i].offset += sections_pos;
+  }
+  // Skips the sections, e.g. to the next model in the file.
+  CHECK_EQ(0, fseek(f, sections_pos + sections_bytes, SEEK_SET));
+  LOG(INFO) << "Model with " << counts_.size() << " sections of " << sections_bytes
+            << " bytes is loaded on demand.";
+}
+
+namespace {
+
+// A section of a file that is read with pread, so that sections can be read concurrently through one descriptor.
+struct FileSection {
+  int fd;
+  uint64 pos;
+  uint64 end;
+};
+
+ssize_t ReadFileSection(void* cookie, char* buffer, size_t size) {
+  FileSection* section = static_cast<FileSection*>(cookie);
+  size = std::min<uint64>(size, section->end - section->pos);
+  if (size == 0) return 0;
+  const ssize_t n = pread(section->fd, buffer, size, section->pos);
+  if (n > 0) section->pos += n;
+  return n;
+}
+
+}  // namespace
+
+void TGenModel::LoadSectionOrDie(int program_id) const {
+  const ModelSection& section = lazy_sections_->sections[program_id];
+  FileSection file_section = {lazy_sections_->fd, section.offset, section.offset + section.bytes};
+  cookie_io_functions_t io = {ReadFileSection, nullptr, nullptr, nullptr};
+  FILE* f = fopencookie(&file_section, "rb", io);
+  CHECK(f != nullptr);
+  counts_[program_id].ReadFrozenFromFileOrDie(f);
+  CHECK_EQ(EOF, fgetc(f)) << "Corrupt section of program " << program_id;
+  fclose(f);
+  lazy_sections_->is_loaded[program_id] = true;
+}
+
+Json::Value TGenModel::WorkingSetReport() const {
+  CHECK(lazy_sections_ != nullptr) << "The model was not loaded with --lazy_model_sections";
+  std::vector<std::pair<uint64, int> > loaded;
+  uint64 loaded_bytes = 0, total_bytes = 0, num_lookups = 0;
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    const ModelSection& section = lazy_sections_->sections[i];
+    total_bytes += section.bytes;
+    num_lookups += lazy_sections_->num_lookups[i];
+    if (lazy_sections_->is_loaded[i]) {
+      loaded.emplace_back(lazy_sections_->num_lookups[i], i);
+      loaded_bytes += section.bytes;
+    }
+  }
+  std::sort(loaded.begin(), loaded.end(), std::greater<std::pair<uint64, int> >());
+  Json::Value result(Json::objectValue);
+  result["is_for_node_type"] = is_for_node_type_;
+  result["num_programs"] = Json::UInt64(counts_.size());
+  result["num_loaded_programs"] = Json::UInt64(loaded.size());
+  result["section_bytes"] = Json::UInt64(total_bytes);
+  result["loaded_section_bytes"] = Json::UInt64(loaded_bytes);
+  result["num_lookups"] = Json::UInt64(num_lookups);
+  Json::Value& programs = result["programs"] = Json::Value(Json::arrayValue);
+  for (const auto& program : loaded) {
+    const ModelSection& section = lazy_sections_->sections[program.second];
+    Json::Value entry(Json::objectValue);
+    entry["program_id"] = program.second;
+    entry["num_lookups"] = Json::UInt64(program.first);
+    entry["section_bytes"] = Json::UInt64(section.bytes);
+    entry["num_feature_values"] = Json::UInt64(section.num_feature_values);
+    programs.append(entry);
+  }
+  return result;
+}
+
+// Written at the start of count shards, followed by a format version.
+static const char kCountShardMagic[] = "PHOGSHRD";
+static const int kCountShardVersion = 1;
+
+// Identifies the strings of ss and their indices.
+static uint64 StringSetFingerprint(const StringSet& ss) {
+  std::vector<int> strings;
+  ss.getAllStrings(&strings);
+  uint64 fingerprint = strings.size();
+  for (int index : strings) {
+    const char* s = ss.getString(index);
+    fingerprint = FingerprintCat64(fingerprint, FingerprintCat64(index, FingerprintMem(s, strlen(s))));
+  }
+  return fingerprint;
+}
+
+size_t TGenModel::WriteCountShardOrDie(const StringSet& ss, FILE* f) {
+  CHECK_EQ(1, fwrite(kCountShardMagic, sizeof(kCountShardMagic), 1, f));
+  CHECK_EQ(1, fwrite(&kCountShardVersion, sizeof(int), 1, f));
+  int num_counters = counts_.size();
+  CHECK_EQ(1, fwrite(&num_counters, sizeof(int), 1, f));
+  int is_for_node_type = is_for_node_type_;
+  CHECK_EQ(1, fwrite(&is_for_node_type, sizeof(int), 1, f));
+  // The record size differs between builds with and without PHOG_FEATURE_HASH64.
+  int record_bytes = sizeof(SpilledCount);
+  CHECK_EQ(1, fwrite(&record_bytes, sizeof(int), 1, f));
+  uint64 strings = StringSetFingerprint(ss);
+  CHECK_EQ(1, fwrite(&strings, sizeof(uint64), 1, f));
+
+  size_t num_records = 0;
+  if (spilled_counts_ != nullptr) {
+    spilled_counts_->Merge([f, &num_records](const SpilledCount& count) {
+      CHECK_EQ(1, fwrite(&count, sizeof(SpilledCount), 1, f));
+      num_records++;
+    });
+    spilled_counts_.reset();
+  } else {
+    // Programs are the first sort key, so sorting the counts of one counter at a time gives a
+    // sorted shard.
+    std::vector<SpilledCount> records;
+    for (size_t program_id = 0; program_id < counts_.size(); ++program_id) {
+      CHECK(!counts_[program_id].sketch().IsEnabled()) << "Counts in a count sketch cannot be written to a shard";
+      records.clear();
+      counts_[program_id].ForEachFeatureValue([program_id, &records](const Feature& feature, int label, int count) {
+        // Value-initialized in place, so that the padding written to the shard is zero.
+        records.emplace_back();
+        SpilledCount& record = records.back();
+        record.program_id = program_id;
+        record.label = label;
+        record.feature = feature;
+        record.count = count;
+      });
+      std::sort(records.begin(), records.end(), SpilledCountLess());
+      CHECK_EQ(records.size(), fwrite(records.data(), sizeof(SpilledCount), records.size(), f));
+      num_records += records.size();
+    }
+  }
+  LOG(INFO) << "Wrote " << num_records << " counts to the shard.";
+  return num_records;
+}
+
+void TGenModel::ReadCountShardHeaderOrDie(uint64 strings, const std::string& name, FILE* f) const {
+  char magic[sizeof(kCountShardMagic)];
+  CHECK_EQ(1, fread(magic, sizeof(magic), 1, f));
+  CHECK(memcmp(magic, kCountShardMagic, sizeof(magic)) == 0) << name << " is not a count shard";
+  int version = 0;
+  CHECK_EQ(1, fread(&version, sizeof(int), 1, f));
+  CHECK_EQ(kCountShardVersion, version) << "Unsupported count shard version in " << name;
+  int num_counters = 0;
+  CHECK_EQ(1, fread(&num_counters, sizeof(int), 1, f));
+  CHECK_EQ(static_cast<int>(counts_.size()), num_counters) << name << " was written for a different TGen program";
+  int is_for_node_type = 0;
+  CHECK_EQ(1, fread(&is_for_node_type, sizeof(int), 1, f));
+  CHECK_EQ(is_for_node_type_, is_for_node_type != 0) << name << " was written with a different --is_for_node_type";
+  int record_bytes = 0;
+  CHECK_EQ(1, fread(&record_bytes, sizeof(int), 1, f));
+  CHECK_EQ(static_cast<int>(sizeof(SpilledCount)), record_bytes) << name << " was written with a different feature size";
+  uint64 shard_strings = 0;
+  CHECK_EQ(1, fread(&shard_strings, sizeof(uint64), 1, f));
+  CHECK_EQ(strings, shard_strings) << name << " was written with different strings";
+}
+
+void TGenModel::MergeCountShardsOrDie(const StringSet& ss, const std::vector<std::string>& shard_files) {
+  CHECK(spilled_counts_ == nullptr && NumFeatureValues() == 0) << "Shards can only be merged into an untrained model";
+  const uint64 strings = StringSetFingerprint(ss);
+  // Nothing is spilled since all records come from the shards.
+  SpilledCounts shards("", static_cast<size_t>(FLAGS_spill_buffer_mb) << 20);
+  for (const std::string& file : shard_files) {
+    FILE* f = fopen(file.c_str(), "rb");
+    CHECK(f != nullptr) << "Could not open " << file;
+    ReadCountShardHeaderOrDie(strings, file, f);
+    shards.AddRun(f);
+  }
+  LOG(INFO) << "Merging " << shards.NumRuns() << " count shards...";
+  EndTrainingWithSortedCounts(&shards, NumThreadsOrDefault(FLAGS_finalization_threads));
+  LogMemoryUsage();
+}
+
+void TGenModel::WriteCheckpointOrDie(const StringSet& ss, FILE* f) {
+  CHECK(spilled_counts_ == nullptr) << "Checkpoints are not available with --spill_dir";
+  uint64 num_records = NumFeatureValues();
+  CHECK_EQ(1, fwrite(&num_records, sizeof(uint64), 1, f));
+  CHECK_EQ(num_records, WriteCountShardOrDie(ss, f));
+}
+
+void TGenModel::ReadCheckpointOrDie(const StringSet& ss, FILE* f) {
+  CHECK(spilled_counts_ == nullptr) << "Checkpoints are not available with --spill_dir";
+  uint64 num_records = 0;
+  CHECK_EQ(1, fread(&num_records, sizeof(uint64), 1, f));
+  ReadCountShardHeaderOrDie(StringSetFingerprint(ss), "The checkpoint", f);
+  SpilledCount record;
+  for (uint64 i = 0; i < num_records; ++i) {
+    CHECK_EQ(1, fread(&record, sizeof(SpilledCount), 1, f));
+    CHECK(record.program_id >= 0 && record.program_id < static_cast<int>(counts_.size()));
+    counts_[record.program_id].AddValue(record.feature, record.label, record.count);
+  }
+  LOG(INFO) << "Read " << num_records << " counts from the checkpoint.";
+}
+
+
+size_t TGenModel::NumFeatureValues() const {
+  size_t result = 0;
+  if (lazy_sections_ != nullptr) {
+    for (const ModelSection& section : lazy_sections_->sections) {
+      result += section.num_feature_values;
+    }
+    return result;
+  }
+  for (const Counter& counter : counts_) {
+    result += counter.NumFeatureValues();
+  }
+  return result;
+}
 
 int TGenModel::GetSubmodelBranch(
     int program_id,
@@ -209,48 +903,122 @@ double TGenModel::GetLabelLogProb(
   }
 
   int best_label = GetLabelAtPosition(program_id, exec, sample, slice);
-  return GetLabelLogProbInner(
-      program_id, exec, SlicedTreeTraversal(sample.tree_storage(), sample.position(), slice), best_label);
+  thread_local FeatureChain chain;
+  GetFeatureChain(program_id, exec, SlicedTreeTraversal(sample.tree_storage(), sample.position(), slice), &chain);
+  return GetLabelLogProbInner(program_id, chain, best_label);
 }
 
-double TGenModel::GetLabelLogProbInner(
+void TGenModel::GetFeatureChain(
     int program_id,
     const TCondLanguage::ExecutionForTree& exec,
     SlicedTreeTraversal sample,
-    int label) const {
+    FeatureChain* chain) const {
+  const Counter& counts = GetCounter(program_id);
+  RecordLookup(program_id);
   Feature f;
-  Smoothing wb;
+  chain->clear();
+  chain->emplace_back(f, counts.GetFeatureStatsOrNull(f));
+  ExecuteContextProgramByIdInAll(
+      &exec,
+      &sample, nullptr,
+      program_id, &program_,
+      [&counts, &f, chain](int op_added) {
+    f.PushBack(op_added);
+    chain->emplace_back(f, counts.GetFeatureStatsOrNull(f));
+  });
+}
 
-  // Unconditional feature is handled separately:
-  const auto* uncond_stats = counts_[program_id].GetFeatureStatsOrNull(f);
-  if (uncond_stats != nullptr) {
-    wb.SetUnconditionedProb(counts_[program_id].GetCount(f, label),
-        uncond_stats->UniqueLabels(),
-        uncond_stats->TotalCount(),
-        counts_[program_id].GetValuePrefixCount(f, label),
-        counts_[program_id].GetTotalPrefixCount(f));
+void TGenModel::GetFeatureChain(const ExtractedSample& sample, FeatureChain* chain) const {
+  const Counter& counts = GetCounter(sample.program_id);
+  RecordLookup(sample.program_id);
+  chain->clear();
+  for (const Feature& f : sample.features) {
+    chain->emplace_back(f, counts.GetFeatureStatsOrNull(f));
+  }
+}
+
+void TGenModel::ExtractSample(
+    int program_id,
+    const TCondLanguage::ExecutionForTree& exec,
+    FullTreeTraversal sample,
+    const TreeSlice* slice,
+    ExtractedSample* extracted) const {
+  size_t call_length = 0;
+  while (program_.program_type(program_id) == TGenProgram::ProgramType::BRANCHED_PROGRAM) {
+    program_id = GetSubmodelBranch(program_id, exec, sample, slice);
+    ++call_length;
+    CHECK_LE(call_length, program_.size());
   }
-  SlicedTreeTraversal traversal = sample;
+
+  extracted->program_id = program_id;
+  extracted->label = GetLabelAtPosition(program_id, exec, sample, slice);
+  extracted->features.clear();
+  Feature f;
+  extracted->features.push_back(f);
+  SlicedTreeTraversal traversal(sample.tree_storage(), sample.position(), slice);
   ExecuteContextProgramByIdInAll(
       &exec,
       &traversal, nullptr,
       program_id, &program_,
-      [&wb, &label, this, &f, program_id](int op_added) {
+      [&f, extracted](int op_added) {
     f.PushBack(op_added);
-    const auto* stats = counts_[program_id].GetFeatureStatsOrNull(f);
+    extracted->features.push_back(f);
+  });
+}
+
+double TGenModel::GetLabelLogProb(const ExtractedSample& sample) const {
+  thread_local FeatureChain chain;
+  GetFeatureChain(sample, &chain);
+  return GetLabelLogProbInner(sample.program_id, chain, sample.label);
+}
+
+bool TGenModel::IsLabelBestPrediction(const ExtractedSample& sample) const {
+  thread_local FeatureChain chain;
+  GetFeatureChain(sample, &chain);
+  return GetBestLabelLogProbInChain(sample.program_id, chain).second == sample.label;
+}
+
+double TGenModel::GetLabelLogProbInner(
+    int program_id,
+    const FeatureChain& chain,
+    int label) const {
+  const Counter& counts = GetCounter(program_id);
+  switch (smoothing_.type) {
+  case WittenBell: return GetLabelLogProbInnerWithSmoothing<WittenBellSmoothing>(counts, chain, label);
+  case KneserNey: return GetLabelLogProbInnerWithSmoothing<KneserNeySmoothing>(counts, chain, label);
+  case Laplace: return GetLabelLogProbInnerWithSmoothing<LaplaceSmoothing>(counts, chain, label);
+  default: LOG(FATAL) << "Unknown smoothing type " << smoothing_.type;
+  }
+  return 0;
+}
+
+template<class Smoothing>
+double TGenModel::GetLabelLogProbInnerWithSmoothing(
+    const Counter& counts,
+    const FeatureChain& chain,
+    int label) const {
+  Smoothing smoothing(smoothing_);
+  int dense_label = counts.DenseLabelIndex(label);
+
+  // Unconditional feature is handled separately:
+  const auto* uncond_stats = chain[0].second;
+  if (uncond_stats != nullptr) {
+    smoothing.SetUnconditionedProb(counts.GetCountInFeature(chain[0].first, *uncond_stats, label, dense_label),
+        Smoothing::kUsesContinuationCounts ? counts.GetValuePrefixCount(0, label, dense_label) : 0,
+        uncond_stats->coefficients());
+  }
+  for (size_t i = 1; i < chain.size(); ++i) {
+    const Feature& f = chain[i].first;
+    const auto* stats = chain[i].second;
     if (stats != nullptr) {
-      wb.AddForwardBackoff(
-          counts_[program_id].GetCount(f, label),
-          stats->UniqueLabels(),
-          stats->TotalCount(),
-          stats->GetCounts(),
-          counts_[program_id].GetValuePrefixCount(f, label),
-          counts_[program_id].GetTotalPrefixCount(f),
-          counts_[program_id].GetKneserNeyDelta(f));
+      smoothing.AddForwardBackoff(
+          counts.GetCountInFeature(f, *stats, label, dense_label),
+          Smoothing::kUsesContinuationCounts ? counts.GetValuePrefixCount(f.size(), label, dense_label) : 0,
+          stats->coefficients());
     }
-  });
+  }
 
-  return wb.GetLogProb();
+  return smoothing.GetLogProb();
 }
 
 std::pair<double, int> TGenModel::GetBestLabelLogProb(
@@ -263,18 +1031,36 @@ std::pair<double, int> TGenModel::GetBestLabelLogProb(
     CHECK_LE(call_length, program_.size());
   }
 
-  Feature f;
-  const auto& uncond_items = counts_[program_id].LabelsSortedByProbability(f);
-  if (uncond_items.empty()) return std::make_pair(0.0, -1);
-  int best_label = *(uncond_items[0].second);
-  double best_score = GetLabelLogProbInner(
-      program_id, exec, SlicedTreeTraversal(sample.tree_storage(), sample.position(), slice), best_label);
-
-  for (size_t i = 1; static_cast<int>(i) < FLAGS_beam_size && i < uncond_items.size(); i++) {
-    int label = *(uncond_items[i].second);
+  // The context program is executed once; every candidate label is then scored on the same chain.
+  thread_local FeatureChain chain;
+  GetFeatureChain(program_id, exec, SlicedTreeTraversal(sample.tree_storage(), sample.position(), slice), &chain);
+  return GetBestLabelLogProbInChain(program_id, chain);
+}
+
+std::pair<double, int> TGenModel::GetBestLabelLogProbInChain(int program_id, const FeatureChain& chain) const {
+  if (chain[0].second == nullptr) return std::make_pair(0.0, -1);
+
+  const Counter& counts = GetCounter(program_id);
+  switch (smoothing_.type) {
+  case WittenBell: return GetBestLabelLogProbInChainWithSmoothing<WittenBellSmoothing>(counts, chain);
+  case KneserNey: return GetBestLabelLogProbInChainWithSmoothing<KneserNeySmoothing>(counts, chain);
+  case Laplace: return GetBestLabelLogProbInChainWithSmoothing<LaplaceSmoothing>(counts, chain);
+  default: LOG(FATAL) << "Unknown smoothing type " << smoothing_.type;
+  }
+  return std::make_pair(0.0, -1);
+}
+
+template<class Smoothing>
+std::pair<double, int> TGenModel::GetBestLabelLogProbInChainWithSmoothing(
+    const Counter& counts, const FeatureChain& chain) const {
+  const Counter::FeatureStats& uncond_stats = *chain[0].second;
+  int best_label = uncond_stats.Label(0);
+  double best_score = GetLabelLogProbInnerWithSmoothing<Smoothing>(counts, chain, best_label);
+
+  for (size_t i = 1; static_cast<int>(i) < FLAGS_beam_size && i < uncond_stats.NumLabels(); i++) {
+    int label = uncond_stats.Label(i);
     if (label != best_label) {
-      double score = GetLabelLogProbInner(
-          program_id, exec, SlicedTreeTraversal(sample.tree_storage(), sample.position(), slice), label);
+      double score = GetLabelLogProbInnerWithSmoothing<Smoothing>(counts, chain, label);
       if (score > best_score) {
         best_score = score;
         best_label = label;
@@ -282,26 +1068,20 @@ std::pair<double, int> TGenModel::GetBestLabelLogProb(
     }
   }
 
-  SlicedTreeTraversal traversal(sample.tree_storage(), sample.position(), slice);
-  ExecuteContextProgramByIdInAll(
-      &exec,
-      &traversal, nullptr,
-      program_id, &program_,
-      [&f, this, &best_label, &best_score, &sample, &exec, slice, program_id](int op_added) {
-    f.PushBack(op_added);
-    const auto& items = counts_[program_id].LabelsSortedByProbability(f);
-    for (size_t i = 0; static_cast<int>(i) < FLAGS_beam_size && i < items.size(); i++) {
-      int label = *(items[i].second);
+  for (size_t order = 1; order < chain.size(); ++order) {
+    if (chain[order].second == nullptr) continue;
+    const Counter::FeatureStats& stats = *chain[order].second;
+    for (size_t i = 0; static_cast<int>(i) < FLAGS_beam_size && i < stats.NumLabels(); i++) {
+      int label = stats.Label(i);
       if (label != best_label) {
-        double score = GetLabelLogProbInner(
-            program_id, exec, SlicedTreeTraversal(sample.tree_storage(), sample.position(), slice), label);
+        double score = GetLabelLogProbInnerWithSmoothing<Smoothing>(counts, chain, label);
         if (score > best_score) {
           best_score = score;
           best_label = label;
         }
       }
     }
-  });
+  }
 
   return std::make_pair(best_score, best_label);
 }
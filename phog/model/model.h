@@ -17,6 +17,19 @@
 #ifndef PHOG_MODEL_MODEL_H_
 #define PHOG_MODEL_MODEL_H_
 
+#include <stdio.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "json/json.h"
+
+#include "base/external_sort.h"
+#include "base/stringset.h"
+#include "base/hyperloglog.h"
 #include "phog/dsl/tgen_program.h"
 
 //////////////////////////////////////////////////////////////////////
@@ -136,11 +149,47 @@ bool ExecuteEqProgram(
   return ExecuteEqProgramByIdInAll(exec, traversal, debug_info, called_p, all, cb);
 }
 
+// Checks feature fingerprints for collisions during training. For a sample of the fingerprints,
+// the full value sequence that produced them is recorded and compared on every occurrence. The
+// sample is selected by the fingerprint itself, such that all sequences sharing a fingerprint are
+// sampled together.
+class FeatureCollisionAudit {
+public:
+  typedef TCondLanguage::Feature Feature;
+
+  // Audits one in sampling_rate fingerprints.
+  FeatureCollisionAudit(int num_programs, int sampling_rate);
+
+  bool IsSampled(const Feature& f) const {
+    // The low bits of the 31-bit hash are far from uniform (e.g. often odd), so it is mixed first.
+    return FingerprintCat64(std::hash<Feature>()(f), 0) % sampling_rate_ == 0;
+  }
+
+  void Record(int program_id, const Feature& f, const std::vector<int>& sequence);
+
+  // Number of sampled fingerprints and how many of them were produced by more than one sequence.
+  int64 NumSampled() const;
+  int64 NumCollided() const { return num_collided_; }
+
+  std::string Report() const;
+
+private:
+  struct Entry {
+    std::vector<int> sequence;
+    bool collided;
+  };
+
+  int sampling_rate_;
+  std::vector<std::unordered_map<Feature, Entry> > per_program_;
+  int64 num_collided_;
+};
+
 class TGenModel {
 public:
   typedef TCondLanguage::Feature Feature;
 
-  explicit TGenModel(const TGenProgram& program, bool is_for_node_type);
+  explicit TGenModel(const TGenProgram& program, bool is_for_node_type,
+                     const SmoothingParams& smoothing = SmoothingParams::FromFlags());
   TGenModel(TGenModel&& o) = delete;
   TGenModel(const TGenModel& o) = delete;
   ~TGenModel();
@@ -151,9 +200,66 @@ public:
       const TCondLanguage::ExecutionForTree& exec,
       FullTreeTraversal sample);
 
-  // Must be called after all calls of GenerativeTrainOneSample are done.
+  // Optional pass over (a sample of) the training data before training. It estimates the number of
+  // distinct features and feature values of every program, so that the tables can be sized once
+  // instead of growing by rehashing. The samples of consecutive sampled trees should alternate
+  // between part 0 and 1. EndPresizing extrapolates the estimates to scale times the sampled data
+  // (e.g. the inverse of the sampled fraction) and sizes the tables.
+  void PresizingOneSample(
+      int program_id,
+      const TCondLanguage::ExecutionForTree& exec,
+      FullTreeTraversal sample,
+      int part);
+  void EndPresizing(double scale);
+
+  // Must be called after all calls of GenerativeTrainOneSample are done. More samples may be added
+  // afterwards; calling it again then only recomputes the statistics of the features they touched.
+  // With --frozen_counts or --compact_counts the counters are frozen or compacted at the end, so
+  // no more samples can be added.
   void GenerativeEndTraining();
 
+  // Converts the trained model to the read-only format (see --frozen_counts). No more samples can
+  // be added afterwards.
+  void Freeze();
+
+  // Switches the trained model to other smoothing settings without training again: the counts do
+  // not depend on the smoothing, only the per-feature coefficients are recomputed. Not available
+  // for compacted or frozen models.
+  void SetSmoothing(const SmoothingParams& smoothing);
+
+  // Prunes the trained model with settings that prune at least as much as the ones it was trained
+  // with (see --prune_min_counts) and recomputes the statistics of all programs. Not available for
+  // compacted or frozen models.
+  void SetPruning(const PruningParams& pruning);
+  // Number of pairs removed by pruning over all programs, by feature order.
+  std::vector<size_t> NumPrunedByOrder() const;
+
+  // Saves a frozen model. Labels are StringSet indices, so the StringSet used in training must be
+  // saved along with it. The counter of every program is a separate section of the file, listed
+  // in a table after the header.
+  void WriteToFileOrDie(FILE* f) const;
+  // Loads a model saved by WriteToFileOrDie into a model built for the same program and settings.
+  // With --lazy_model_sections only the section table is read and the counter of a program is
+  // loaded from its section when it is first looked up; the file stays open until then.
+  void ReadFromFileOrDie(FILE* f);
+
+  // Sharded training: every process trains on a part of the data and, instead of calling
+  // GenerativeEndTraining, writes its raw counts to a shard, sorted like the runs of --spill_dir.
+  // MergeCountShardsOrDie then sums the shards with a streaming k-way merge (in the memory of
+  // --spill_buffer_mb) and finalizes and freezes the model as GenerativeEndTraining would have
+  // after training on all the data. Labels and features are StringSet indices, so the shards and
+  // the merge must use the same strings.
+  // Returns the number of counts written.
+  size_t WriteCountShardOrDie(const StringSet& ss, FILE* f);
+  void MergeCountShardsOrDie(const StringSet& ss, const std::vector<std::string>& shard_files);
+
+  // Checkpoints of an unfinished training (see evaluate --checkpoint_file): the raw counts in the
+  // format of a count shard, preceded by their number so that the checkpoints of several models
+  // can follow each other in a file. ReadCheckpointOrDie adds the counts to the model, which can
+  // then be trained further. Not available with --spill_dir.
+  void WriteCheckpointOrDie(const StringSet& ss, FILE* f);
+  void ReadCheckpointOrDie(const StringSet& ss, FILE* f);
+
 
   // Gets the probability of the label at the position given by the iterator "sample".
   double GetLabelLogProb(
@@ -183,25 +289,206 @@ public:
       const TreeSlice* slice,
       bool use_teq = true) const;
 
+  // What the model needs of a sample to score it, independent of the smoothing: the program that
+  // predicts it after all branches, its label and its features from the unconditioned one up to
+  // the highest order. Extracted once, a sample can be scored under several smoothing settings
+  // (see SetSmoothing) without executing the programs again.
+  struct ExtractedSample {
+    int program_id;
+    int label;
+    std::vector<Feature> features;
+  };
+  void ExtractSample(
+      int program_id,
+      const TCondLanguage::ExecutionForTree& exec,
+      FullTreeTraversal sample,
+      const TreeSlice* slice,
+      ExtractedSample* extracted) const;
+
+  // GetLabelLogProb and IsLabelBestPrediction of an extracted sample.
+  double GetLabelLogProb(const ExtractedSample& sample) const;
+  bool IsLabelBestPrediction(const ExtractedSample& sample) const;
+
   bool is_for_node_type() const { return is_for_node_type_; }
+  const SmoothingParams& smoothing() const { return smoothing_; }
 
   int start_program_id() const { return program_.size() - 1; }
+
+  // Number of (feature, label) pairs kept by the model after training.
+  size_t NumFeatureValues() const;
+
+  // Memory of the model by program and by feature order (see PerFeatureValueCounter::
+  // GetMemoryReport), with the totals over all programs at the top level. Programs that have
+  // no features are only counted in the totals.
+  Json::Value MemoryReport() const;
+
+  // The programs whose sections were loaded with --lazy_model_sections, with their section sizes
+  // and numbers of lookups, most looked up first. Only available for lazily loaded models.
+  Json::Value WorkingSetReport() const;
+
+  // Calls cb(int program_id, const Feature& f, int label, int count) for every trained
+  // (feature, label) pair. Not available for compacted or frozen models.
+  template<class Callback>
+  void ForEachFeatureValue(const Callback& cb) const {
+    for (size_t program_id = 0; program_id < counts_.size(); ++program_id) {
+      counts_[program_id].ForEachFeatureValue([program_id, &cb](const Feature& f, int label, int count) {
+        cb(program_id, f, label, count);
+      });
+    }
+  }
+
+  // Null unless --feature_collision_audit_sampling is set.
+  const FeatureCollisionAudit* collision_audit() const { return collision_audit_.get(); }
 private:
+  // A training count of one sample when training out of core (see --spill_dir).
+  struct SpilledCount {
+    int program_id;
+    int label;
+    Feature feature;
+    int count;
+  };
+  // Orders the counts by program, then feature (all labels of a feature are adjacent), then label.
+  struct SpilledCountLess {
+    bool operator()(const SpilledCount& a, const SpilledCount& b) const {
+      if (a.program_id != b.program_id) return a.program_id < b.program_id;
+      const size_t a_hash = std::hash<Feature>()(a.feature), b_hash = std::hash<Feature>()(b.feature);
+      if (a_hash != b_hash) return a_hash < b_hash;
+      return a.label < b.label;
+    }
+  };
+  struct SpilledCountCombine {
+    void operator()(SpilledCount* into, const SpilledCount& from) const {
+      into->count += from.count;
+      // Features of different orders can have the same hash. Like in memory, where the feature
+      // seen first (usually the lower order) is kept, the result must not depend on the merge order.
+      if (from.feature.size() < into->feature.size()) {
+        into->feature = from.feature;
+      }
+    }
+  };
+  typedef ExternalSorter<SpilledCount, SpilledCountLess, SpilledCountCombine> SpilledCounts;
+
+  // Finalizes and freezes all counters from the sorted counts.
+  void EndTrainingWithSortedCounts(SpilledCounts* counts, int num_threads);
+
+  // Reads the header of a count shard and checks that it was written by a model of the same
+  // program and settings with the strings of the given fingerprint. name is used in the errors.
+  void ReadCountShardHeaderOrDie(uint64 strings, const std::string& name, FILE* f) const;
+
+  // Calls cb(int program_id, int label, const Feature& f, int op_added) for the features of the
+  // sample, from the unconditioned one to the highest order. op_added is the value last pushed to
+  // f (0 for the unconditioned feature).
+  template<class Callback>
+  void ForEachTrainingFeature(
+      int program_id,
+      const TCondLanguage::ExecutionForTree& exec,
+      FullTreeTraversal sample,
+      const Callback& cb);
+
+  // Counts one training sample for a feature, in memory or in the spill buffer.
+  void AddTrainingCount(int program_id, const Feature& f, int label);
+
+  void LogMemoryUsage() const;
+
   int GetSubmodelBranch(
       int program_id,
       const TCondLanguage::ExecutionForTree& exec,
       FullTreeTraversal sample,
       const TreeSlice* slice) const;
 
-  double GetLabelLogProbInner(
+  typedef PerFeatureValueCounter<Feature, int> Counter;
+
+  // The features of one sample from the unconditioned feature up to the highest order, together
+  // with their statistics (null for features not seen in training).
+  typedef std::vector<std::pair<Feature, const Counter::FeatureStats*> > FeatureChain;
+
+  // Executes the context program once and collects the backoff chain of the sample.
+  void GetFeatureChain(
       int program_id,
       const TCondLanguage::ExecutionForTree& exec,
       SlicedTreeTraversal sample,
+      FeatureChain* chain) const;
+  // The backoff chain of an extracted sample.
+  void GetFeatureChain(const ExtractedSample& sample, FeatureChain* chain) const;
+
+  // The best label of the chain among the most likely labels of its features (see --beam_size).
+  std::pair<double, int> GetBestLabelLogProbInChain(int program_id, const FeatureChain& chain) const;
+
+  double GetLabelLogProbInner(
+      int program_id,
+      const FeatureChain& chain,
+      int label) const;
+
+  // Specializations of the two functions above for a smoothing policy. They switch on smoothing_
+  // once per sample, so that all candidate labels of the sample are scored without indirect calls.
+  template<class Smoothing>
+  std::pair<double, int> GetBestLabelLogProbInChainWithSmoothing(const Counter& counts, const FeatureChain& chain) const;
+
+  template<class Smoothing>
+  double GetLabelLogProbInnerWithSmoothing(
+      const Counter& counts,
+      const FeatureChain& chain,
       int label) const;
 
+  // The counter of the program, loaded first if the model is loaded lazily.
+  const Counter& GetCounter(int program_id) const {
+    if (lazy_sections_ != nullptr) {
+      std::call_once(lazy_sections_->loaded[program_id], [this, program_id]() { LoadSectionOrDie(program_id); });
+    }
+    return counts_[program_id];
+  }
+
+  // Counts a lookup of the program for WorkingSetReport.
+  void RecordLookup(int program_id) const {
+    if (lazy_sections_ != nullptr) {
+      lazy_sections_->num_lookups[program_id].fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Reads the counter of the program from its section of the model file.
+  void LoadSectionOrDie(int program_id) const;
+
+  // Where the counter of a program is in a model file.
+  struct ModelSection {
+    uint64 offset;
+    uint64 bytes;
+    uint64 num_feature_values;
+  };
+  // The model file of a lazily loaded model and the state of its sections.
+  struct LazySections {
+    explicit LazySections(size_t num_sections)
+        : fd(-1), sections(num_sections), loaded(new std::once_flag[num_sections]),
+          is_loaded(new std::atomic<bool>[num_sections]), num_lookups(new std::atomic<uint64>[num_sections]) {
+      for (size_t i = 0; i < num_sections; ++i) {
+        is_loaded[i] = false;
+        num_lookups[i] = 0;
+      }
+    }
+
+    int fd;
+    std::vector<ModelSection> sections;
+    std::unique_ptr<std::once_flag[]> loaded;
+    std::unique_ptr<std::atomic<bool>[]> is_loaded;
+    std::unique_ptr<std::atomic<uint64>[]> num_lookups;
+  };
+
   const TGenProgram program_;
   bool is_for_node_type_;
-  std::vector<PerFeatureValueCounter<Feature, int> > counts_;
+  SmoothingParams smoothing_;
+  // Mutable for the sections of a lazily loaded model, each of which is read once under its once_flag in
+  // LazySections before anything reads its counter (see GetCounter).
+  mutable std::vector<Counter> counts_;
+  // Non-null if the model is loaded lazily (see --lazy_model_sections).
+  std::unique_ptr<LazySections> lazy_sections_;
+  std::unique_ptr<FeatureCollisionAudit> collision_audit_;
+  // Cardinality sketches of the presizing pass, per program and part of the sample.
+  struct PresizingSketches {
+    HyperLogLog features[2];
+    HyperLogLog feature_values[2];
+  };
+  std::vector<PresizingSketches> presizing_;
+  // Non-null while training out of core.
+  std::unique_ptr<SpilledCounts> spilled_counts_;
 };
 
 
@@ -221,6 +508,10 @@ public:
       const TGenModel* model,
       const TCondLanguage::ExecutionForTree& exec,
       int position_in_tree);
+  // Adds a sample extracted with TGenModel::ExtractSample.
+  void AddSample(const TGenModel* model, const TGenModel::ExtractedSample& sample);
+  // Adds the samples of another computation of the same metric, e.g. on another thread.
+  void Merge(const TGenModelEvaluationMetricComputation& o);
   double GetComputedValue() const;
 
 private:
@@ -0,0 +1,305 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "json/json.h"
+
+#include "base/stringprintf.h"
+#include "model.h"
+
+#include "external/gtest/googletest/include/gtest/gtest.h"
+
+DECLARE_bool(lazy_model_sections);
+
+namespace {
+
+TCondLanguage::Feature FeatureOf(const std::vector<int>& sequence) {
+  TCondLanguage::Feature feature;
+  for (int value : sequence) {
+    feature.PushBack(value);
+  }
+  return feature;
+}
+
+// Predicts the values of properties with program 1 and of the other nodes with program 0.
+// Program 2 is not referenced.
+const char kProgram[] =
+    "WRITE_TYPE LEFT WRITE_TYPE\n"
+    "UP WRITE_TYPE\n"
+    "UP UP WRITE_VALUE\n"
+    "switch WRITE_TYPE: on \"Property\" goto 1; else goto 0\n";
+
+const char* const kTrees[] = {
+    "[{\"id\":0, \"type\":\"Program\", \"children\":[1]}, {\"id\":1, \"type\":\"ObjectExpression\", \"children\":[2,4]}, "
+    "{\"id\":2, \"type\":\"Property\", \"value\":\"zoom\", \"children\":[3]}, {\"id\":3, \"type\":\"Literal\", \"value\":\"8\"}, "
+    "{\"id\":4, \"type\":\"Property\", \"value\":\"center\", \"children\":[5]}, {\"id\":5, \"type\":\"Identifier\", \"value\":\"pos\"}, 0]",
+    "[{\"id\":0, \"type\":\"Program\", \"children\":[1]}, {\"id\":1, \"type\":\"CallExpression\", \"children\":[2,5]}, "
+    "{\"id\":2, \"type\":\"MemberExpression\", \"children\":[3,4]}, {\"id\":3, \"type\":\"Identifier\", \"value\":\"map\"}, "
+    "{\"id\":4, \"type\":\"Property\", \"value\":\"center\"}, {\"id\":5, \"type\":\"Identifier\", \"value\":\"pos\"}, 0]",
+    "[{\"id\":0, \"type\":\"Program\", \"children\":[1]}, {\"id\":1, \"type\":\"ObjectExpression\", \"children\":[2]}, "
+    "{\"id\":2, \"type\":\"Property\", \"value\":\"zoom\", \"children\":[3]}, {\"id\":3, \"type\":\"Literal\", \"value\":\"12\"}, 0]",
+};
+
+std::string TempDir() {
+  const char* dir = getenv("TEST_TMPDIR");
+  return dir != nullptr ? dir : "/tmp";
+}
+
+std::vector<TreeStorage> ParseTrees(StringSet* ss) {
+  std::vector<TreeStorage> trees;
+  for (const char* json : kTrees) {
+    Json::Value v;
+    CHECK(Json::Reader().parse(json, v, false)) << "Could not parse JSON";
+    trees.emplace_back();
+    trees.back().Parse(v, ss);
+  }
+  return trees;
+}
+
+// Trains on the trees from first_tree up to (not including) end_tree.
+void TrainOnTrees(const StringSet* ss, const std::vector<TreeStorage>& trees, size_t first_tree, size_t end_tree,
+                  TGenModel* model) {
+  for (size_t tree_id = first_tree; tree_id < end_tree; ++tree_id) {
+    const TreeStorage& tree = trees[tree_id];
+    TCondLanguage::ExecutionForTree exec(ss, &tree);
+    for (unsigned node_id = 0; node_id < tree.NumAllocatedNodes(); ++node_id) {
+      model->GenerativeTrainOneSample(model->start_program_id(), exec, FullTreeTraversal(&tree, node_id));
+    }
+  }
+}
+
+// The log-probability of the label of every node of the trees.
+std::vector<double> ScoreTrees(const StringSet* ss, const std::vector<TreeStorage>& trees, const TGenModel& model) {
+  std::vector<double> scores;
+  for (const TreeStorage& tree : trees) {
+    TCondLanguage::ExecutionForTree exec(ss, &tree);
+    for (unsigned node_id = 0; node_id < tree.NumAllocatedNodes(); ++node_id) {
+      TreeSlice slice(&tree, node_id, !model.is_for_node_type());
+      scores.push_back(model.GetLabelLogProb(model.start_program_id(), exec, FullTreeTraversal(&tree, node_id), &slice));
+    }
+  }
+  return scores;
+}
+
+// The trained pairs of all programs with their counts, in a canonical order.
+std::vector<std::string> FeatureValueCounts(const TGenModel& model) {
+  std::vector<std::string> result;
+  model.ForEachFeatureValue([&result](int program_id, const TCondLanguage::Feature& f, int label, int count) {
+    result.push_back(StringPrintf("%d %zu %d %d %d", program_id, std::hash<TCondLanguage::Feature>()(f), f.size(),
+                                  label, count));
+  });
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+}  // namespace
+
+TEST(TGenModelTest, LazyModelSectionsTest) {
+  StringSet ss;
+  TCondLanguage lang(&ss);
+  TGenProgram program;
+  program.LoadFromStringOrDie(&lang, kProgram);
+  const std::vector<TreeStorage> trees = ParseTrees(&ss);
+
+  TGenModel model(program, false);
+  TrainOnTrees(&ss, trees, 0, trees.size(), &model);
+  model.GenerativeEndTraining();
+  model.Freeze();
+  FILE* f = tmpfile();
+  ASSERT_TRUE(f != nullptr);
+  model.WriteToFileOrDie(f);
+
+  TGenModel eager_model(program, false);
+  rewind(f);
+  eager_model.ReadFromFileOrDie(f);
+  TGenModel lazy_model(program, false);
+  rewind(f);
+  FLAGS_lazy_model_sections = true;
+  lazy_model.ReadFromFileOrDie(f);
+  FLAGS_lazy_model_sections = false;
+  fclose(f);
+
+  // The counters after all branches are the only ones looked up.
+  std::set<int> touched_programs;
+  for (const TreeStorage& tree : trees) {
+    TCondLanguage::ExecutionForTree exec(&ss, &tree);
+    for (unsigned node_id = 0; node_id < tree.NumAllocatedNodes(); ++node_id) {
+      TreeSlice slice(&tree, node_id, true);
+      TGenModel::ExtractedSample sample;
+      model.ExtractSample(model.start_program_id(), exec, FullTreeTraversal(&tree, node_id), &slice, &sample);
+      touched_programs.insert(sample.program_id);
+    }
+  }
+  EXPECT_EQ(std::set<int>({0, 1}), touched_programs);
+
+  const std::vector<double> scores = ScoreTrees(&ss, trees, model);
+  EXPECT_EQ(scores, ScoreTrees(&ss, trees, eager_model));
+  EXPECT_EQ(scores, ScoreTrees(&ss, trees, lazy_model));
+
+  const Json::Value report = lazy_model.WorkingSetReport();
+  EXPECT_EQ(4, report["num_programs"].asInt());
+  EXPECT_EQ(touched_programs.size(), report["num_loaded_programs"].asUInt64());
+  std::set<int> loaded_programs;
+  for (const Json::Value& entry : report["programs"]) {
+    loaded_programs.insert(entry["program_id"].asInt());
+    EXPECT_LT(0, entry["num_lookups"].asInt());
+  }
+  EXPECT_EQ(touched_programs, loaded_programs);
+}
+
+TEST(FeatureCollisionAuditTest, RecordTest) {
+  FeatureCollisionAudit audit(2, 1);
+  const TCondLanguage::Feature f = FeatureOf({1, 2});
+  EXPECT_TRUE(audit.IsSampled(f));
+
+  // The same sequence again is no collision.
+  audit.Record(0, f, {1, 2});
+  audit.Record(0, f, {1, 2});
+  EXPECT_EQ(1, audit.NumSampled());
+  EXPECT_EQ(0, audit.NumCollided());
+
+  // Further sequences with the fingerprint count once.
+  audit.Record(0, f, {3});
+  audit.Record(0, f, {4, 5});
+  EXPECT_EQ(1, audit.NumSampled());
+  EXPECT_EQ(1, audit.NumCollided());
+
+  // Programs are audited separately.
+  audit.Record(1, f, {3});
+  audit.Record(1, FeatureOf({7}), {7});
+  EXPECT_EQ(3, audit.NumSampled());
+  EXPECT_EQ(1, audit.NumCollided());
+  audit.Record(1, f, {1, 2});
+  EXPECT_EQ(2, audit.NumCollided());
+  EXPECT_EQ("2 of 3 sampled feature fingerprints (1 in 1) collide (66.666667%).", audit.Report());
+}
+
+TEST(FeatureCollisionAuditTest, SequenceCollisionTest) {
+  // Leading zero values are absorbed into the initial 31-bit hash, so the first three sequences
+  // share its fingerprint. The 64-bit fingerprint mixes in the positions.
+  const std::vector<std::vector<int> > sequences = {{5}, {0, 5}, {0, 0, 5}, {5, 0}, {1, 5}, {5, 1}};
+  FeatureCollisionAudit audit(1, 1);
+  for (const std::vector<int>& sequence : sequences) {
+    audit.Record(0, FeatureOf(sequence), sequence);
+  }
+#ifdef PHOG_FEATURE_HASH64
+  EXPECT_EQ(6, audit.NumSampled());
+  EXPECT_EQ(0, audit.NumCollided());
+#else
+  EXPECT_EQ(4, audit.NumSampled());
+  EXPECT_EQ(1, audit.NumCollided());
+#endif
+}
+
+TEST(FeatureCollisionAuditTest, SamplingTest) {
+  // One in four fingerprints is sampled, and sequences with the same fingerprint are sampled together.
+  FeatureCollisionAudit audit(1, 4);
+  int num_sampled = 0;
+  for (int value = 1; value <= 1000; ++value) {
+    const TCondLanguage::Feature f = FeatureOf({value, value + 1});
+    EXPECT_EQ(audit.IsSampled(f), audit.IsSampled(FeatureOf({value, value + 1})));
+    if (audit.IsSampled(f)) {
+      ++num_sampled;
+      audit.Record(0, f, {value, value + 1});
+    }
+  }
+  EXPECT_EQ(num_sampled, audit.NumSampled());
+  EXPECT_NEAR(250, num_sampled, 75);
+  EXPECT_EQ(0, audit.NumCollided());
+}
+
+TEST(TGenModelTest, MergeCountShardsTest) {
+  StringSet ss;
+  TCondLanguage lang(&ss);
+  TGenProgram program;
+  program.LoadFromStringOrDie(&lang, kProgram);
+  const std::vector<TreeStorage> trees = ParseTrees(&ss);
+
+  TGenModel model(program, false);
+  TrainOnTrees(&ss, trees, 0, trees.size(), &model);
+  model.GenerativeEndTraining();
+  model.Freeze();
+
+  // The first two trees go to one shard and the last one to the other. The second tree has pairs
+  // in common with both of the others.
+  const std::vector<std::string> shard_files = {TempDir() + "/model_test_shard0", TempDir() + "/model_test_shard1"};
+  const size_t kShardEnds[] = {2, trees.size()};
+  size_t first_tree = 0;
+  size_t num_shard_records = 0;
+  for (size_t shard = 0; shard < shard_files.size(); ++shard) {
+    TGenModel shard_model(program, false);
+    TrainOnTrees(&ss, trees, first_tree, kShardEnds[shard], &shard_model);
+    first_tree = kShardEnds[shard];
+    FILE* f = fopen(shard_files[shard].c_str(), "wb");
+    ASSERT_TRUE(f != nullptr);
+    num_shard_records += shard_model.WriteCountShardOrDie(ss, f);
+    ASSERT_EQ(0, fclose(f));
+  }
+  TGenModel merged_model(program, false);
+  merged_model.MergeCountShardsOrDie(ss, shard_files);
+  for (const std::string& file : shard_files) {
+    remove(file.c_str());
+  }
+
+  EXPECT_LT(model.NumFeatureValues(), num_shard_records);
+  EXPECT_EQ(model.NumFeatureValues(), merged_model.NumFeatureValues());
+  EXPECT_EQ(model.MemoryReport()["num_features"], merged_model.MemoryReport()["num_features"]);
+  EXPECT_EQ(ScoreTrees(&ss, trees, model), ScoreTrees(&ss, trees, merged_model));
+}
+
+TEST(TGenModelTest, ResumeFromCheckpointTest) {
+  StringSet ss;
+  TCondLanguage lang(&ss);
+  TGenProgram program;
+  program.LoadFromStringOrDie(&lang, kProgram);
+  const std::vector<TreeStorage> trees = ParseTrees(&ss);
+
+  TGenModel model(program, false);
+  TrainOnTrees(&ss, trees, 0, trees.size(), &model);
+  model.GenerativeEndTraining();
+
+  for (size_t checkpoint_tree = 0; checkpoint_tree <= trees.size(); ++checkpoint_tree) {
+    TGenModel interrupted_model(program, false);
+    TrainOnTrees(&ss, trees, 0, checkpoint_tree, &interrupted_model);
+    FILE* f = tmpfile();
+    ASSERT_TRUE(f != nullptr);
+    interrupted_model.WriteCheckpointOrDie(ss, f);
+    rewind(f);
+    TGenModel resumed_model(program, false);
+    resumed_model.ReadCheckpointOrDie(ss, f);
+    EXPECT_EQ(EOF, fgetc(f));
+    fclose(f);
+    TrainOnTrees(&ss, trees, checkpoint_tree, trees.size(), &resumed_model);
+    resumed_model.GenerativeEndTraining();
+
+    EXPECT_EQ(FeatureValueCounts(model), FeatureValueCounts(resumed_model)) << checkpoint_tree;
+    EXPECT_EQ(ScoreTrees(&ss, trees, model), ScoreTrees(&ss, trees, resumed_model)) << checkpoint_tree;
+  }
+}
+
+int main(int argc, char **argv) {
+  google::InstallFailureSignalHandler();
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -16,6 +16,8 @@
 
 #include "pbox.h"
 
+#include "base/strutil.h"
+
 DEFINE_int32(smoothing_type, 0, "Smoothing type to use. Either of:\n"
     "  --smoothing_type=0           WittenBell (default)\n"
     "  --smoothing_type=1           KneserNey\n"
@@ -24,6 +26,77 @@ DEFINE_int32(smoothing_type, 0, "Smoothing type to use. Either of:\n"
 
 DEFINE_double(kneser_ney_d, -1, "Delta used with KneserNey smoothing. Should be in the range <0,1>. If set to -1 (default) it is determined automatically.");
 
+DEFINE_int32(max_dense_labels, 1024, "Counters with at most this many distinct labels (e.g. node types) keep "
+    "per-feature label count arrays for fast lookups. Set to 0 to disable.");
+
+DEFINE_bool(compact_counts, false, "After training, keep the feature-label counts in a frozen table with "
+    "8-bit counts and 64-bit packed keys instead of the hash map used for adding. Uses less than half the "
+    "memory, but the counts can no longer be enumerated or added to.");
+
+DEFINE_bool(frozen_counts, false, "After training, convert the model statistics to a read-only format indexed by "
+    "minimal perfect hashes of the feature and (feature, label) keys. Uses 2-3x less memory for the indices, but "
+    "the model cannot be updated afterwards. Takes precedence over --compact_counts.");
+
+DEFINE_string(prune_min_counts, "", "Comma-separated minimum counts of the (feature, label) pairs kept for the "
+    "feature orders 1, 2, ...; the last value also applies to all higher orders. E.g. --prune_min_counts=1,1,2 "
+    "drops the singletons of order 3 and higher. The unconditioned distribution is never pruned. Empty (default) "
+    "keeps all pairs.");
+
+DEFINE_int32(count_sketch_mb, 0, "If positive, training memory for the feature-label counts is bounded to about "
+    "this many megabytes, split evenly between the TGen programs: half for a count-min sketch and half for the "
+    "exact counts of the pairs seen at least --count_sketch_min_count times. Other pairs are dropped from the "
+    "model. 0 (default) counts all pairs exactly.");
+
+DEFINE_int32(count_sketch_min_count, 2, "With --count_sketch_mb, the estimated count at which a feature-label "
+    "pair gets an exact count.");
+
+DEFINE_int32(feature_filter_bits_per_key, 0, "If positive, every TGen program keeps a blocked Bloom filter over its "
+    "features with this many bits per feature, such that looking up a feature that is not in the model usually "
+    "does not touch the feature table. 10 rejects about 99% of the missing features. 0 (default) disables it.");
+
+DEFINE_bool(ranked_label_lists, false, "With --frozen_counts or --save_model, the label list of every feature keeps "
+    "only the labels in decreasing order of probability, without the probabilities, which takes a quarter of the "
+    "memory for int labels. Scoring only takes the candidate labels from the lists, so the predictions do not change.");
+
+DEFINE_int32(finalization_threads, 0, "Number of threads used to compute the model statistics at the end of "
+    "training. 0 (default) uses all cores.");
+
+SketchParams SketchParams::FromFlags(int num_counters) {
+  SketchParams params;
+  if (FLAGS_count_sketch_mb <= 0) return params;
+  CHECK_GE(FLAGS_count_sketch_min_count, 1);
+  const size_t counter_bytes = (static_cast<size_t>(FLAGS_count_sketch_mb) << 20) / std::max(1, num_counters);
+  params.sketch_bytes = counter_bytes / 2;
+  params.exact_bytes = counter_bytes - params.sketch_bytes;
+  params.min_count = FLAGS_count_sketch_min_count;
+  return params;
+}
+
+PruningParams PruningParams::FromFlags() {
+  return Parse(FLAGS_prune_min_counts);
+}
+
+PruningParams PruningParams::Parse(const std::string& min_counts) {
+  PruningParams params;
+  if (min_counts.empty()) return params;
+  std::vector<std::string> parts;
+  SplitStringUsing(min_counts, ',', &parts);
+  for (const std::string& part : parts) {
+    int min_count = ParseInt32WithDefault(part, -1);
+    CHECK_GE(min_count, 0) << "Invalid minimum counts '" << min_counts << "', see --prune_min_counts";
+    params.min_counts.push_back(min_count);
+  }
+  return params;
+}
+
+StorageParams StorageParams::FromFlags() {
+  StorageParams params;
+  params.max_dense_labels = FLAGS_max_dense_labels;
+  params.feature_filter_bits_per_key = FLAGS_feature_filter_bits_per_key;
+  params.ranked_label_lists = FLAGS_ranked_label_lists;
+  return params;
+}
+
 template<class V>
 std::string DebugValue(const V* value, const StringSet* ss) {
   return value->DebugString(ss);
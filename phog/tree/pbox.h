@@ -20,13 +20,24 @@
 #include <stdio.h>
 #include <math.h>
 #include <algorithm>
+#include <limits>
 #include <memory>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 #include <iostream>
 
+#include "base/arena.h"
+#include "base/bloom_filter.h"
+#include "base/compact_count_table.h"
+#include "base/count_min_sketch.h"
+#include "base/fileutil.h"
+#include "base/flat_hash_map.h"
+#include "base/huge_pages.h"
+#include "base/minimal_perfect_hash.h"
+#include "base/parallel.h"
 #include "base/sparsehash/dense_hash_map.h"
 #include "base/stringprintf.h"
 #include "tree.h"
@@ -36,6 +47,15 @@
 
 DECLARE_int32(smoothing_type);
 DECLARE_double(kneser_ney_d);
+DECLARE_int32(max_dense_labels);
+DECLARE_bool(compact_counts);
+DECLARE_string(prune_min_counts);
+DECLARE_int32(finalization_threads);
+DECLARE_int32(feature_filter_bits_per_key);
+DECLARE_bool(ranked_label_lists);
+DECLARE_bool(frozen_counts);
+DECLARE_int32(count_sketch_mb);
+DECLARE_int32(count_sketch_min_count);
 
 template<class V>
 std::string DebugValue(const V* value, const StringSet* ss);
@@ -90,6 +110,20 @@ template <> struct deleted_key<TreeSubstitutionOnlyLabel> {
 };
 
 
+// Hash maps of the counters. Compiling with -DPHOG_SWISS_TABLE replaces them with FlatHashMap,
+// which probes 16 control bytes with one SIMD compare (see base/flat_hash_map.h). Lookups of
+// missing features, which are common at high backoff orders, then mostly cost one compare.
+// Large tables are backed by huge pages with --huge_pages.
+#ifdef PHOG_SWISS_TABLE
+template<class K, class V, class H = std::hash<K> > using CountHashMap = FlatHashMap<K, V, H>;
+template<class K, class V> using FeatureHashMap = FlatHashMap<K, V>;
+#else
+template<class K, class V, class H = std::hash<K> > using CountHashMap =
+    google::dense_hash_map<K, V, H, std::equal_to<K>, HugePageAllocator<std::pair<const K, V> > >;
+template<class K, class V> using FeatureHashMap =
+    std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, HugePageAllocator<std::pair<const K, V> > >;
+#endif
+
 // Simple class that counts the number of times something happens.
 template<class X>
 class ValueCounter {
@@ -97,14 +131,16 @@ public:
   ValueCounter() {}
   ValueCounter(const ValueCounter&) = delete;
 
+  // May also be called after EndAdding; EndAdding must then be called again.
   void AddValue(const X& value, int count) {
-    CHECK(data_.sorted_by_prob_.empty()) << "AddValue after EndAdding";
+    // Adding may rehash values_, which the sorted list points into.
+    data_.sorted_by_prob_.clear();
     data_.values_[value].Add(count);
     data_.total_count_ += count;
   }
 
   void EndAdding() {
-    CHECK(data_.sorted_by_prob_.empty()) << "EndAdding called twice.";
+    data_.sorted_by_prob_.clear();
     data_.sorted_by_prob_.reserve(data_.values_.size());
     double z = (data_.total_count_ + 1.0 * (data_.values_.size() + 1));
     for (auto it = data_.values_.begin(); it != data_.values_.end(); ++it) {
@@ -164,7 +200,7 @@ private:
   };
 
   struct Data {
-    google::dense_hash_map<X, CounterValue, std::hash<X> > values_;
+    CountHashMap<X, CounterValue> values_;
     std::vector<std::pair<double, const X*> > sorted_by_prob_;
     double unmet_log_prob_;
     int total_count_;
@@ -191,8 +227,20 @@ public:
       counts_[i] = 0;
     }
     deltas_estimated_ = false;
+    SetTotalPrefixCount(0);
+  }
+
+  // Sum of the continuation counts of the order, i.e. the number of distinct pairs of a feature of
+  // the order and a label. Kept here rather than in the coefficients of every feature, so that an
+  // update of the counts changes it for all features of the order at once.
+  void SetTotalPrefixCount(int total_prefix_count) {
+    total_prefix_count_ = total_prefix_count;
+    inv_total_prefix_count_ = total_prefix_count > 0 ? 1.0 / total_prefix_count : 0;
   }
 
+  int total_prefix_count() const { return total_prefix_count_; }
+  double inv_total_prefix_count() const { return inv_total_prefix_count_; }
+
   double GetDelta(int count) const {
     CHECK(deltas_estimated_);
     return deltas_[std::min(count,3)];
@@ -203,6 +251,20 @@ public:
     counts_[std::min(count,4)]++;
   }
 
+  // Adds the counts collected by another instance (before EndAdding).
+  void Merge(const KneserNeyDelta& o) {
+    for (int i = 0; i < 5; i++) {
+      counts_[i] += o.counts_[i];
+    }
+  }
+
+  // Undoes AddCount(count), e.g. when a count is updated after EndAdding. Call EndAdding again
+  // to re-estimate the deltas.
+  void RemoveCount(int count) {
+    CHECK(count > 0);
+    counts_[std::min(count,4)]--;
+  }
+
   void EndAdding() {
     deltas_estimated_ = true;
     LOG(INFO) << "n1: " << counts_[1] << ", n2: " << counts_[2] << ", n3: " << counts_[3] << ", n4: " << counts_[4];
@@ -229,6 +291,8 @@ private:
   bool deltas_estimated_;
   int counts_[5];
   double deltas_[4];
+  int total_prefix_count_;
+  double inv_total_prefix_count_;
 };
 
 enum SmoothingTypes {
@@ -237,97 +301,232 @@ enum SmoothingTypes {
   Laplace
 };
 
-class Smoothing {
-public:
-  Smoothing() : prob_(0), prob_tmp_(0) {}
+// Smoothing settings of a model. They are read once when the model is built and select one of the
+// smoothing policies below, so no flags are consulted while scoring.
+struct SmoothingParams {
+  SmoothingParams(SmoothingTypes type, double kneser_ney_d) : type(type), kneser_ney_d(kneser_ney_d) {}
 
-  void SetUnconditionedProb(int count, int unique_count, int total_count, int prefix_count, int total_prefix_count) {
-    prob_ = (count + 1.0) / (total_count + unique_count + 1.0);
-    if (FLAGS_smoothing_type == KneserNey) {
-      CHECK(prefix_count <= 1);
-      prob_tmp_ = (prefix_count + 1.0) / (prefix_count + total_prefix_count + 1.0);
-    }
+  static SmoothingParams FromFlags() {
+    return SmoothingParams(static_cast<SmoothingTypes>(FLAGS_smoothing_type), FLAGS_kneser_ney_d);
   }
 
-  void AddForwardBackoff(int count, int unique_count, int total_count, const std::vector<int>* counts, int prefix_count, int total_prefix_count,
-      const KneserNeyDelta* delta) {
-    switch (FLAGS_smoothing_type) {
-    case WittenBell:
-    {
-      double p_ml = static_cast<double>(count) / total_count;
-      double lambda = 1 - (unique_count / (double) (unique_count + total_count));
-      CHECK(p_ml >= 0 && p_ml <= 1);
+  // Whether continuation counts and deltas must be collected (only for KneserNey).
+  bool UsesContinuationCounts() const { return type == KneserNey; }
 
-      prob_ = lambda * p_ml + (1 - lambda) * prob_;
-      break;
-    }
-    case KneserNey:
-    {
-      if (FLAGS_kneser_ney_d != -1) {
-        // Higher order feature, use counts
-        {
-          double lambda = static_cast<double>(unique_count * FLAGS_kneser_ney_d) / total_count;
-          double p_ml = std::max(static_cast<double>(count) - FLAGS_kneser_ney_d, 0.0) / total_count;
-          CHECK(p_ml >= 0 && p_ml <= 1);
-
-          prob_ = p_ml + lambda * prob_tmp_;
-        }
+  SmoothingTypes type;
+  double kneser_ney_d;  // -1 if the deltas are estimated from the counts.
+};
 
-        // Lower order feature, use continuation
-        {
-          double lambda = static_cast<double>(prefix_count * FLAGS_kneser_ney_d) / total_prefix_count;
-          prob_tmp_ = std::max(static_cast<double>(prefix_count) - FLAGS_kneser_ney_d, 0.0) / total_prefix_count + lambda * prob_tmp_;
-        }
-      } else {
-        CHECK(delta != nullptr);
-
-        // Higher order feature, use counts
-        {
-          double lambda = (delta->GetDelta(1) * counts->at(1) + delta->GetDelta(2) * counts->at(2) + delta->GetDelta(3) * counts->at(3)) / total_count;
-          double p_ml = std::max(static_cast<double>(count) - delta->GetDelta(count), 0.0) / total_count;
-          CHECK(p_ml >= 0 && p_ml <= 1);
-
-          prob_ = p_ml + lambda * prob_tmp_;
-          // Avoid asigning zero probability, not part of Kneser-Ney Smoothing
-          if (prob_ == 0.0) {
-            prob_ = (1.0 + count) / (1.0 + unique_count + total_count);
-          }
-        }
+// Count-based pruning of the (feature, label) pairs of a model, applied in EndAdding before any
+// statistics are computed.
+struct PruningParams {
+  static PruningParams FromFlags();
+  // Parses comma-separated minimum counts in the format of --prune_min_counts.
+  static PruningParams Parse(const std::string& min_counts);
 
-        // Lower order feature, use continuation
-        {
-          double lambda = (delta->GetDelta(1) * counts->at(1) + delta->GetDelta(2) * counts->at(2) + delta->GetDelta(3) * counts->at(3)) / total_prefix_count;
-          prob_tmp_ = std::max(static_cast<double>(prefix_count) - delta->GetDelta(prefix_count), 0.0) / total_prefix_count + lambda * prob_tmp_;
-        }
-      }
-      break;
-    }
-    case Laplace:
-    {
-      prob_ = static_cast<double>(count + 1) / (total_count + unique_count + 1);
-      break;
-    }
-    default:
-      LOG(FATAL) << "Unknown smoothing type " << FLAGS_smoothing_type;
+  // Minimum count of a pair with a feature of the given order. The unconditioned feature
+  // (order 0) is never pruned.
+  int MinCount(int order) const {
+    if (order == 0 || min_counts.empty()) return 0;
+    return min_counts[std::min<size_t>(order, min_counts.size()) - 1];
+  }
+
+  bool IsEnabled() const { return !min_counts.empty(); }
 
+  // Whether every pair kept by these settings is also kept by other.
+  bool PrunesAtMost(const PruningParams& other) const {
+    for (size_t order = 1; order <= std::max(min_counts.size(), other.min_counts.size()); ++order) {
+      if (MinCount(order) > other.MinCount(order)) return false;
     }
+    return true;
   }
 
-  double GetLogProb() const {
-    return log2(prob_);
+  // Minimum counts for the orders 1, 2, ...; the last one also applies to all higher orders.
+  std::vector<int> min_counts;
+};
+
+// Bounded-memory approximate counting of the (feature, label) pairs during training. Pairs of
+// order 1 and higher are counted in a count-min sketch until their estimate reaches min_count and
+// only then get an exact count; pairs that never do are dropped from the model.
+struct SketchParams {
+  SketchParams() : sketch_bytes(0), exact_bytes(0), min_count(0) {}
+
+  // Splits the budget of --count_sketch_mb evenly between num_counters counters.
+  static SketchParams FromFlags(int num_counters);
+
+  bool IsEnabled() const { return sketch_bytes > 0; }
+
+  size_t sketch_bytes;
+  // Memory for the exact counts. Pairs reaching min_count are not added once it is used up.
+  size_t exact_bytes;
+  int min_count;
+};
+
+// How a counter stores its statistics. The defaults are those of the flags.
+struct StorageParams {
+  StorageParams() : max_dense_labels(1024), feature_filter_bits_per_key(0), ranked_label_lists(false) {}
+
+  static StorageParams FromFlags();
+
+  // Counters with at most this many distinct labels index them densely (see --max_dense_labels).
+  int max_dense_labels;
+  // Bits per feature of the Bloom filter built in EndAdding, none if 0 (see --feature_filter_bits_per_key).
+  int feature_filter_bits_per_key;
+  // Whether Freeze keeps only the ranks of the labels (see --ranked_label_lists).
+  bool ranked_label_lists;
+};
+
+// Smoothing coefficients of one feature. They depend only on the feature (and its order), not on
+// the label, so PerFeatureValueCounter computes them once in EndAdding and a backoff step of the
+// smoothing policy is then a single multiply-add. What depends on all features of an order (the
+// Kneser-Ney deltas and continuation totals) is read through delta instead, so that updating the
+// counts of some features does not change the coefficients of the others.
+struct SmoothingCoefficients {
+  SmoothingCoefficients()
+      : inv_total_count(0), backoff_weight(0), discount_mass(0), count_scale(0), laplace_scale(0),
+        discount_counts{0, 0, 0}, delta(nullptr) {}
+
+  double inv_total_count;  // 1 / total_count
+  double backoff_weight;   // Weight of the lower order probability (not with estimated deltas).
+  double discount_mass;    // KneserNey: total count discounted from the seen labels (same).
+  double count_scale;      // WittenBell: 1 / (total_count + unique_count)
+  double laplace_scale;    // 1 / (total_count + unique_count + 1)
+
+  // KneserNey with estimated deltas: the number of labels seen once, twice and three or more
+  // times, which the deltas of the order weigh into the discounted count.
+  int discount_counts[3];
+  // KneserNey: the statistics of the order of the feature (null if not collected).
+  const KneserNeyDelta* delta;
+};
+
+// Smoothing policies. Each policy accumulates the probability of one label from the lowest to the
+// highest order feature with SetUnconditionedProb followed by AddForwardBackoff for every order.
+// Users switch on SmoothingParams::type once, when a model is built, and are then templated on the
+// policy.
+class WittenBellSmoothing {
+public:
+  static const bool kUsesContinuationCounts = false;
+
+  explicit WittenBellSmoothing(const SmoothingParams&) : prob_(0) {}
+
+  static void CalculateCoefficients(
+      const SmoothingParams&, int unique_count, const int*, const KneserNeyDelta*, SmoothingCoefficients* c) {
+    c->backoff_weight = unique_count * c->count_scale;
+  }
+
+  void SetUnconditionedProb(int count, int, const SmoothingCoefficients& c) {
+    prob_ = (count + 1.0) * c.laplace_scale;
   }
 
-  double GetProb() const {
-    return prob_;
+  void AddForwardBackoff(int count, int, const SmoothingCoefficients& c) {
+    DCHECK(count * c.inv_total_count >= 0 && count * c.inv_total_count <= 1);
+    prob_ = fma(count, c.count_scale, c.backoff_weight * prob_);
   }
 
+  double GetLogProb() const { return log2(prob_); }
+  double GetProb() const { return prob_; }
+
 private:
   double prob_;
+};
+
+class KneserNeySmoothing {
+public:
+  static const bool kUsesContinuationCounts = true;
+
+  explicit KneserNeySmoothing(const SmoothingParams& params) : d_(params.kneser_ney_d), prob_(0), prob_tmp_(0) {}
+
+  static void CalculateCoefficients(
+      const SmoothingParams& params, int unique_count, const int* counts, const KneserNeyDelta* delta,
+      SmoothingCoefficients* c) {
+    c->delta = delta;
+    if (params.kneser_ney_d != -1) {
+      c->discount_mass = unique_count * params.kneser_ney_d;
+      c->backoff_weight = c->discount_mass * c->inv_total_count;
+    } else {
+      CHECK(delta != nullptr);
+      std::copy(counts + 1, counts + 4, c->discount_counts);
+    }
+  }
+
+  // Total count discounted from the seen labels of the feature with the estimated deltas.
+  static double EstimatedDiscountMass(const SmoothingCoefficients& c) {
+    return c.delta->GetDelta(1) * c.discount_counts[0] + c.delta->GetDelta(2) * c.discount_counts[1] +
+        c.delta->GetDelta(3) * c.discount_counts[2];
+  }
+
+  void SetUnconditionedProb(int count, int prefix_count, const SmoothingCoefficients& c) {
+    prob_ = (count + 1.0) * c.laplace_scale;
+    CHECK(prefix_count <= 1);
+    const int total_prefix_count = c.delta == nullptr ? 0 : c.delta->total_prefix_count();
+    prob_tmp_ = (prefix_count + 1.0) / (prefix_count + total_prefix_count + 1.0);
+  }
+
+  void AddForwardBackoff(int count, int prefix_count, const SmoothingCoefficients& c) {
+    if (d_ != -1) {
+      // Higher order feature, use counts
+      double p_ml = std::max(count - d_, 0.0) * c.inv_total_count;
+      DCHECK(p_ml >= 0 && p_ml <= 1);
+      prob_ = fma(c.backoff_weight, prob_tmp_, p_ml);
+
+      // Lower order feature, use continuation
+      const double inv_total_prefix_count = c.delta == nullptr ? 0 : c.delta->inv_total_prefix_count();
+      double lambda = prefix_count * d_ * inv_total_prefix_count;
+      prob_tmp_ = fma(lambda, prob_tmp_, std::max(prefix_count - d_, 0.0) * inv_total_prefix_count);
+    } else {
+      const KneserNeyDelta& delta = *c.delta;
+      const double discount_mass = EstimatedDiscountMass(c);
+      // Higher order feature, use counts
+      double p_ml = std::max(count - delta.GetDelta(count), 0.0) * c.inv_total_count;
+      DCHECK(p_ml >= 0 && p_ml <= 1);
+      prob_ = fma(discount_mass * c.inv_total_count, prob_tmp_, p_ml);
+      // Avoid asigning zero probability, not part of Kneser-Ney Smoothing
+      if (prob_ == 0.0) {
+        prob_ = (1.0 + count) * c.laplace_scale;
+      }
+
+      // Lower order feature, use continuation
+      double lambda = discount_mass * delta.inv_total_prefix_count();
+      prob_tmp_ = fma(lambda, prob_tmp_, std::max(prefix_count - delta.GetDelta(prefix_count), 0.0) * delta.inv_total_prefix_count());
+    }
+  }
+
+  double GetLogProb() const { return log2(prob_); }
+  double GetProb() const { return prob_; }
+
+private:
+  double d_;
+  double prob_;
 
   // helper probability for kneser ney smoothing
   double prob_tmp_;
 };
 
+class LaplaceSmoothing {
+public:
+  static const bool kUsesContinuationCounts = false;
+
+  explicit LaplaceSmoothing(const SmoothingParams&) : prob_(0) {}
+
+  static void CalculateCoefficients(
+      const SmoothingParams&, int, const int*, const KneserNeyDelta*, SmoothingCoefficients*) {
+  }
+
+  void SetUnconditionedProb(int count, int, const SmoothingCoefficients& c) {
+    prob_ = (count + 1.0) * c.laplace_scale;
+  }
+
+  void AddForwardBackoff(int count, int, const SmoothingCoefficients& c) {
+    prob_ = (count + 1.0) * c.laplace_scale;
+  }
+
+  double GetLogProb() const { return log2(prob_); }
+  double GetProb() const { return prob_; }
+
+private:
+  double prob_;
+};
+
 
 
 
@@ -510,6 +709,64 @@ template <> struct deleted_key<SequenceHashFeature> {
   }
 };
 
+// Same as SequenceHashFeature, but with a 63-bit fingerprint of the sequence. With the 31-bit
+// hash of SequenceHashFeature, distinct contexts start to merge once a model has hundreds of
+// millions of features. Selected for TCondLanguage::Feature with -DPHOG_FEATURE_HASH64.
+class SequenceHash64Feature {
+public:
+  SequenceHash64Feature() : hash_(0), size_(0) {}
+
+  static SequenceHash64Feature EmptyFeature() {
+    return SequenceHash64Feature(~0ULL, 0);
+  }
+
+  static SequenceHash64Feature DeletedFeature() {
+    return SequenceHash64Feature(~0ULL - 1, 0);
+  }
+
+  bool operator==(const SequenceHash64Feature& o) const {
+     return hash_ == o.hash_;
+   }
+
+  void PushBack(int value) {
+    // The position is mixed in, such that leading zero values are not absorbed into the initial
+    // hash (as in SequenceHashFeature, where [0, x] and [x] collide). The top bit is cleared such
+    // that the empty and the deleted feature are never produced.
+    uint64 item = (static_cast<uint64>(size_ + 1) << 32) | static_cast<unsigned>(value);
+    hash_ = FingerprintCat64(hash_, item) & 0x7FFFFFFFFFFFFFFFULL;
+    size_++;
+  }
+
+  int size() const {
+    return size_;
+  }
+
+  void WriteToFileOrDie(FILE* f) const {
+    CHECK_EQ(1, fwrite(&hash_, sizeof(uint64), 1, f));
+  }
+
+  void ReadFromFileOrDie(FILE* f) {
+    CHECK_EQ(1, fread(&hash_, sizeof(uint64), 1, f));
+  }
+
+  uint64 hash_;
+  int size_;
+private:
+  SequenceHash64Feature(uint64 hash, int size) : hash_(hash), size_(size) {}
+};
+
+template <> struct empty_key<SequenceHash64Feature> {
+  SequenceHash64Feature operator()() const {
+    return SequenceHash64Feature::EmptyFeature();
+  }
+};
+
+template <> struct deleted_key<SequenceHash64Feature> {
+  SequenceHash64Feature operator()() const {
+    return SequenceHash64Feature::DeletedFeature();
+  }
+};
+
 namespace std {
 template <> struct hash<SequenceHashFeature> {
   size_t operator()(const SequenceHashFeature& x) const {
@@ -522,6 +779,18 @@ template <> struct hash<std::pair<SequenceHashFeature, int> > {
     return FingerprintCat(std::hash<SequenceHashFeature>()(x.first), x.second);
   }
 };
+
+template <> struct hash<SequenceHash64Feature> {
+  size_t operator()(const SequenceHash64Feature& x) const {
+    return x.hash_;
+  }
+};
+
+template <> struct hash<std::pair<SequenceHash64Feature, int> > {
+  size_t operator()(const std::pair<SequenceHash64Feature, int>& x) const {
+    return FingerprintCat64(x.first.hash_, static_cast<unsigned>(x.second));
+  }
+};
 }
 
 namespace std {
@@ -552,40 +821,189 @@ template <int Bound> struct hash<BoundedSequenceFeature<Bound> > {
 };
 }
 
+/*******
+ * 64-bit key of a (feature, label) pair in the compact count table of PerFeatureValueCounter.
+ * Pairs of a 31-bit feature hash and an int label are packed exactly; the other types are
+ * fingerprinted.
+ */
+
+template<class F, class V> struct packed_key {
+  uint64 operator()(const F& feature, const V& value) const {
+    return FingerprintCat64(std::hash<F>()(feature), std::hash<V>()(value));
+  }
+};
+
+template<> struct packed_key<SequenceHashFeature, int> {
+  uint64 operator()(const SequenceHashFeature& feature, int value) const {
+    return (static_cast<uint64>(static_cast<uint32>(feature.hash_)) << 32) | static_cast<uint32>(value);
+  }
+};
+
+
+/*******
+ * Memory report of a PerFeatureValueCounter (see GetMemoryReport). The feature table, the pair
+ * table and the continuation counts are shared by all feature orders; their bytes are split
+ * between the orders in proportion to the entries of each order.
+ */
+
+struct OrderMemoryReport {
+  OrderMemoryReport()
+      : num_features(0), num_pairs(0), feature_table_bytes(0), label_bytes(0), pair_table_bytes(0),
+        kneser_ney_bytes(0) {}
+
+  size_t TotalBytes() const {
+    return feature_table_bytes + label_bytes + pair_table_bytes + kneser_ney_bytes;
+  }
+
+  size_t num_features;
+  size_t num_pairs;
+  // Share of the feature table (buckets and feature stats).
+  size_t feature_table_bytes;
+  // Label lists and label counts of the feature stats, without arena overhead.
+  size_t label_bytes;
+  // Share of the (feature, label) count table.
+  size_t pair_table_bytes;
+  // Continuation counts, count histogram and dense continuation row of the order.
+  size_t kneser_ney_bytes;
+};
+
+struct CounterMemoryReport {
+  CounterMemoryReport()
+      : num_features(0), num_pairs(0), feature_slots(0), pair_slots(0), feature_table_bytes(0),
+        feature_filter_bytes(0), label_bytes(0), pair_table_bytes(0), kneser_ney_bytes(0),
+        dense_label_bytes(0) {}
+
+  size_t TotalBytes() const {
+    return feature_table_bytes + feature_filter_bytes + label_bytes + pair_table_bytes +
+        kneser_ney_bytes + dense_label_bytes;
+  }
+
+  // Entries per slot of the tables; 0 for tables without slots (e.g. pairs kept as dense labels).
+  double FeatureLoadFactor() const {
+    return feature_slots == 0 ? 0 : static_cast<double>(num_features) / feature_slots;
+  }
+  double PairLoadFactor() const {
+    return pair_slots == 0 ? 0 : static_cast<double>(num_pairs) / pair_slots;
+  }
+
+  size_t num_features;
+  size_t num_pairs;
+  // Slots (buckets) of the feature table and the pair table.
+  size_t feature_slots;
+  size_t pair_slots;
+  size_t feature_table_bytes;
+  size_t feature_filter_bytes;
+  // The arena of the label lists and label counts.
+  size_t label_bytes;
+  size_t pair_table_bytes;
+  size_t kneser_ney_bytes;
+  size_t dense_label_bytes;
+  // Indexed by feature order.
+  std::vector<OrderMemoryReport> orders;
+};
+
 
 template<class F, class V>
 class PerFeatureValueCounter {
 public:
 
-  class ValueStats {
+  // Kneser-Ney continuation counts: for every feature order and label, the number of distinct
+  // features of that order seen with the label. Kept in one flat table keyed by (order, label),
+  // with the totals per order in an array.
+  class ContinuationCounts {
   public:
-    ValueStats() : total_count_(0) {}
+    ContinuationCounts() {
+      counts_.set_empty_key(std::pair<int, V>(-1, empty_key<V>()()));
+      counts_.set_deleted_key(std::pair<int, V>(-2, deleted_key<V>()()));
+    }
+
+    void clear() {
+      counts_.clear();
+      totals_.clear();
+    }
 
-    void AddFeatureForValue(const V& value) {
-      per_value_continuations_[value] += 1;
-      total_count_++;
+    // Records one more feature of the given order seen with the value. Returns the count before.
+    int AddFeatureForValue(int order, const V& value) {
+      if (order >= static_cast<int>(totals_.size())) {
+        totals_.resize(order + 1, 0);
+      }
+      totals_[order]++;
+      return counts_[std::pair<int, V>(order, value)]++;
     }
 
-    int GetValuePrefixCount(const V& value) const {
-      const auto it = per_value_continuations_.find(value);
-      if (it != per_value_continuations_.end()) {
+    int Get(int order, const V& value) const {
+      const auto it = counts_.find(std::pair<int, V>(order, value));
+      if (it != counts_.end()) {
         return it->second;
       }
       return 0;
     }
 
-    int TotalPrefixCount() const {
-      return total_count_;
+    int Total(int order) const {
+      return order < static_cast<int>(totals_.size()) ? totals_[order] : 0;
+    }
+
+    size_t size() const {
+      return counts_.size();
+    }
+
+    size_t MemoryBytes() const {
+      return counts_.bucket_count() * sizeof(typename decltype(counts_)::value_type) + totals_.capacity() * sizeof(int);
+    }
+
+    void Merge(const ContinuationCounts& o) {
+      for (auto it = o.counts_.begin(); it != o.counts_.end(); it++) {
+        counts_[it->first] += it->second;
+      }
+      if (o.totals_.size() > totals_.size()) {
+        totals_.resize(o.totals_.size(), 0);
+      }
+      for (size_t order = 0; order < o.totals_.size(); ++order) {
+        totals_[order] += o.totals_[order];
+      }
+    }
+
+    // CB(int order, V value, int count);
+    template<class CB>
+    void ForEach(const CB& f) const {
+      for (auto it = counts_.begin(); it != counts_.end(); it++) {
+        f(it->first.first, it->first.second, it->second);
+      }
+    }
+
+    void WriteToFileOrDie(FILE* f) const {
+      std::vector<std::pair<std::pair<int, V>, int> > entries(counts_.begin(), counts_.end());
+      WriteVectorToFileOrDie(entries, f);
+      WriteVectorToFileOrDie(totals_, f);
+    }
+
+    void ReadFromFileOrDie(FILE* f) {
+      std::vector<std::pair<std::pair<int, V>, int> > entries;
+      ReadVectorFromFileOrDie(&entries, f);
+      counts_.clear();
+      counts_.insert(entries.begin(), entries.end());
+      ReadVectorFromFileOrDie(&totals_, f);
     }
 
-    std::unordered_map<V, int> per_value_continuations_;
   private:
-    int total_count_;
+    struct KeyHash {
+      size_t operator()(const std::pair<int, V>& x) const {
+        return FingerprintCat64(x.first, std::hash<V>()(x.second));
+      }
+    };
+
+    CountHashMap<std::pair<int, V>, int, KeyHash> counts_;
+    std::vector<int> totals_;
   };
 
+  // Per-feature statistics. The label lists and label counts are arrays in the arena of the
+  // counter, so the stats are small, copies share the arrays and the counter frees all of them at
+  // once.
   class FeatureStats {
   public:
-    FeatureStats() : total_count_(0), unique_count_(0), counts_(4,0) {}
+    typedef ArenaArray<std::pair<double, V> > LabelList;
+
+    FeatureStats() : total_count_(0), unique_count_(0), order_(0), ranked_(false), sorted_by_prob_(), counts_{0, 0, 0, 0} {}
 
     int TotalCount() const {
       return total_count_;
@@ -595,16 +1013,71 @@ public:
       return unique_count_;
     }
 
-    const std::vector<int>* GetCounts() const {
-      return &counts_;
+    // Size of the feature, kept since frozen counters do not store their features.
+    int order() const {
+      return order_;
+    }
+
+    // Number of labels seen once, twice and three or more times (index 1 to 3).
+    const int* GetCounts() const {
+      return counts_;
+    }
+
+    const SmoothingCoefficients& coefficients() const {
+      return coefficients_;
+    }
+
+    // Labels with their probabilities in decreasing order. Not available once only the ranked labels
+    // are kept (see RankLabels); NumLabels and Label work in both forms.
+    const LabelList& sorted_by_prob() const {
+      CHECK(!ranked_) << "Only the ranked labels are kept (see --ranked_label_lists), use NumLabels and Label.";
+      return sorted_by_prob_;
+    }
+
+    // Whether the probabilities of the labels are kept (see sorted_by_prob).
+    bool HasLabelProbabilities() const {
+      return !ranked_;
+    }
+
+    size_t NumLabels() const {
+      return ranked_ ? ranked_labels_.size() : sorted_by_prob_.size();
+    }
+
+    // The i-th most likely label.
+    const V& Label(size_t i) const {
+      return ranked_ ? ranked_labels_[i] : sorted_by_prob_[i].second;
+    }
+
+    // Count of the label with the given dense index (see PerFeatureValueCounter::DenseLabelIndex).
+    // Only valid if the counter uses dense labels.
+    int GetDenseLabelCount(int dense_label) const {
+      if (!dense_label_counts_.empty()) {
+        // Labels added to the counter after the stats were built are past the end.
+        return dense_label < static_cast<int>(dense_label_counts_.size()) ? dense_label_counts_[dense_label] : 0;
+      }
+      auto it = std::lower_bound(sparse_label_counts_.begin(), sparse_label_counts_.end(), std::pair<int, int>(dense_label, 0));
+      if (it == sparse_label_counts_.end() || it->first != dense_label) {
+        return 0;
+      }
+      return it->second;
+    }
+
+    // Memory of the arrays of the stats in the arena of the counter.
+    size_t LabelBytes() const {
+      return (ranked_ ? ranked_labels_.size() * sizeof(V) : sorted_by_prob_.size() * sizeof(typename LabelList::value_type)) +
+          sparse_label_counts_.size() * sizeof(std::pair<int, int>) +
+          dense_label_counts_.size() * sizeof(int);
     }
 
     std::string DebugString(const StringSet* ss = nullptr) const {
       std::string result;
-      int i = 0;
-      for (auto it = sorted_by_prob_.begin(); it != sorted_by_prob_.end(); it++){
-        StringAppendF(&result, "\t%f -> %s\n", it->first, DebugValue(it->second, ss).c_str()); //it->second->DebugString(ss).c_str());
-        if (i++ > 100) {
+      for (size_t i = 0; i < NumLabels(); ++i) {
+        if (ranked_) {
+          StringAppendF(&result, "\t%s\n", DebugValue(&Label(i), ss).c_str());
+        } else {
+          StringAppendF(&result, "\t%f -> %s\n", sorted_by_prob_[i].first, DebugValue(&Label(i), ss).c_str());
+        }
+        if (i > 100) {
           result.append("\t...\n");
           break;
         }
@@ -618,26 +1091,136 @@ public:
 
     int total_count_;
     int unique_count_;
-    std::vector<std::pair<double, const V*> > sorted_by_prob_;
-    std::vector<int> counts_;
+    int order_;
+    // Whether ranked_labels_ holds the labels instead of sorted_by_prob_.
+    bool ranked_;
+    // Labels are stored with the stats so that they do not depend on the feature-value table.
+    // Frozen stats may keep the labels without their probabilities, in the same space.
+    union {
+      LabelList sorted_by_prob_;
+      ArenaArray<V> ranked_labels_;
+    };
+    int counts_[4];
+    SmoothingCoefficients coefficients_;
+
+    // Label counts by dense label index if the counter uses dense labels. Features with few labels
+    // keep (index, count) pairs sorted by index, the others a count for every label.
+    ArenaArray<std::pair<int, int> > sparse_label_counts_;
+    ArenaArray<int> dense_label_counts_;
+
+    // Makes room for num_values more calls of AddValue.
+    void ReserveValues(size_t num_values, Arena* arena) {
+      sorted_by_prob_.reserve(sorted_by_prob_.size() + num_values, arena);
+    }
 
-    void AddValue(int count, const V* value) {
+    // Drops the labels for the stats to be built again from num_values calls of AddValue. The
+    // arrays keep their memory; a label list that is too small grows to at least twice its size,
+    // so that features updated often do not leave a new array in the arena every time.
+    void ResetValues(size_t num_values, Arena* arena) {
+      DCHECK(!ranked_);
+      total_count_ = 0;
+      unique_count_ = 0;
+      std::fill(counts_, counts_ + 4, 0);
+      sorted_by_prob_.clear();
+      sparse_label_counts_.clear();
+      dense_label_counts_.clear();
+      if (num_values > sorted_by_prob_.capacity()) {
+        sorted_by_prob_.reserve(std::max(num_values, 2 * sorted_by_prob_.capacity()), arena);
+      }
+    }
+
+    // Memory reserved for the arrays of the stats in the arena of the counter.
+    size_t CapacityBytes() const {
+      return (ranked_ ? ranked_labels_.capacity() * sizeof(V) :
+                        sorted_by_prob_.capacity() * sizeof(typename LabelList::value_type)) +
+          sparse_label_counts_.capacity() * sizeof(std::pair<int, int>) +
+          dense_label_counts_.capacity() * sizeof(int);
+    }
+
+    // Moves the arrays of the stats to arena.
+    void MoveArrays(Arena* arena) {
+      if (ranked_) {
+        ranked_labels_.reallocate(arena);
+      } else {
+        sorted_by_prob_.reallocate(arena);
+      }
+      sparse_label_counts_.reallocate(arena);
+      dense_label_counts_.reallocate(arena);
+    }
+
+    void AddValue(int count, const V& value) {
       total_count_ += count;
       unique_count_++;
       // We start by storing the counts and calculate the prob later
       // when we collected the total_count and unique_count
-      sorted_by_prob_.push_back(std::pair<double, const V*>(count, value));
+      sorted_by_prob_.push_back(std::pair<double, V>(count, value));
       counts_[std::min(count, 3)]++;
     }
 
+    // Must be called before CalculateProb while sorted_by_prob_ still holds the counts.
+    template<class DenseIndex>
+    void BuildDenseLabelCounts(const DenseIndex& dense_index, int num_dense_labels, Arena* arena) {
+      if (unique_count_ * 4 > num_dense_labels) {
+        dense_label_counts_.assign(num_dense_labels, 0, arena);
+        for (const auto& item : sorted_by_prob_) {
+          dense_label_counts_[dense_index(item.second)] = static_cast<int>(item.first);
+        }
+        return;
+      }
+      sparse_label_counts_.reserve(sorted_by_prob_.size(), arena);
+      for (const auto& item : sorted_by_prob_) {
+        sparse_label_counts_.push_back(std::pair<int, int>(dense_index(item.second), static_cast<int>(item.first)));
+      }
+      std::sort(sparse_label_counts_.begin(), sparse_label_counts_.end());
+    }
+
     void CalculateProb() {
       for (auto it = sorted_by_prob_.begin(); it != sorted_by_prob_.end(); it++){
         it->first = GetMLProb(it->first);
       }
     }
 
+    // Must be called once total_count_, unique_count_ and counts_ are final. delta holds the
+    // Kneser-Ney statistics for the order of the feature (null if not collected).
+    template<class Smoothing>
+    void CalculateCoefficients(const SmoothingParams& params, const KneserNeyDelta* delta) {
+      // Nothing is kept from coefficients computed for other smoothing settings.
+      coefficients_ = SmoothingCoefficients();
+      SmoothingCoefficients& c = coefficients_;
+      c.inv_total_count = 1.0 / total_count_;
+      c.count_scale = 1.0 / (total_count_ + unique_count_);
+      c.laplace_scale = 1.0 / (total_count_ + unique_count_ + 1.0);
+      Smoothing::CalculateCoefficients(params, unique_count_, counts_, delta, &c);
+    }
+
+    // Replaces the label list by the labels alone, in the same order. Scoring computes the
+    // probabilities from the counts and only takes the candidate labels from the list, so this
+    // takes a quarter of the memory for int labels without changing any prediction. All arrays of
+    // the stats are moved to arena.
+    void RankLabels(Arena* arena) {
+      if (!ranked_) {
+        const LabelList labels = sorted_by_prob_;
+        ranked_labels_ = ArenaArray<V>();
+        ranked_labels_.reserve(labels.size(), arena);
+        for (const auto& item : labels) {
+          ranked_labels_.push_back(item.second);
+        }
+        ranked_ = true;
+      } else {
+        ranked_labels_.reallocate(arena);
+      }
+      sparse_label_counts_.reallocate(arena);
+      dense_label_counts_.reallocate(arena);
+    }
+
+    // Sorts the labels by decreasing probability. Labels of equal probability end up in the reverse
+    // of the order they were added in. EndAdding adds them in the iteration order of the
+    // feature-value table, so ties come out as when the label lists pointed into the table and
+    // were sorted by address.
     void SortValues() {
-      std::sort(sorted_by_prob_.begin(), sorted_by_prob_.end(), std::greater<std::pair<double, const V*> >());
+      std::reverse(sorted_by_prob_.begin(), sorted_by_prob_.end());
+      std::stable_sort(sorted_by_prob_.begin(), sorted_by_prob_.end(),
+          [](const std::pair<double, V>& a, const std::pair<double, V>& b) { return a.first > b.first; });
     }
 
     double GetMLProb(int count) const {
@@ -647,80 +1230,1048 @@ public:
     double GetLaplaceSmoothedMLProb(int count) const {
       return (count + 1.0) / (total_count_ + unique_count_ + 1.0);
     }
+
+    // The Kneser-Ney delta of the coefficients is stored as an index into deltas.
+    void WriteToFileOrDie(const KneserNeyDelta* deltas, FILE* f) const {
+      CHECK_EQ(1, fwrite(&total_count_, sizeof(int), 1, f));
+      CHECK_EQ(1, fwrite(&unique_count_, sizeof(int), 1, f));
+      WriteArrayToFileOrDie(ranked_ ? LabelList() : sorted_by_prob_, f);
+      WriteArrayToFileOrDie(ranked_ ? ranked_labels_ : ArenaArray<V>(), f);
+      CHECK_EQ(1, fwrite(&order_, sizeof(int), 1, f));
+      std::vector<int> counts(counts_, counts_ + 4);
+      WriteVectorToFileOrDie(counts, f);
+      SmoothingCoefficients c = coefficients_;
+      c.delta = nullptr;
+      CHECK_EQ(1, fwrite(&c, sizeof(c), 1, f));
+      int delta_index = coefficients_.delta == nullptr ? -1 : coefficients_.delta - deltas;
+      CHECK_EQ(1, fwrite(&delta_index, sizeof(int), 1, f));
+      WriteArrayToFileOrDie(sparse_label_counts_, f);
+      WriteArrayToFileOrDie(dense_label_counts_, f);
+    }
+
+    void ReadFromFileOrDie(const KneserNeyDelta* deltas, Arena* arena, FILE* f) {
+      CHECK_EQ(1, fread(&total_count_, sizeof(int), 1, f));
+      CHECK_EQ(1, fread(&unique_count_, sizeof(int), 1, f));
+      LabelList labels;
+      ReadArrayFromFileOrDie(&labels, arena, f);
+      ArenaArray<V> ranked_labels;
+      ReadArrayFromFileOrDie(&ranked_labels, arena, f);
+      ranked_ = !ranked_labels.empty();
+      if (ranked_) {
+        ranked_labels_ = ranked_labels;
+      } else {
+        sorted_by_prob_ = labels;
+      }
+      CHECK_EQ(1, fread(&order_, sizeof(int), 1, f));
+      std::vector<int> counts;
+      ReadVectorFromFileOrDie(&counts, f);
+      CHECK_EQ(4, counts.size());
+      std::copy(counts.begin(), counts.end(), counts_);
+      CHECK_EQ(1, fread(&coefficients_, sizeof(coefficients_), 1, f));
+      int delta_index = -1;
+      CHECK_EQ(1, fread(&delta_index, sizeof(int), 1, f));
+      coefficients_.delta = delta_index < 0 ? nullptr : deltas + delta_index;
+      ReadArrayFromFileOrDie(&sparse_label_counts_, arena, f);
+      ReadArrayFromFileOrDie(&dense_label_counts_, arena, f);
+    }
+
+    // Same file format as WriteVectorToFileOrDie.
+    template<class T>
+    static void WriteArrayToFileOrDie(const ArenaArray<T>& array, FILE* f) {
+      unsigned long long size = array.size();
+      CHECK_EQ(1, fwrite(&size, sizeof(size), 1, f));
+      if (size > 0) {
+        CHECK_EQ(size, fwrite(array.data(), sizeof(T), size, f));
+      }
+    }
+
+    template<class T>
+    static void ReadArrayFromFileOrDie(ArenaArray<T>* array, Arena* arena, FILE* f) {
+      unsigned long long size = 0;
+      CHECK_EQ(1, fread(&size, sizeof(size), 1, f));
+      array->reset();
+      array->assign(size, T(), arena);
+      if (size > 0) {
+        CHECK_EQ(size, fread(array->data(), sizeof(T), size, f));
+      }
+    }
   };
 
 private:
-  google::dense_hash_map<std::pair<F, V>, int, std::hash<std::pair<F, V> > > feature_value_counts_;
-  std::unordered_map<F, FeatureStats> feature_stats_;
-  std::unordered_map<int, ValueStats> value_stats_;
-  std::unordered_map<int, KneserNeyDelta> deltas_;
-  const std::vector<std::pair<double, const V*> > empty_vec_;
+  CountHashMap<std::pair<F, V>, int> feature_value_counts_;
+  FeatureHashMap<F, FeatureStats> feature_stats_;
+  // Owns the arrays of all feature stats. Arrays replaced by incremental updates are freed when
+  // they take half of the arena (see CompactArena) or all stats are rebuilt.
+  Arena arena_;
+  size_t unused_arena_bytes_;
+  // Kneser-Ney statistics (only collected if smoothing_.UsesContinuationCounts()). The deltas are
+  // indexed by feature order.
+  ContinuationCounts continuations_;
+  std::vector<KneserNeyDelta> deltas_;
+  // Continuation counts by dense label * deltas_.size() + order if the counter uses dense labels.
+  std::vector<int> dense_continuations_;
+  const typename FeatureStats::LabelList empty_vec_;
+  SmoothingParams smoothing_;
+
+  PruningParams pruning_;
+  // Number of pruned pairs by feature order.
+  std::vector<size_t> num_pruned_by_order_;
+  StorageParams storage_;
+
+  SketchParams sketch_params_;
+  // Allocated on the first pair that goes to it.
+  CountMinSketch sketch_;
+  size_t max_exact_pairs_;
+  size_t num_promoted_;
+  // Sum of the increments that were dropped because their pair reached min_count when no exact
+  // counts could be added anymore. The earlier increments of these pairs are only in the sketch.
+  size_t num_rejected_increments_;
+
+  // Features of the counter (see --feature_filter_bits_per_key). Empty if disabled.
+  BlockedBloomFilter feature_filter_;
+  // Number of features the filter was built for.
+  size_t feature_filter_num_keys_;
+
+  // Expected number of features (see Presize), 0 if unknown.
+  size_t expected_num_features_;
+
+  // Pairs given by AddFinalCount, by packed key. Replaces feature_value_counts_ until Freeze().
+  std::vector<std::pair<uint64, int> > final_counts_;
+  // Labels of the last feature given to AddFinalCount, added to its stats when the feature changes.
+  F pending_feature_;
+  std::vector<std::pair<int, V> > pending_values_;
+
+  // Set by the first EndAdding. Pairs added later are tracked so that the next EndAdding only
+  // recomputes the stats of the features they belong to.
+  bool finalized_;
+  int max_feature_size_;
+  // Features changed since the last EndAdding with the labels that are new to them.
+  std::unordered_map<F, std::vector<V> > dirty_features_;
+  // Orders whose Kneser-Ney continuation counts and deltas changed since the last EndAdding.
+  std::unordered_set<int> dirty_orders_;
+  // Set if an update cannot be applied incrementally (e.g. a new highest order).
+  bool refinalize_all_;
+
+  // Replaces feature_value_counts_ after EndAdding if --compact_counts is set.
+  CompactCountTable<uint8> compact_counts_;
+  bool compact_;
+
+  // Read-only index that replaces feature_stats_ and feature_value_counts_ after Freeze().
+  // Features and (feature, label) pairs are addressed by minimal perfect hashes of their keys and
+  // every entry keeps a fingerprint of its key to reject keys that are not in the model. The pairs
+  // are not kept if the counter uses dense labels, since the feature stats then have the counts.
+  MinimalPerfectHash frozen_feature_index_;
+  std::vector<std::pair<uint32, FeatureStats>, HugePageAllocator<std::pair<uint32, FeatureStats> > > frozen_feature_stats_;
+  MinimalPerfectHash frozen_pair_index_;
+  std::vector<std::pair<uint32, int>, HugePageAllocator<std::pair<uint32, int> > > frozen_pair_counts_;
+  size_t frozen_num_feature_values_;
+  bool frozen_;
+
+  static uint64 FeatureKey(const F& feature) {
+    return std::hash<F>()(feature);
+  }
+
+  static uint32 KeyFingerprint(uint64 key) {
+    return FingerprintCat64(key, 0) >> 32;
+  }
+
+  // Labels by dense index and the inverse mapping. Empty if the counter has more than
+  // --max_dense_labels distinct labels.
+  std::vector<V> dense_labels_;
+  // Not a dense_hash_map: empty_key<int> and deleted_key<int> are valid TEq labels.
+  std::unordered_map<V, int> dense_label_index_;
+
+  // Collects the label alphabet if it is small enough. Must be called before the stats are
+  // finalized.
+  void BuildDenseLabels() {
+    dense_labels_.clear();
+    dense_label_index_.clear();
+    for (auto it = feature_stats_.begin(); it != feature_stats_.end(); it++) {
+      if (static_cast<int>(dense_labels_.size()) > storage_.max_dense_labels) break;
+      for (const auto& item : it->second.sorted_by_prob_) {
+        if (dense_label_index_.insert(std::make_pair(item.second, static_cast<int>(dense_labels_.size()))).second) {
+          dense_labels_.push_back(item.second);
+        }
+      }
+    }
+    if (static_cast<int>(dense_labels_.size()) > storage_.max_dense_labels) {
+      dense_labels_.clear();
+      dense_label_index_.clear();
+    }
+  }
+
+  template<class Smoothing>
+  void EndAddingWithSmoothing(int num_threads) {
+    feature_stats_.clear();
+    arena_.Clear();
+    unused_arena_bytes_ = 0;
+    continuations_.clear();
+    deltas_.clear();
+
+    // The pairs are grouped by feature in num_threads partitions (by feature hash), each built
+    // by one thread, and then merged. The content of the stats does not depend on the
+    // partitioning.
+    struct Partition {
+      Partition() : max_feature_size(-1) {}
+      FeatureHashMap<F, FeatureStats> feature_stats;
+      Arena arena;
+      ContinuationCounts continuations;
+      std::vector<KneserNeyDelta> deltas;
+      int max_feature_size;
+    };
+    // A pair of the partition. Sorting the pairs by feature hash gives the labels of every feature
+    // at once, so that its label list is allocated with the right size and the stats are looked
+    // up once per feature. The sort is stable to keep the labels in table order (see SortValues).
+    struct PartitionPair {
+      size_t feature_hash;
+      const std::pair<F, V>* pair;
+      int count;
+      bool operator<(const PartitionPair& o) const { return feature_hash < o.feature_hash; }
+    };
+    const size_t num_partitions = num_threads;
+    // The table is cut in contiguous slices, and each thread hashes the pairs of one slice into a
+    // bucket per partition, so that the pairs are scanned once in total. A partition then takes
+    // its buckets in slice order, which keeps its pairs in table order.
+    const size_t num_slices = std::max<size_t>(1, std::min(feature_value_counts_.size(), num_partitions));
+    std::vector<decltype(feature_value_counts_.begin())> slice_begin;
+    slice_begin.reserve(num_slices + 1);
+    {
+      size_t i = 0;
+      for (auto it = feature_value_counts_.begin(); it != feature_value_counts_.end(); it++, i++) {
+        if (i == slice_begin.size() * feature_value_counts_.size() / num_slices) {
+          slice_begin.push_back(it);
+        }
+      }
+      while (slice_begin.size() <= num_slices) {
+        slice_begin.push_back(feature_value_counts_.end());
+      }
+    }
+    std::vector<std::vector<std::vector<PartitionPair> > > buckets(
+        num_slices, std::vector<std::vector<PartitionPair> >(num_partitions));
+    ParallelFor(num_slices, num_threads, [this, &slice_begin, &buckets, num_partitions](size_t slice) {
+      for (auto& bucket : buckets[slice]) {
+        bucket.reserve(feature_value_counts_.size() / buckets.size() / num_partitions);
+      }
+      for (auto it = slice_begin[slice]; it != slice_begin[slice + 1]; it++) {
+        const size_t feature_hash = std::hash<F>()(it->first.first);
+        const size_t partition_id = num_partitions > 1 ? FingerprintCat64(feature_hash, 0) % num_partitions : 0;
+        buckets[slice][partition_id].push_back(PartitionPair{feature_hash, &it->first, it->second});
+      }
+    });
+
+    std::vector<Partition> partitions(num_partitions);
+    ParallelFor(partitions.size(), num_threads, [this, &partitions, &buckets](size_t partition_id) {
+      Partition& partition = partitions[partition_id];
+      partition.feature_stats.reserve(expected_num_features_ / partitions.size());
+      std::vector<PartitionPair> pairs;
+      size_t num_pairs = 0;
+      for (const auto& slice_buckets : buckets) {
+        num_pairs += slice_buckets[partition_id].size();
+      }
+      pairs.reserve(num_pairs);
+      for (auto& slice_buckets : buckets) {
+        pairs.insert(pairs.end(), slice_buckets[partition_id].begin(), slice_buckets[partition_id].end());
+        std::vector<PartitionPair>().swap(slice_buckets[partition_id]);
+      }
+      for (const PartitionPair& pair : pairs) {
+        const int order = pair.pair->first.size();
+        partition.max_feature_size = std::max(partition.max_feature_size, order);
+        // Value stats and deltas are only used for continuation counts for Kneser-Ney smoothing
+        if (Smoothing::kUsesContinuationCounts) {
+          partition.continuations.AddFeatureForValue(order, pair.pair->second);
+          if (order >= static_cast<int>(partition.deltas.size())) {
+            partition.deltas.resize(order + 1);
+          }
+          partition.deltas[order].AddCount(pair.count);
+        }
+      }
+
+      std::stable_sort(pairs.begin(), pairs.end());
+      for (size_t begin = 0, end = 0; begin < pairs.size(); begin = end) {
+        const F& feature = pairs[begin].pair->first;
+        for (end = begin + 1; end < pairs.size() && pairs[end].feature_hash == pairs[begin].feature_hash; ++end) {}
+        FeatureStats& stats = partition.feature_stats[feature];
+        stats.ReserveValues(end - begin, &partition.arena);
+        bool has_other_features = false;
+        for (size_t i = begin; i < end; ++i) {
+          if (pairs[i].pair->first == feature) {
+            stats.AddValue(pairs[i].count, pairs[i].pair->second);
+          } else {
+            has_other_features = true;
+          }
+        }
+        // Distinct features with the same hash (rare) get their labels one by one.
+        for (size_t i = begin; has_other_features && i < end; ++i) {
+          if (!(pairs[i].pair->first == feature)) {
+            FeatureStats& other = partition.feature_stats[pairs[i].pair->first];
+            other.ReserveValues(1, &partition.arena);
+            other.AddValue(pairs[i].count, pairs[i].pair->second);
+          }
+        }
+      }
+    });
+
+    int max_feature_size = -1;
+    size_t num_features = 0;
+    for (const Partition& partition : partitions) {
+      num_features += partition.feature_stats.size();
+    }
+    feature_stats_.reserve(num_features);
+    for (Partition& partition : partitions) {
+      for (auto& it : partition.feature_stats) {
+        feature_stats_.insert(std::make_pair(it.first, std::move(it.second)));
+      }
+      partition.feature_stats.clear();
+      arena_.Merge(&partition.arena);
+      continuations_.Merge(partition.continuations);
+      if (partition.deltas.size() > deltas_.size()) {
+        deltas_.resize(partition.deltas.size());
+      }
+      for (size_t order = 0; order < partition.deltas.size(); ++order) {
+        deltas_[order].Merge(partition.deltas[order]);
+      }
+      max_feature_size = std::max(max_feature_size, partition.max_feature_size);
+    }
+    FinishEndAdding<Smoothing>(max_feature_size, num_threads);
+  }
+
+  // Estimates the Kneser-Ney deltas once continuations_ and the per-order pair counts in deltas_
+  // are collected.
+  void EstimateDeltas(int max_feature_size) {
+    //We want the higher order of deltas be estimated from value counts, the rest from prefix counts
+    for (int order = 0; order < max_feature_size; ++order) {
+      deltas_[order].clear();
+    }
+    continuations_.ForEach([this, max_feature_size](int order, const V&, int count) {
+      if (order != max_feature_size) {
+        deltas_[order].AddCount(count);
+      }
+    });
+    for (int order = 0; order <= max_feature_size; ++order) {
+      if (continuations_.Total(order) == 0) continue;
+      LOG(INFO) << "Estimates for order " << order;
+      deltas_[order].EndAdding();
+    }
+    for (size_t order = 0; order < deltas_.size(); ++order) {
+      deltas_[order].SetTotalPrefixCount(continuations_.Total(order));
+    }
+  }
+
+  // Records a pair for the Kneser-Ney statistics: a continuation of its label and its count in the
+  // count histogram of its order.
+  void AddContinuation(int order, const V& value, int count) {
+    continuations_.AddFeatureForValue(order, value);
+    if (order >= static_cast<int>(deltas_.size())) {
+      deltas_.resize(order + 1);
+    }
+    deltas_[order].AddCount(count);
+  }
+
+  // Estimates the Kneser-Ney deltas and finalizes all feature stats once feature_stats_,
+  // continuations_ and the per-order pair counts in deltas_ are collected.
+  template<class Smoothing>
+  void FinishEndAdding(int max_feature_size, int num_threads) {
+    if (Smoothing::kUsesContinuationCounts) {
+      EstimateDeltas(max_feature_size);
+    }
+
+    BuildDenseLabels();
+    if (Smoothing::kUsesContinuationCounts) {
+      BuildDenseContinuations();
+    }
+    std::vector<std::pair<const F*, FeatureStats*> > features;
+    features.reserve(feature_stats_.size());
+    for (auto it = feature_stats_.begin(); it != feature_stats_.end(); it++) {
+      features.emplace_back(&it->first, &it->second);
+    }
+    // Each slice of the features allocates its dense label counts from its own arena.
+    const size_t num_slices = std::min<size_t>(features.size(), static_cast<size_t>(num_threads) * 4);
+    std::vector<Arena> arenas(num_slices);
+    ParallelFor(num_slices, num_threads, [this, &features, &arenas, num_slices](size_t slice) {
+      for (size_t i = slice * features.size() / num_slices; i < (slice + 1) * features.size() / num_slices; ++i) {
+        FinalizeFeatureStats<Smoothing>(*features[i].first, features[i].second, &arenas[slice]);
+      }
+    });
+    for (Arena& arena : arenas) {
+      arena_.Merge(&arena);
+    }
+    max_feature_size_ = max_feature_size;
+  }
+
+  // Sorts the labels of a feature and computes its coefficients. The counts of the feature and
+  // the Kneser-Ney statistics of its order must be final.
+  template<class Smoothing>
+  void FinalizeFeatureStats(const F& feature, FeatureStats* stats, Arena* arena) {
+    if (UsesDenseLabels()) {
+      stats->BuildDenseLabelCounts([this](const V& label) -> int {
+        return dense_label_index_.find(label)->second;
+      }, dense_labels_.size(), arena);
+    }
+    stats->order_ = feature.size();
+    stats->CalculateProb();
+    stats->SortValues();
+    CalculateFeatureCoefficients<Smoothing>(feature, stats);
+  }
+
+  template<class Smoothing>
+  void CalculateFeatureCoefficients(const F& feature, FeatureStats* stats) {
+    const int order = feature.size();
+    if (Smoothing::kUsesContinuationCounts && order < static_cast<int>(deltas_.size())) {
+      stats->template CalculateCoefficients<Smoothing>(smoothing_, &deltas_[order]);
+    } else {
+      stats->template CalculateCoefficients<Smoothing>(smoothing_, nullptr);
+    }
+  }
+
+  // The part of bytes taken by part of total entries.
+  static size_t MemoryShare(size_t bytes, size_t part, size_t total) {
+    return total == 0 ? 0 : static_cast<size_t>(static_cast<double>(bytes) * part / total);
+  }
+
+  // Copies the continuation counts of the dense labels to dense_continuations_, with the counts
+  // of a label for all orders next to each other, so that labels added later by updates go at
+  // the end.
+  void BuildDenseContinuations() {
+    dense_continuations_.clear();
+    if (!UsesDenseLabels()) return;
+    const size_t num_orders = deltas_.size();
+    dense_continuations_.assign(dense_labels_.size() * num_orders, 0);
+    continuations_.ForEach([this, num_orders](int order, const V& value, int count) {
+      dense_continuations_[dense_label_index_.find(value)->second * num_orders + order] = count;
+    });
+  }
+
+  // Updates the statistics for a pair added after EndAdding. old_count is the count of the pair
+  // before the update.
+  void RecordUpdate(const F& feature, const V& value, int old_count, int count) {
+    CHECK(!pruning_.IsEnabled()) << "Counts cannot be updated after EndAdding with pruning enabled";
+    if (count <= 0) return;
+    std::vector<V>& new_labels = dirty_features_[feature];
+    if (old_count == 0) {
+      new_labels.push_back(value);
+      if (UsesDenseLabels() && DenseLabelIndex(value) < 0) {
+        if (static_cast<int>(dense_labels_.size()) < storage_.max_dense_labels) {
+          dense_label_index_[value] = dense_labels_.size();
+          dense_labels_.push_back(value);
+        } else {
+          refinalize_all_ = true;
+        }
+      }
+    }
+    if (!smoothing_.UsesContinuationCounts()) return;
+
+    const int order = feature.size();
+    if (order > max_feature_size_) {
+      refinalize_all_ = true;
+      return;
+    }
+    // Keep the count histograms of KneserNeyDelta as EndAddingWithSmoothing builds them: from
+    // the pair counts for the highest order and from the continuation counts for the others.
+    KneserNeyDelta& delta = deltas_[order];
+    if (order == max_feature_size_) {
+      if (old_count > 0) delta.RemoveCount(old_count);
+      delta.AddCount(old_count + count);
+    }
+    if (old_count == 0) {
+      int continuations = continuations_.AddFeatureForValue(order, value);
+      if (order != max_feature_size_) {
+        if (continuations > 0) delta.RemoveCount(continuations);
+        delta.AddCount(continuations + 1);
+      }
+      const int dense_label = DenseLabelIndex(value);
+      if (dense_label >= 0) {
+        const size_t index = dense_label * deltas_.size() + order;
+        if (index >= dense_continuations_.size()) {
+          dense_continuations_.resize((dense_label + 1) * deltas_.size(), 0);
+        }
+        dense_continuations_[index] = continuations + 1;
+      }
+    }
+    dirty_orders_.insert(order);
+  }
+
+  // Recomputes the stats of the features changed since the last EndAdding. The Kneser-Ney
+  // statistics that the other features of a changed order depend on are shared through their
+  // KneserNeyDelta, so only the changed features are visited.
+  template<class Smoothing>
+  void UpdateDirtyFeatures() {
+    for (int order : dirty_orders_) {
+      deltas_[order].EndAdding();
+      deltas_[order].SetTotalPrefixCount(continuations_.Total(order));
+    }
+    // The labels of a dirty feature are re-added new ones first, so unlike after a full EndAdding,
+    // labels of equal probability are not in the iteration order of the table.
+    for (auto& dirty : dirty_features_) {
+      auto it = feature_stats_.find(dirty.first);
+      if (it == feature_stats_.end()) {
+        it = feature_stats_.insert(std::make_pair(dirty.first, FeatureStats())).first;
+        AddToFeatureFilter(dirty.first);
+      }
+      FeatureStats& stats = it->second;
+      std::vector<V>& labels = dirty.second;
+      for (const auto& item : stats.sorted_by_prob_) {
+        labels.push_back(item.second);
+      }
+      // Arrays that grow are left behind in the arena.
+      const size_t capacity_bytes = stats.CapacityBytes();
+      const size_t used_bytes = arena_.UsedBytes();
+      stats.ResetValues(labels.size(), &arena_);
+      for (const V& label : labels) {
+        stats.AddValue(GetCount(dirty.first, label), label);
+      }
+      FinalizeFeatureStats<Smoothing>(dirty.first, &stats, &arena_);
+      unused_arena_bytes_ += arena_.UsedBytes() - used_bytes + capacity_bytes - stats.CapacityBytes();
+    }
+    if (unused_arena_bytes_ * 2 > arena_.UsedBytes()) {
+      CompactArena();
+    }
+  }
+
+  // Moves the arrays of all stats to a new arena, which frees the arrays left behind by updates.
+  void CompactArena() {
+    Arena arena;
+    for (auto it = feature_stats_.begin(); it != feature_stats_.end(); it++) {
+      it->second.MoveArrays(&arena);
+    }
+    arena_ = std::move(arena);
+    unused_arena_bytes_ = 0;
+  }
+
+  // Recomputes the coefficients of all features for smoothing_. The Kneser-Ney statistics are
+  // collected from the pairs first if the previous smoothing did not need them.
+  template<class Smoothing>
+  void RecalculateCoefficients(int num_threads) {
+    if (Smoothing::kUsesContinuationCounts && deltas_.empty()) {
+      for (auto it = feature_value_counts_.begin(); it != feature_value_counts_.end(); it++) {
+        AddContinuation(it->first.first.size(), it->first.second, it->second);
+      }
+      EstimateDeltas(max_feature_size_);
+      BuildDenseContinuations();
+    }
+    std::vector<std::pair<const F*, FeatureStats*> > features;
+    features.reserve(feature_stats_.size());
+    for (auto it = feature_stats_.begin(); it != feature_stats_.end(); it++) {
+      features.emplace_back(&it->first, &it->second);
+    }
+    ParallelFor(features.size(), num_threads, [this, &features](size_t i) {
+      CalculateFeatureCoefficients<Smoothing>(*features[i].first, features[i].second);
+    });
+  }
+
+  // Builds the filter over the features in feature_stats_.
+  void BuildFeatureFilter() {
+    feature_filter_.clear();
+    feature_filter_num_keys_ = 0;
+    if (storage_.feature_filter_bits_per_key <= 0) return;
+    feature_filter_.Init(feature_stats_.size(), storage_.feature_filter_bits_per_key);
+    for (auto it = feature_stats_.begin(); it != feature_stats_.end(); it++) {
+      feature_filter_.Add(FeatureKey(it->first));
+    }
+    feature_filter_num_keys_ = feature_stats_.size();
+  }
+
+  // Adds a feature added by an update to the filter. The filter is built again once it holds
+  // twice the keys it was sized for, which keeps its false positive rate bounded.
+  void AddToFeatureFilter(const F& feature) {
+    if (feature_filter_.empty()) return;
+    if (feature_stats_.size() > 2 * std::max<size_t>(1, feature_filter_num_keys_)) {
+      BuildFeatureFilter();
+    } else {
+      feature_filter_.Add(FeatureKey(feature));
+    }
+  }
+
+  // Adds the labels collected by AddFinalCount to the stats of their feature.
+  void AddPendingValues() {
+    if (pending_values_.empty()) return;
+    FeatureStats& stats = feature_stats_[pending_feature_];
+    stats.ReserveValues(pending_values_.size(), &arena_);
+    for (const auto& item : pending_values_) {
+      stats.AddValue(item.first, item.second);
+    }
+    pending_values_.clear();
+  }
+
+  void CountPruned(int order) {
+    if (static_cast<int>(num_pruned_by_order_.size()) <= order) {
+      num_pruned_by_order_.resize(order + 1);
+    }
+    num_pruned_by_order_[order]++;
+  }
+
+  // Drops the pairs with a count below the minimum count of their order.
+  void Prune() {
+    for (auto it = feature_value_counts_.begin(); it != feature_value_counts_.end(); it++) {
+      if (it->second < pruning_.MinCount(it->first.first.size())) {
+        CountPruned(it->first.first.size());
+        feature_value_counts_.erase(it);
+      }
+    }
+    // Shrinks the table now that it has fewer elements.
+    feature_value_counts_.resize(0);
+  }
+
+  // Counts a pair without an exact count in the sketch. Returns the count to add to its exact
+  // count (the whole estimate if the pair gets promoted), or 0 if it stays in the sketch.
+  int AddToSketch(const F& feature, const V& value, int count) {
+    if (sketch_.empty()) {
+      sketch_.Init(sketch_params_.sketch_bytes);
+      // Each entry in the hash map may take up to 4x its size (load factor and growth).
+      max_exact_pairs_ = sketch_params_.exact_bytes / (4 * sizeof(typename decltype(feature_value_counts_)::value_type));
+    }
+    const uint32 estimate = sketch_.Add(packed_key<F, V>()(feature, value), count);
+    if (static_cast<int64>(estimate) < sketch_params_.min_count) return 0;
+    if (feature_value_counts_.size() >= max_exact_pairs_) {
+      LOG_IF(WARNING, num_rejected_increments_ == 0) << "Exact counts full with " << max_exact_pairs_
+          << " pairs, further pairs are dropped. Increase --count_sketch_mb.";
+      num_rejected_increments_ += count;
+      return 0;
+    }
+    num_promoted_++;
+    return std::min<uint32>(estimate, std::numeric_limits<int>::max());
+  }
 
 public:
-  PerFeatureValueCounter() {
+  explicit PerFeatureValueCounter(const SmoothingParams& smoothing = SmoothingParams::FromFlags())
+      : unused_arena_bytes_(0), smoothing_(smoothing), pruning_(),
+        max_exact_pairs_(0), num_promoted_(0), num_rejected_increments_(0), feature_filter_num_keys_(0), expected_num_features_(0),
+        finalized_(false), max_feature_size_(-1), refinalize_all_(false), compact_(false),
+        frozen_num_feature_values_(0), frozen_(false) {
     feature_value_counts_.set_empty_key(std::pair<F, V>(empty_key<F>()(), empty_key<V>()()));
     feature_value_counts_.set_deleted_key(std::pair<F, V>(deleted_key<F>()(), deleted_key<V>()()));
   }
 
-  void AddValue(const F& feature, const V& value, int count) {
-    feature_value_counts_[std::pair<F, V>(feature, value)] += count;
+  // Smoothing used to compute the per-feature coefficients. Must be set before EndAdding.
+  const SmoothingParams& smoothing() const { return smoothing_; }
+  void set_smoothing(const SmoothingParams& smoothing) { smoothing_ = smoothing; }
+
+  // Pruning applied at the start of EndAdding (see --prune_min_counts).
+  const PruningParams& pruning() const { return pruning_; }
+  void set_pruning(const PruningParams& pruning) { pruning_ = pruning; }
+
+  // Number of pairs removed by pruning, in total and by feature order (trailing orders without
+  // pruned pairs are left out).
+  size_t NumPruned() const {
+    size_t result = 0;
+    for (size_t n : num_pruned_by_order_) result += n;
+    return result;
   }
+  const std::vector<size_t>& NumPrunedByOrder() const { return num_pruned_by_order_; }
 
-  void EndAdding() {
-    feature_stats_.clear();
-    value_stats_.clear();
-    deltas_.clear();
+  // Storage of the statistics. Must be set before EndAdding.
+  const StorageParams& storage() const { return storage_; }
+  void set_storage(const StorageParams& storage) { storage_ = storage; }
 
-    int max_feature_size = -1;
-    for (auto it = feature_value_counts_.begin(); it != feature_value_counts_.end(); it++){
-      feature_stats_[it->first.first].AddValue(it->second, &it->first.second);
-
-      max_feature_size = std::max(max_feature_size, it->first.first.size());
-      // Value stats and deltas are only used for continuation counts for Kneser-Ney smoothing
-      if (FLAGS_smoothing_type == KneserNey) {
-        value_stats_[it->first.first.size()].AddFeatureForValue(it->first.second);
-        deltas_[it->first.first.size()].AddCount(it->second);
-      }
-    }
-
-    if (FLAGS_smoothing_type == KneserNey) {
-      //We want the higher order of deltas be estimated from value counts, the rest from prefix counts
-      for (const auto it : value_stats_) {
-        LOG(INFO) << "Estimates for order " << it.first;
-        auto delta_it = deltas_.find(it.first);
-        CHECK(delta_it != deltas_.end());
-        if (it.first == max_feature_size) {
-          delta_it->second.EndAdding();
-          continue;
-        }
+  // Approximate counting (see --count_sketch_mb). Must be set before any values are added.
+  const SketchParams& sketch() const { return sketch_params_; }
+  void set_sketch(const SketchParams& sketch) {
+    CHECK(feature_value_counts_.empty()) << "The sketch must be set before adding values";
+    sketch_params_ = sketch;
+  }
 
-        delta_it->second.clear();
-        for (const auto prefix : it.second.per_value_continuations_) {
-          delta_it->second.AddCount(prefix.second);
-        }
-        delta_it->second.EndAdding();
+  // Sizes the tables for the expected number of distinct pairs and features before adding values,
+  // so that they do not have to grow by rehashing (see TGenModel::EndPresizing).
+  void Presize(size_t num_pairs, size_t num_features) {
+    if (!sketch_params_.IsEnabled()) {
+      feature_value_counts_.resize(std::max(num_pairs, feature_value_counts_.size()));
+    }
+    expected_num_features_ = num_features;
+  }
+
+  // Number of pairs that got an exact count after reaching the minimum count in the sketch.
+  size_t NumPromotedFromSketch() const { return num_promoted_; }
+  // Sum of the increments dropped because the exact counts were full (see num_rejected_increments_).
+  size_t NumRejectedIncrements() const { return num_rejected_increments_; }
+
+  // Values may also be added after EndAdding. They take effect with the next call of EndAdding,
+  // which then only recomputes the stats of the changed features.
+  void AddValue(const F& feature, const V& value, int count) {
+    CHECK(!compact_ && !frozen_) << "Cannot add values to compacted or frozen counts";
+    const std::pair<F, V> key(feature, value);
+    if (sketch_params_.IsEnabled() && feature.size() > 0 &&
+        feature_value_counts_.find(key) == feature_value_counts_.end()) {
+      count = AddToSketch(feature, value, count);
+      if (count == 0) return;
+    }
+    int& pair_count = feature_value_counts_[key];
+    if (finalized_) {
+      RecordUpdate(feature, value, pair_count, count);
+    }
+    pair_count += count;
+  }
+
+  // Computes the stats of all features. Large counters can use several threads (see
+  // --finalization_threads); the result does not depend on the number of threads.
+  void EndAdding(int num_threads = 1) {
+    CHECK(!compact_ && !frozen_) << "The counts were already compacted or frozen";
+    num_threads = std::max(1, num_threads);
+    if (finalized_ && !refinalize_all_) {
+      switch (smoothing_.type) {
+      case WittenBell: UpdateDirtyFeatures<WittenBellSmoothing>(); break;
+      case KneserNey: UpdateDirtyFeatures<KneserNeySmoothing>(); break;
+      case Laplace: UpdateDirtyFeatures<LaplaceSmoothing>(); break;
+      default: LOG(FATAL) << "Unknown smoothing type " << smoothing_.type;
       }
+    } else {
+      if (pruning_.IsEnabled()) {
+        Prune();
+      }
+      switch (smoothing_.type) {
+      case WittenBell: EndAddingWithSmoothing<WittenBellSmoothing>(num_threads); break;
+      case KneserNey: EndAddingWithSmoothing<KneserNeySmoothing>(num_threads); break;
+      case Laplace: EndAddingWithSmoothing<LaplaceSmoothing>(num_threads); break;
+      default: LOG(FATAL) << "Unknown smoothing type " << smoothing_.type;
+      }
+    }
+    if (!finalized_ || refinalize_all_) {
+      BuildFeatureFilter();
+    }
+    finalized_ = true;
+    refinalize_all_ = false;
+    dirty_features_.clear();
+    dirty_orders_.clear();
+  }
+
+  // Switches a trained counter to other smoothing settings. The counts and the sorted labels do
+  // not depend on the smoothing, so only the coefficients of the features are recomputed (and the
+  // Kneser-Ney statistics collected when switching to it). Not available once compacted or frozen.
+  void Resmooth(const SmoothingParams& smoothing, int num_threads = 1) {
+    CHECK(finalized_ && !compact_ && !frozen_) << "Only trained counts that are not compacted or frozen can be resmoothed";
+    CHECK(dirty_features_.empty() && !refinalize_all_) << "EndAdding must be called after adding values";
+    smoothing_ = smoothing;
+    if (!smoothing_.UsesContinuationCounts()) {
+      // Not kept up to date by later updates, so collected again when switching back.
+      continuations_.clear();
+      deltas_.clear();
+      dense_continuations_.clear();
+    }
+    num_threads = std::max(1, num_threads);
+    switch (smoothing_.type) {
+    case WittenBell: RecalculateCoefficients<WittenBellSmoothing>(num_threads); break;
+    case KneserNey: RecalculateCoefficients<KneserNeySmoothing>(num_threads); break;
+    case Laplace: RecalculateCoefficients<LaplaceSmoothing>(num_threads); break;
+    default: LOG(FATAL) << "Unknown smoothing type " << smoothing_.type;
+    }
+  }
 
+  // Prunes a trained counter with settings that prune at least as much as the current ones and
+  // recomputes all stats from the pairs that are left. Not available once compacted or frozen.
+  void Reprune(const PruningParams& pruning, int num_threads = 1) {
+    CHECK(finalized_ && !compact_ && !frozen_) << "Only trained counts that are not compacted or frozen can be repruned";
+    CHECK(dirty_features_.empty() && !refinalize_all_) << "EndAdding must be called after adding values";
+    CHECK(pruning_.PrunesAtMost(pruning)) << "Pruned pairs cannot be restored";
+    pruning_ = pruning;
+    refinalize_all_ = true;
+    EndAdding(num_threads);
+  }
+
+  // Alternative to AddValue for counts that are already aggregated, e.g. by an external sort:
+  // every pair must be given once with its total count. The counts go straight into the feature
+  // stats instead of the table of pairs, and the counter is frozen by EndAddingFinalCounts.
+  void AddFinalCount(const F& feature, const V& value, int count) {
+    DCHECK(!finalized_) << "Final counts cannot be added to a trained counter";
+    if (count < pruning_.MinCount(feature.size())) {
+      CountPruned(feature.size());
+      return;
+    }
+    if (!pending_values_.empty() && !(feature == pending_feature_)) {
+      AddPendingValues();
     }
+    pending_feature_ = feature;
+    pending_values_.emplace_back(count, value);
+    final_counts_.emplace_back(packed_key<F, V>()(feature, value), count);
+    const int order = feature.size();
+    max_feature_size_ = std::max(max_feature_size_, order);
+    if (smoothing_.UsesContinuationCounts()) {
+      AddContinuation(order, value, count);
+    }
+  }
+
+  // Computes the stats from the counts given by AddFinalCount and freezes the counter.
+  // AddFinalCount is cheapest if the labels of a feature are given one after the other.
+  void EndAddingFinalCounts(int num_threads = 1) {
+    CHECK(!finalized_ && feature_value_counts_.empty()) << "Cannot mix AddFinalCount with AddValue";
+    num_threads = std::max(1, num_threads);
+    AddPendingValues();
+    switch (smoothing_.type) {
+    case WittenBell: FinishEndAdding<WittenBellSmoothing>(max_feature_size_, num_threads); break;
+    case KneserNey: FinishEndAdding<KneserNeySmoothing>(max_feature_size_, num_threads); break;
+    case Laplace: FinishEndAdding<LaplaceSmoothing>(max_feature_size_, num_threads); break;
+    default: LOG(FATAL) << "Unknown smoothing type " << smoothing_.type;
+    }
+    finalized_ = true;
+    BuildFeatureFilter();
+    Freeze();
+  }
 
+  // Moves the counts to a frozen table with fingerprinted keys (see --compact_counts). Must be
+  // called after EndAdding; the counter cannot be updated or resmoothed afterwards.
+  void Compact() {
+    if (compact_) return;
+    CHECK(finalized_ && !frozen_) << "Only trained counts that are not frozen can be compacted";
+    compact_counts_.Reserve(feature_value_counts_.size());
+    for (auto it = feature_value_counts_.begin(); it != feature_value_counts_.end(); it++) {
+      compact_counts_.Add(packed_key<F, V>()(it->first.first, it->first.second), it->second);
+    }
+    feature_value_counts_.clear();
+    sketch_.clear();
+    compact_ = true;
+  }
+
+  // Converts the stats and counts to the read-only format (see --frozen_counts). Must be called
+  // after EndAdding; the counter cannot be updated afterwards.
+  void Freeze() {
+    if (frozen_) return;
+    CHECK(!compact_) << "Compacted counts cannot be frozen";
+    std::vector<uint64> keys;
+    keys.reserve(feature_stats_.size());
+    for (auto it = feature_stats_.begin(); it != feature_stats_.end(); it++) {
+      keys.push_back(FeatureKey(it->first));
+    }
+    frozen_feature_index_.Build(keys);
+    frozen_feature_stats_.resize(keys.size());
     for (auto it = feature_stats_.begin(); it != feature_stats_.end(); it++) {
-      it->second.CalculateProb();
-      it->second.SortValues();
+      const uint64 key = FeatureKey(it->first);
+      auto& entry = frozen_feature_stats_[frozen_feature_index_.Lookup(key)];
+      entry.first = KeyFingerprint(key);
+      entry.second = std::move(it->second);
     }
+    FeatureHashMap<F, FeatureStats>().swap(feature_stats_);
+    if (storage_.ranked_label_lists) {
+      // The ranked labels go to a new arena, which also drops arrays left by incremental updates.
+      Arena arena;
+      for (auto& entry : frozen_feature_stats_) {
+        entry.second.RankLabels(&arena);
+      }
+      arena_ = std::move(arena);
+      unused_arena_bytes_ = 0;
+    }
+
+    frozen_num_feature_values_ = NumFeatureValues();
+    if (!UsesDenseLabels()) {
+      std::vector<std::pair<uint64, int> > pairs;
+      pairs.swap(final_counts_);
+      pairs.reserve(pairs.size() + feature_value_counts_.size());
+      for (auto it = feature_value_counts_.begin(); it != feature_value_counts_.end(); it++) {
+        pairs.emplace_back(packed_key<F, V>()(it->first.first, it->first.second), it->second);
+      }
+      keys.clear();
+      keys.reserve(pairs.size());
+      for (const auto& pair : pairs) {
+        keys.push_back(pair.first);
+      }
+      frozen_pair_index_.Build(keys);
+      frozen_pair_counts_.resize(keys.size());
+      for (const auto& pair : pairs) {
+        auto& entry = frozen_pair_counts_[frozen_pair_index_.Lookup(pair.first)];
+        entry.first = KeyFingerprint(pair.first);
+        entry.second = pair.second;
+      }
+    }
+    feature_value_counts_.clear();
+    std::vector<std::pair<uint64, int> >().swap(final_counts_);
+    sketch_.clear();
+    frozen_ = true;
+  }
+
+  bool IsFrozen() const {
+    return frozen_;
+  }
+
+  // Saves a frozen counter. The counter that reads it must have the same smoothing.
+  void WriteFrozenToFileOrDie(FILE* f) const {
+    static_assert(std::is_trivially_copyable<V>::value, "Labels are written as raw bytes");
+    CHECK(frozen_) << "Only frozen counters can be saved";
+    CHECK_EQ(1, fwrite(&smoothing_.type, sizeof(smoothing_.type), 1, f));
+    CHECK_EQ(1, fwrite(&smoothing_.kneser_ney_d, sizeof(double), 1, f));
+    CHECK_EQ(1, fwrite(&max_feature_size_, sizeof(int), 1, f));
+    uint64 num_feature_values = frozen_num_feature_values_;
+    CHECK_EQ(1, fwrite(&num_feature_values, sizeof(uint64), 1, f));
+    WriteVectorToFileOrDie(dense_labels_, f);
+    WriteVectorToFileOrDie(deltas_, f);
+    continuations_.WriteToFileOrDie(f);
+    feature_filter_.WriteToFileOrDie(f);
+
+    frozen_feature_index_.WriteToFileOrDie(f);
+    for (const auto& entry : frozen_feature_stats_) {
+      CHECK_EQ(1, fwrite(&entry.first, sizeof(uint32), 1, f));
+      entry.second.WriteToFileOrDie(deltas_.data(), f);
+    }
+    frozen_pair_index_.WriteToFileOrDie(f);
+    WriteVectorToFileOrDie(frozen_pair_counts_, f);
+  }
+
+  void ReadFrozenFromFileOrDie(FILE* f) {
+    SmoothingParams smoothing(WittenBell, -1);
+    CHECK_EQ(1, fread(&smoothing.type, sizeof(smoothing.type), 1, f));
+    CHECK_EQ(1, fread(&smoothing.kneser_ney_d, sizeof(double), 1, f));
+    CHECK(smoothing.type == smoothing_.type && smoothing.kneser_ney_d == smoothing_.kneser_ney_d)
+        << "The counts were saved with --smoothing_type=" << smoothing.type << " --kneser_ney_d=" << smoothing.kneser_ney_d;
+    CHECK_EQ(1, fread(&max_feature_size_, sizeof(int), 1, f));
+    uint64 num_feature_values = 0;
+    CHECK_EQ(1, fread(&num_feature_values, sizeof(uint64), 1, f));
+    frozen_num_feature_values_ = num_feature_values;
+    ReadVectorFromFileOrDie(&dense_labels_, f);
+    dense_label_index_.clear();
+    for (size_t i = 0; i < dense_labels_.size(); ++i) {
+      dense_label_index_[dense_labels_[i]] = i;
+    }
+    ReadVectorFromFileOrDie(&deltas_, f);
+    continuations_.ReadFromFileOrDie(f);
+    feature_filter_.ReadFromFileOrDie(f);
+    if (smoothing_.UsesContinuationCounts()) {
+      BuildDenseContinuations();
+    }
+
+    frozen_feature_index_.ReadFromFileOrDie(f);
+    feature_stats_.clear();
+    frozen_feature_stats_.clear();
+    arena_.Clear();
+    frozen_feature_stats_.resize(frozen_feature_index_.size());
+    for (auto& entry : frozen_feature_stats_) {
+      CHECK_EQ(1, fread(&entry.first, sizeof(uint32), 1, f));
+      entry.second.ReadFromFileOrDie(deltas_.data(), &arena_, f);
+    }
+    frozen_pair_index_.ReadFromFileOrDie(f);
+    ReadVectorFromFileOrDie(&frozen_pair_counts_, f);
+
+    feature_stats_.clear();
+    feature_value_counts_.clear();
+    finalized_ = true;
+    frozen_ = true;
+  }
+
+  // Approximate memory used to index the feature stats (without the label lists they hold).
+  size_t FeatureIndexBytes() const {
+    return FeatureTableBytes() + feature_filter_.MemoryBytes();
+  }
+
+  // Same without the feature filter.
+  size_t FeatureTableBytes() const {
+    if (frozen_) {
+      return frozen_feature_index_.MemoryBytes() +
+          frozen_feature_stats_.capacity() * sizeof(typename decltype(frozen_feature_stats_)::value_type);
+    }
+#ifdef PHOG_SWISS_TABLE
+    return feature_stats_.bucket_count() * (sizeof(typename decltype(feature_stats_)::value_type) + 1);
+#else
+    return feature_stats_.size() * (sizeof(typename decltype(feature_stats_)::value_type) + 2 * sizeof(void*)) +
+        feature_stats_.bucket_count() * sizeof(void*);
+#endif
+  }
+
+  // Memory of the label lists and label counts of the feature stats.
+  size_t FeatureLabelBytes() const {
+    return arena_.MemoryBytes();
+  }
+
+  // Whether the counts are in the compact frozen table (see --compact_counts).
+  bool IsCompact() const {
+    return compact_;
+  }
+
+  // Approximate memory used by the feature-value counts.
+  size_t FeatureValueBytes() const {
+    if (frozen_) {
+      return frozen_pair_index_.MemoryBytes() +
+          frozen_pair_counts_.capacity() * sizeof(typename decltype(frozen_pair_counts_)::value_type);
+    }
+    if (compact_) {
+      return compact_counts_.MemoryBytes();
+    }
+    return feature_value_counts_.bucket_count() * sizeof(typename decltype(feature_value_counts_)::value_type) +
+        sketch_.MemoryBytes();
   }
 
   size_t Size() const {
-    return feature_stats_.size();
+    return frozen_ ? frozen_feature_stats_.size() : feature_stats_.size();
+  }
+
+  // Memory of the counter by component and by feature order, with the numbers of features and
+  // pairs. Orders are only split up once the stats are built in EndAdding.
+  CounterMemoryReport GetMemoryReport() const {
+    CounterMemoryReport report;
+    report.num_features = Size();
+    report.num_pairs = NumFeatureValues();
+    report.feature_table_bytes = FeatureTableBytes();
+    report.feature_filter_bytes = feature_filter_.MemoryBytes();
+    report.label_bytes = FeatureLabelBytes();
+    report.pair_table_bytes = FeatureValueBytes();
+    report.kneser_ney_bytes = continuations_.MemoryBytes() + deltas_.capacity() * sizeof(KneserNeyDelta) +
+        dense_continuations_.capacity() * sizeof(int);
+    report.dense_label_bytes = dense_labels_.capacity() * sizeof(V) +
+        dense_label_index_.size() * (sizeof(typename decltype(dense_label_index_)::value_type) + 2 * sizeof(void*)) +
+        dense_label_index_.bucket_count() * sizeof(void*);
+    if (frozen_) {
+      // Minimal perfect hashing leaves no empty slots.
+      report.feature_slots = frozen_feature_stats_.size();
+      report.pair_slots = frozen_pair_counts_.size();
+    } else {
+      report.feature_slots = feature_stats_.bucket_count();
+      report.pair_slots = compact_ ? compact_counts_.capacity() : feature_value_counts_.bucket_count();
+    }
+
+    std::vector<OrderMemoryReport>& orders = report.orders;
+    auto order_report = [&orders](int order) -> OrderMemoryReport& {
+      if (order >= static_cast<int>(orders.size())) {
+        orders.resize(order + 1);
+      }
+      return orders[order];
+    };
+    auto add_feature = [&order_report](const FeatureStats& stats) {
+      OrderMemoryReport& o = order_report(stats.order());
+      o.num_features++;
+      o.num_pairs += stats.NumLabels();
+      o.label_bytes += stats.LabelBytes();
+    };
+    if (frozen_) {
+      for (const auto& entry : frozen_feature_stats_) {
+        add_feature(entry.second);
+      }
+    } else if (finalized_) {
+      for (auto it = feature_stats_.begin(); it != feature_stats_.end(); it++) {
+        add_feature(it->second);
+      }
+    }
+    std::vector<size_t> num_continuations;
+    continuations_.ForEach([&num_continuations](int order, const V&, int) {
+      if (order >= static_cast<int>(num_continuations.size())) {
+        num_continuations.resize(order + 1, 0);
+      }
+      num_continuations[order]++;
+    });
+    if (!deltas_.empty()) order_report(deltas_.size() - 1);
+    if (!num_continuations.empty()) order_report(num_continuations.size() - 1);
+
+    size_t num_pairs = 0;
+    for (const OrderMemoryReport& o : orders) {
+      num_pairs += o.num_pairs;
+    }
+    const size_t dense_row_bytes = deltas_.empty() ? 0 : dense_continuations_.capacity() / deltas_.size() * sizeof(int);
+    for (size_t order = 0; order < orders.size(); ++order) {
+      OrderMemoryReport& o = orders[order];
+      o.feature_table_bytes = MemoryShare(report.feature_table_bytes, o.num_features, report.num_features);
+      o.pair_table_bytes = MemoryShare(report.pair_table_bytes, o.num_pairs, num_pairs);
+      if (order < num_continuations.size()) {
+        o.kneser_ney_bytes += MemoryShare(continuations_.MemoryBytes(), num_continuations[order], continuations_.size());
+      }
+      if (order < deltas_.size()) {
+        o.kneser_ney_bytes += sizeof(KneserNeyDelta) + dense_row_bytes;
+      }
+    }
+    return report;
   }
 
   // Reading out the data:
   unsigned NumFeatureValues() const {
-    return feature_value_counts_.size();
+    if (frozen_) return frozen_num_feature_values_;
+    return compact_ ? compact_counts_.size() : feature_value_counts_.size() + final_counts_.size();
   }
 
-  // CB(F feature, V value, int count);
+  // CB(F feature, V value, int count); Not available for compacted counts.
   template<class CB>
   void ForEachFeatureValue(const CB& f) const {
+    CHECK(!compact_ && !frozen_) << "Compacted or frozen counts cannot be enumerated";
     for (auto it = feature_value_counts_.begin(); it != feature_value_counts_.end(); it++) {
       f(it->first.first, it->first.second, it->second);
     }
@@ -731,11 +2282,30 @@ public:
     for (auto it = feature_stats_.begin(); it != feature_stats_.end(); it++) {
       StringAppendF(&result, "Feature: \n%s", it->second.DebugString(ss).c_str());
     }
+    for (const auto& entry : frozen_feature_stats_) {
+      StringAppendF(&result, "Feature: \n%s", entry.second.DebugString(ss).c_str());
+    }
 
     return result;
   }
 
+  // False if the feature is definitely not in the counter. Always true without a feature filter.
+  bool MayContainFeature(const F& feature) const {
+    return feature_filter_.empty() || feature_filter_.MayContain(FeatureKey(feature));
+  }
+
   const FeatureStats* GetFeatureStatsOrNull(const F& feature) const {
+    if (!MayContainFeature(feature)) {
+      return nullptr;
+    }
+    if (frozen_) {
+      const uint64 key = FeatureKey(feature);
+      const size_t slot = frozen_feature_index_.Lookup(key);
+      if (slot >= frozen_feature_stats_.size() || frozen_feature_stats_[slot].first != KeyFingerprint(key)) {
+        return nullptr;
+      }
+      return &frozen_feature_stats_[slot].second;
+    }
     auto it = feature_stats_.find(feature);
     if (it == feature_stats_.end()) {
       return nullptr;
@@ -743,43 +2313,40 @@ public:
     return &it->second;
   }
 
-  const std::vector<std::pair<double, const V*> >& LabelsSortedByProbability(const F& feature) const {
-    auto it = feature_stats_.find(feature);
-    if (it == feature_stats_.end()) {
+  // Fails for the ranked label lists of a frozen counter (see FeatureStats::sorted_by_prob).
+  const typename FeatureStats::LabelList& LabelsSortedByProbability(const F& feature) const {
+    const FeatureStats* stats = GetFeatureStatsOrNull(feature);
+    if (stats == nullptr) {
       return empty_vec_;
     }
-    return it->second.sorted_by_prob_;
+    return stats->sorted_by_prob();
   }
 
+  // Continuation counts are only collected if smoothing().UsesContinuationCounts().
   int GetValuePrefixCount(const F& feature, const V& value) const {
-    if (FLAGS_smoothing_type != KneserNey) {
-      return 0;
-    }
-    const auto it = value_stats_.find(feature.size());
-    if (it != value_stats_.end()) {
-      return it->second.GetValuePrefixCount(value);
+    return continuations_.Get(feature.size(), value);
+  }
+
+  // Same as GetValuePrefixCount(feature, value) given the order of the feature and
+  // DenseLabelIndex(value). Reads a flat array if the counter uses dense labels.
+  int GetValuePrefixCount(int order, const V& value, int dense_label) const {
+    if (UsesDenseLabels()) {
+      const size_t index = dense_label * deltas_.size() + order;
+      return (dense_label < 0 || index >= dense_continuations_.size()) ? 0 : dense_continuations_[index];
     }
-    return 0;
+    return continuations_.Get(order, value);
   }
 
   int GetTotalPrefixCount(const F& feature) const {
-    if (FLAGS_smoothing_type != KneserNey) {
-      return 0;
-    }
-    const auto it = value_stats_.find(feature.size());
-    if (it != value_stats_.end()) {
-      return it->second.TotalPrefixCount();
-    }
-    return 0;
+    return continuations_.Total(feature.size());
   }
 
   const KneserNeyDelta* GetKneserNeyDelta(const F& feature) const {
-    if (FLAGS_smoothing_type != KneserNey) {
+    if (!smoothing_.UsesContinuationCounts()) {
       return nullptr;
     }
-    const auto it = deltas_.find(feature.size());
-    CHECK(it != deltas_.end());
-    return &it->second;
+    CHECK_LT(feature.size(), static_cast<int>(deltas_.size()));
+    return &deltas_[feature.size()];
   }
 
   double GetMLProb(const F& feature, const V& value, const FeatureStats* feature_stats) const {
@@ -790,7 +2357,47 @@ public:
     return feature_stats->GetLaplaceSmoothedMLProb(GetCount(feature, value));
   }
 
+  // Whether FeatureStats keep per-label count arrays (set in EndAdding for small label alphabets).
+  bool UsesDenseLabels() const {
+    return !dense_labels_.empty();
+  }
+
+  // Returns the dense index of a label or -1 if the label was not seen or dense labels are not used.
+  int DenseLabelIndex(const V& value) const {
+    if (!UsesDenseLabels()) return -1;
+    auto it = dense_label_index_.find(value);
+    if (it == dense_label_index_.end()) {
+      return -1;
+    }
+    return it->second;
+  }
+
+  // Same as GetCount(feature, value) given the stats of the feature and DenseLabelIndex(value). Does
+  // not touch the feature-value table if the counter uses dense labels.
+  int GetCountInFeature(const F& feature, const FeatureStats& stats, const V& value, int dense_label) const {
+    if (UsesDenseLabels()) {
+      return dense_label < 0 ? 0 : stats.GetDenseLabelCount(dense_label);
+    }
+    return GetCount(feature, value);
+  }
+
   int GetCount(const F& feature, const V& value) const {
+    if (frozen_) {
+      if (UsesDenseLabels()) {
+        const FeatureStats* stats = GetFeatureStatsOrNull(feature);
+        const int dense_label = DenseLabelIndex(value);
+        return (stats == nullptr || dense_label < 0) ? 0 : stats->GetDenseLabelCount(dense_label);
+      }
+      const uint64 key = packed_key<F, V>()(feature, value);
+      const size_t slot = frozen_pair_index_.Lookup(key);
+      if (slot >= frozen_pair_counts_.size() || frozen_pair_counts_[slot].first != KeyFingerprint(key)) {
+        return 0;
+      }
+      return frozen_pair_counts_[slot].second;
+    }
+    if (compact_) {
+      return compact_counts_.Get(packed_key<F, V>()(feature, value));
+    }
     auto it = feature_value_counts_.find(std::pair<F, V>(feature, value));
     if (it == feature_value_counts_.end()) {
       return 0;
@@ -14,6 +14,11 @@
    limitations under the License.
  */
 
+#include <algorithm>
+#include <functional>
+#include <unordered_set>
+#include <vector>
+
 #include "glog/logging.h"
 #include "json/json.h"
 
@@ -76,6 +81,9 @@ TEST(PBoxTest, ContinuationTest) {
     EXPECT_EQ(5, counts_.GetTotalPrefixCount(f));
     EXPECT_EQ(2, counts_.GetValuePrefixCount(f, 10));
     EXPECT_EQ(3, counts_.GetValuePrefixCount(f, 11));
+    EXPECT_EQ(2, counts_.GetValuePrefixCount(2, 10, counts_.DenseLabelIndex(10)));
+    EXPECT_EQ(3, counts_.GetValuePrefixCount(2, 11, counts_.DenseLabelIndex(11)));
+    EXPECT_EQ(0, counts_.GetValuePrefixCount(2, 12, counts_.DenseLabelIndex(12)));
   }
 
   {
@@ -94,6 +102,600 @@ TEST(PBoxTest, ContinuationTest) {
   }
 }
 
+TEST(PBoxTest, WittenBellCoefficientsTest) {
+  FLAGS_smoothing_type = WittenBell;
+  PerFeatureValueCounter<SequenceHashFeature, int> counts_;
+
+  SequenceHashFeature empty;
+  SequenceHashFeature f;
+  f.PushBack(1);
+  counts_.AddValue(empty, 10, 3);
+  counts_.AddValue(empty, 11, 1);
+  counts_.AddValue(f, 10, 2);
+  counts_.AddValue(f, 12, 2);
+  counts_.EndAdding();
+
+  WittenBellSmoothing wb(counts_.smoothing());
+  wb.SetUnconditionedProb(counts_.GetCount(empty, 10), 0, counts_.GetFeatureStatsOrNull(empty)->coefficients());
+  EXPECT_DOUBLE_EQ(4.0 / 7.0, wb.GetProb());
+  wb.AddForwardBackoff(counts_.GetCount(f, 10), 0, counts_.GetFeatureStatsOrNull(f)->coefficients());
+  // lambda = 1 - 2 / (2 + 4)
+  EXPECT_DOUBLE_EQ((2.0 / 3.0) * (2.0 / 4.0) + (1.0 / 3.0) * (4.0 / 7.0), wb.GetProb());
+}
+
+TEST(PBoxTest, DenseLabelsTest) {
+  FLAGS_smoothing_type = WittenBell;
+  PerFeatureValueCounter<SequenceHashFeature, int> counts_;
+
+  SequenceHashFeature empty;
+  SequenceHashFeature f;
+  f.PushBack(1);
+  for (int label = -12; label < 20; ++label) {
+    counts_.AddValue(empty, label, label + 13);
+  }
+  counts_.AddValue(f, 3, 2);
+  counts_.AddValue(f, -10, 1);
+  counts_.EndAdding();
+  ASSERT_TRUE(counts_.UsesDenseLabels());
+
+  for (int label = -15; label < 25; ++label) {
+    int dense_label = counts_.DenseLabelIndex(label);
+    EXPECT_EQ(counts_.GetCount(empty, label),
+              counts_.GetCountInFeature(empty, *counts_.GetFeatureStatsOrNull(empty), label, dense_label));
+    EXPECT_EQ(counts_.GetCount(f, label),
+              counts_.GetCountInFeature(f, *counts_.GetFeatureStatsOrNull(f), label, dense_label));
+  }
+}
+
+TEST(PBoxTest, CompactCountsTest) {
+  FLAGS_smoothing_type = WittenBell;
+  PerFeatureValueCounter<SequenceHashFeature, int> counts_;
+  PerFeatureValueCounter<SequenceHashFeature, int> compact_counts_;
+
+  for (int i = 0; i < 1000; ++i) {
+    SequenceHashFeature f;
+    f.PushBack(i % 37);
+    f.PushBack(i % 11);
+    counts_.AddValue(f, i % 7 - 12, 1 + i % 3);
+    compact_counts_.AddValue(f, i % 7 - 12, 1 + i % 3);
+  }
+  SequenceHashFeature empty;
+  counts_.AddValue(empty, 5, 1000);
+  compact_counts_.AddValue(empty, 5, 1000);
+  counts_.EndAdding();
+  compact_counts_.EndAdding();
+  compact_counts_.Compact();
+
+  ASSERT_TRUE(compact_counts_.IsCompact());
+  EXPECT_EQ(counts_.NumFeatureValues(), compact_counts_.NumFeatureValues());
+  EXPECT_LT(compact_counts_.FeatureValueBytes() * 2, counts_.FeatureValueBytes());
+  counts_.ForEachFeatureValue([&compact_counts_](const SequenceHashFeature& f, int label, int count) {
+    EXPECT_EQ(count, compact_counts_.GetCount(f, label));
+  });
+  EXPECT_EQ(1000, compact_counts_.GetCount(empty, 5));
+  EXPECT_EQ(0, compact_counts_.GetCount(empty, 6));
+}
+
+TEST(PBoxTest, PruningTest) {
+  FLAGS_smoothing_type = KneserNey;
+  PerFeatureValueCounter<SequenceHashFeature, int> counts_;
+  PruningParams pruning;
+  pruning.min_counts = {2};
+  counts_.set_pruning(pruning);
+
+  SequenceHashFeature empty;
+  SequenceHashFeature f1, f2;
+  f1.PushBack(1);
+  f2.PushBack(2);
+  counts_.AddValue(empty, 10, 1);
+  counts_.AddValue(empty, 11, 1);
+  counts_.AddValue(f1, 10, 3);
+  counts_.AddValue(f1, 11, 1);
+  counts_.AddValue(f2, 11, 1);
+  counts_.EndAdding();
+
+  EXPECT_EQ(2u, counts_.NumPruned());
+  EXPECT_EQ(3u, counts_.NumFeatureValues());
+  EXPECT_EQ(1, counts_.GetCount(empty, 11));
+  EXPECT_EQ(0, counts_.GetCount(f1, 11));
+  EXPECT_EQ(nullptr, counts_.GetFeatureStatsOrNull(f2));
+  EXPECT_EQ(3, counts_.GetFeatureStatsOrNull(f1)->TotalCount());
+  // Continuation counts only see the pairs that were kept.
+  EXPECT_EQ(1, counts_.GetTotalPrefixCount(f1));
+  EXPECT_EQ(0, counts_.GetValuePrefixCount(f1, 11));
+}
+
+TEST(PBoxTest, RepruneTest) {
+  FLAGS_smoothing_type = KneserNey;
+  PerFeatureValueCounter<SequenceHashFeature, int> counts_;
+  PerFeatureValueCounter<SequenceHashFeature, int> repruned_counts_;
+  PruningParams pruning = PruningParams::Parse("1,3");
+  counts_.set_pruning(pruning);
+  repruned_counts_.set_pruning(PruningParams::Parse("1,2"));
+  std::vector<SequenceHashFeature> features;
+  for (int i = 0; i < 1000; ++i) {
+    SequenceHashFeature f;
+    counts_.AddValue(f, i % 13, 1);
+    repruned_counts_.AddValue(f, i % 13, 1);
+    for (int order = 1; order <= 3; ++order) {
+      f.PushBack(1 + (i / order) % 29);
+      counts_.AddValue(f, (i * order) % 19, 1 + i % 3);
+      repruned_counts_.AddValue(f, (i * order) % 19, 1 + i % 3);
+      features.push_back(f);
+    }
+  }
+  counts_.EndAdding();
+  repruned_counts_.EndAdding();
+  const size_t num_pruned = repruned_counts_.NumPruned();
+  EXPECT_LT(num_pruned, counts_.NumPruned());
+  repruned_counts_.Reprune(pruning);
+
+  // Pruning in two steps keeps the pairs and computes the stats of pruning at once.
+  EXPECT_EQ(counts_.NumPrunedByOrder(), repruned_counts_.NumPrunedByOrder());
+  ASSERT_EQ(4u, counts_.NumPrunedByOrder().size());
+  EXPECT_EQ(0u, counts_.NumPrunedByOrder()[1]);
+  EXPECT_LT(0u, counts_.NumPrunedByOrder()[3]);
+  EXPECT_EQ(counts_.NumFeatureValues(), repruned_counts_.NumFeatureValues());
+  for (const SequenceHashFeature& f : features) {
+    const auto* stats = counts_.GetFeatureStatsOrNull(f);
+    const auto* repruned_stats = repruned_counts_.GetFeatureStatsOrNull(f);
+    ASSERT_EQ(stats == nullptr, repruned_stats == nullptr);
+    if (stats == nullptr) continue;
+    EXPECT_EQ(stats->TotalCount(), repruned_stats->TotalCount());
+    EXPECT_EQ(stats->UniqueLabels(), repruned_stats->UniqueLabels());
+    EXPECT_DOUBLE_EQ(stats->sorted_by_prob()[0].first, repruned_stats->sorted_by_prob()[0].first);
+    EXPECT_EQ(counts_.GetTotalPrefixCount(f), repruned_counts_.GetTotalPrefixCount(f));
+    for (int label = 0; label < 19; ++label) {
+      EXPECT_EQ(counts_.GetCount(f, label), repruned_counts_.GetCount(f, label));
+    }
+  }
+}
+
+TEST(PBoxTest, IncrementalUpdateTest) {
+  FLAGS_smoothing_type = KneserNey;
+  PerFeatureValueCounter<SequenceHashFeature, int> counts_;
+  PerFeatureValueCounter<SequenceHashFeature, int> incremental_counts_;
+  std::vector<SequenceHashFeature> features;
+
+  const auto add_sample = [&features](PerFeatureValueCounter<SequenceHashFeature, int>* counts, int i) {
+    SequenceHashFeature f;
+    counts->AddValue(f, i % 5, 1);
+    for (int order = 1; order <= 3; ++order) {
+      // Pushing 0 onto an empty SequenceHashFeature would not change its hash.
+      f.PushBack(1 + (i / order) % 4);
+      counts->AddValue(f, (i * order) % 7, 1);
+      features.push_back(f);
+    }
+  };
+  for (int i = 0; i < 500; ++i) {
+    add_sample(&counts_, i);
+    add_sample(&incremental_counts_, i);
+  }
+  incremental_counts_.EndAdding();
+  for (int i = 500; i < 600; ++i) {
+    add_sample(&counts_, i * 3);
+    add_sample(&incremental_counts_, i * 3);
+  }
+  counts_.EndAdding();
+  incremental_counts_.EndAdding();
+
+  features.push_back(SequenceHashFeature());
+  for (const SequenceHashFeature& f : features) {
+    const auto* stats = counts_.GetFeatureStatsOrNull(f);
+    const auto* incremental_stats = incremental_counts_.GetFeatureStatsOrNull(f);
+    ASSERT_NE(nullptr, incremental_stats);
+    EXPECT_EQ(stats->TotalCount(), incremental_stats->TotalCount());
+    // Labels of equal probability may come in a different order after an incremental update.
+    std::vector<std::pair<double, int> > labels(stats->sorted_by_prob().begin(), stats->sorted_by_prob().end());
+    std::vector<std::pair<double, int> > incremental_labels(
+        incremental_stats->sorted_by_prob().begin(), incremental_stats->sorted_by_prob().end());
+    std::sort(labels.begin(), labels.end(), std::greater<std::pair<double, int> >());
+    std::sort(incremental_labels.begin(), incremental_labels.end(), std::greater<std::pair<double, int> >());
+    EXPECT_EQ(labels, incremental_labels);
+    EXPECT_DOUBLE_EQ(stats->coefficients().backoff_weight, incremental_stats->coefficients().backoff_weight);
+    EXPECT_DOUBLE_EQ(stats->coefficients().discount_mass, incremental_stats->coefficients().discount_mass);
+    EXPECT_TRUE(std::equal(stats->coefficients().discount_counts, stats->coefficients().discount_counts + 3,
+                           incremental_stats->coefficients().discount_counts));
+    EXPECT_EQ(counts_.GetTotalPrefixCount(f), incremental_counts_.GetTotalPrefixCount(f));
+    for (int count = 1; count <= 3; ++count) {
+      EXPECT_DOUBLE_EQ(counts_.GetKneserNeyDelta(f)->GetDelta(count),
+                       incremental_counts_.GetKneserNeyDelta(f)->GetDelta(count));
+    }
+  }
+}
+
+TEST(PBoxTest, ParallelEndAddingTest) {
+  FLAGS_smoothing_type = KneserNey;
+  PerFeatureValueCounter<SequenceHashFeature, int> counts_;
+  PerFeatureValueCounter<SequenceHashFeature, int> parallel_counts_;
+  std::vector<SequenceHashFeature> features;
+
+  for (int i = 0; i < 2000; ++i) {
+    SequenceHashFeature f;
+    counts_.AddValue(f, i % 13, 1);
+    parallel_counts_.AddValue(f, i % 13, 1);
+    for (int order = 1; order <= 3; ++order) {
+      f.PushBack(1 + (i / order) % 17);
+      counts_.AddValue(f, (i * order) % 23, 1 + i % 2);
+      parallel_counts_.AddValue(f, (i * order) % 23, 1 + i % 2);
+      features.push_back(f);
+    }
+  }
+  counts_.EndAdding();
+  parallel_counts_.EndAdding(4);
+
+  EXPECT_EQ(counts_.Size(), parallel_counts_.Size());
+  for (const SequenceHashFeature& f : features) {
+    const auto* stats = counts_.GetFeatureStatsOrNull(f);
+    const auto* parallel_stats = parallel_counts_.GetFeatureStatsOrNull(f);
+    ASSERT_NE(nullptr, parallel_stats);
+    EXPECT_EQ(stats->sorted_by_prob(), parallel_stats->sorted_by_prob());
+    EXPECT_EQ(stats->coefficients().discount_mass, parallel_stats->coefficients().discount_mass);
+    EXPECT_TRUE(std::equal(stats->coefficients().discount_counts, stats->coefficients().discount_counts + 3,
+                           parallel_stats->coefficients().discount_counts));
+    EXPECT_EQ(counts_.GetTotalPrefixCount(f), parallel_counts_.GetTotalPrefixCount(f));
+  }
+}
+
+TEST(PBoxTest, ResmoothTest) {
+  const std::vector<SmoothingParams> settings{
+      SmoothingParams(WittenBell, -1), SmoothingParams(KneserNey, -1), SmoothingParams(KneserNey, 0.5),
+      SmoothingParams(Laplace, -1), SmoothingParams(KneserNey, -1)};
+  PerFeatureValueCounter<SequenceHashFeature, int> resmoothed_counts(settings[0]);
+  std::vector<SequenceHashFeature> features;
+  const auto add_samples = [&features](PerFeatureValueCounter<SequenceHashFeature, int>* counts) {
+    for (int i = 0; i < 1000; ++i) {
+      SequenceHashFeature f;
+      counts->AddValue(f, i % 11, 1);
+      for (int order = 1; order <= 3; ++order) {
+        f.PushBack(1 + (i / order) % 9);
+        counts->AddValue(f, (i * order) % 19, 1 + i % 3);
+        features.push_back(f);
+      }
+    }
+  };
+  add_samples(&resmoothed_counts);
+  resmoothed_counts.EndAdding();
+
+  for (const SmoothingParams& smoothing : settings) {
+    PerFeatureValueCounter<SequenceHashFeature, int> counts(smoothing);
+    add_samples(&counts);
+    counts.EndAdding();
+    resmoothed_counts.Resmooth(smoothing, 2);
+
+    for (const SequenceHashFeature& f : features) {
+      const auto* stats = counts.GetFeatureStatsOrNull(f);
+      const auto* resmoothed_stats = resmoothed_counts.GetFeatureStatsOrNull(f);
+      ASSERT_NE(nullptr, resmoothed_stats);
+      EXPECT_EQ(stats->sorted_by_prob(), resmoothed_stats->sorted_by_prob());
+      EXPECT_DOUBLE_EQ(stats->coefficients().backoff_weight, resmoothed_stats->coefficients().backoff_weight);
+      EXPECT_DOUBLE_EQ(stats->coefficients().discount_mass, resmoothed_stats->coefficients().discount_mass);
+      EXPECT_TRUE(std::equal(stats->coefficients().discount_counts, stats->coefficients().discount_counts + 3,
+                             resmoothed_stats->coefficients().discount_counts));
+      EXPECT_EQ(stats->coefficients().delta == nullptr, resmoothed_stats->coefficients().delta == nullptr);
+      EXPECT_EQ(counts.GetTotalPrefixCount(f), resmoothed_counts.GetTotalPrefixCount(f));
+    }
+  }
+}
+
+TEST(PBoxTest, FrozenCountsTest) {
+  FLAGS_smoothing_type = KneserNey;
+  for (int max_dense_labels : {StorageParams().max_dense_labels, 0}) {
+    StorageParams storage;
+    storage.max_dense_labels = max_dense_labels;
+    PerFeatureValueCounter<SequenceHashFeature, int> counts_;
+    PerFeatureValueCounter<SequenceHashFeature, int> frozen_counts_;
+    counts_.set_storage(storage);
+    frozen_counts_.set_storage(storage);
+    std::vector<SequenceHashFeature> features;
+    for (int i = 0; i < 1000; ++i) {
+      SequenceHashFeature f;
+      counts_.AddValue(f, i % 13, 1);
+      frozen_counts_.AddValue(f, i % 13, 1);
+      for (int order = 1; order <= 2; ++order) {
+        f.PushBack(1 + (i / order) % 29);
+        counts_.AddValue(f, (i * order) % 19 - 12, 1 + i % 3);
+        frozen_counts_.AddValue(f, (i * order) % 19 - 12, 1 + i % 3);
+        features.push_back(f);
+      }
+    }
+    counts_.EndAdding();
+    frozen_counts_.EndAdding();
+    frozen_counts_.Freeze();
+
+    // Round trip through a file.
+    FILE* f = tmpfile();
+    frozen_counts_.WriteFrozenToFileOrDie(f);
+    rewind(f);
+    PerFeatureValueCounter<SequenceHashFeature, int> loaded_counts_;
+    loaded_counts_.ReadFrozenFromFileOrDie(f);
+    fclose(f);
+
+    for (const auto* frozen : {&frozen_counts_, &loaded_counts_}) {
+      ASSERT_TRUE(frozen->IsFrozen());
+      EXPECT_EQ(counts_.Size(), frozen->Size());
+      EXPECT_EQ(counts_.NumFeatureValues(), frozen->NumFeatureValues());
+      for (const SequenceHashFeature& feature : features) {
+        const auto* stats = counts_.GetFeatureStatsOrNull(feature);
+        const auto* frozen_stats = frozen->GetFeatureStatsOrNull(feature);
+        ASSERT_NE(nullptr, frozen_stats);
+        EXPECT_EQ(stats->sorted_by_prob(), frozen_stats->sorted_by_prob());
+        EXPECT_EQ(stats->coefficients().discount_mass, frozen_stats->coefficients().discount_mass);
+        for (int label = -12; label < 19; ++label) {
+          EXPECT_EQ(counts_.GetCount(feature, label), frozen->GetCount(feature, label));
+        }
+      }
+      SequenceHashFeature unknown;
+      unknown.PushBack(1000);
+      EXPECT_EQ(nullptr, frozen->GetFeatureStatsOrNull(unknown));
+      EXPECT_EQ(0, frozen->GetCount(unknown, 1));
+    }
+  }
+}
+
+TEST(PBoxTest, CountSketchTest) {
+  FLAGS_smoothing_type = WittenBell;
+  SketchParams sketch;
+  sketch.sketch_bytes = 1 << 20;
+  sketch.exact_bytes = 1 << 20;
+  sketch.min_count = 2;
+  PerFeatureValueCounter<SequenceHashFeature, int> counts_;
+  counts_.set_sketch(sketch);
+  sketch.exact_bytes = 100 * 4 * sizeof(std::pair<std::pair<SequenceHashFeature, int>, int>);
+  PerFeatureValueCounter<SequenceHashFeature, int> small_counts_;
+  small_counts_.set_sketch(sketch);
+
+  // Labels 0..3 are seen twice per feature, labels 4 and 5 once.
+  SequenceHashFeature empty;
+  for (int i = 0; i < 1000; ++i) {
+    SequenceHashFeature f;
+    f.PushBack(1 + i % 100);
+    int label = (i / 100) % 6;
+    counts_.AddValue(f, label, 1);
+    small_counts_.AddValue(f, label, 1);
+    counts_.AddValue(empty, label, 1);
+  }
+  counts_.EndAdding();
+  small_counts_.EndAdding();
+
+  // The unconditioned feature is always counted exactly.
+  for (int label = 0; label < 6; ++label) {
+    EXPECT_EQ(label < 4 ? 200 : 100, counts_.GetCount(empty, label));
+  }
+  for (int i = 0; i < 100; ++i) {
+    SequenceHashFeature f;
+    f.PushBack(1 + i);
+    EXPECT_EQ(2, counts_.GetCount(f, 0));
+    EXPECT_EQ(2, counts_.GetCount(f, 3));
+    EXPECT_EQ(0, counts_.GetCount(f, 4));
+  }
+  EXPECT_EQ(6 + 4 * 100, counts_.NumFeatureValues());
+  EXPECT_EQ(4 * 100, counts_.NumPromotedFromSketch());
+  EXPECT_EQ(0, counts_.NumRejectedIncrements());
+
+  // The first 100 pairs at the minimum count fill the exact counts, the second increments of the other
+  // 300 are dropped.
+  EXPECT_EQ(100, small_counts_.NumFeatureValues());
+  EXPECT_EQ(300, small_counts_.NumRejectedIncrements());
+}
+
+TEST(PBoxTest, FinalCountsTest) {
+  FLAGS_smoothing_type = KneserNey;
+  PerFeatureValueCounter<SequenceHashFeature, int> counts_;
+  std::vector<SequenceHashFeature> features;
+  for (int i = 0; i < 1000; ++i) {
+    SequenceHashFeature f;
+    counts_.AddValue(f, i % 13, 1);
+    for (int order = 1; order <= 3; ++order) {
+      f.PushBack(1 + (i / order) % 17);
+      counts_.AddValue(f, (i * order) % 23, 1 + i % 2);
+      features.push_back(f);
+    }
+  }
+  counts_.EndAdding();
+
+  PerFeatureValueCounter<SequenceHashFeature, int> final_counts_;
+  counts_.ForEachFeatureValue([&final_counts_](const SequenceHashFeature& f, int label, int count) {
+    final_counts_.AddFinalCount(f, label, count);
+  });
+  final_counts_.EndAddingFinalCounts();
+
+  ASSERT_TRUE(final_counts_.IsFrozen());
+  EXPECT_EQ(counts_.Size(), final_counts_.Size());
+  EXPECT_EQ(counts_.NumFeatureValues(), final_counts_.NumFeatureValues());
+  for (const SequenceHashFeature& f : features) {
+    const auto* stats = counts_.GetFeatureStatsOrNull(f);
+    const auto* final_stats = final_counts_.GetFeatureStatsOrNull(f);
+    ASSERT_NE(nullptr, final_stats);
+    EXPECT_EQ(stats->sorted_by_prob(), final_stats->sorted_by_prob());
+    EXPECT_EQ(stats->coefficients().discount_mass, final_stats->coefficients().discount_mass);
+    EXPECT_TRUE(std::equal(stats->coefficients().discount_counts, stats->coefficients().discount_counts + 3,
+                           final_stats->coefficients().discount_counts));
+    EXPECT_EQ(counts_.GetTotalPrefixCount(f), final_counts_.GetTotalPrefixCount(f));
+    EXPECT_EQ(counts_.GetValuePrefixCount(f, 3), final_counts_.GetValuePrefixCount(f, 3));
+  }
+}
+
+TEST(PBoxTest, FeatureFilterTest) {
+  FLAGS_smoothing_type = WittenBell;
+  StorageParams storage;
+  storage.feature_filter_bits_per_key = 10;
+  PerFeatureValueCounter<SequenceHashFeature, int> counts_;
+  counts_.set_storage(storage);
+  std::vector<SequenceHashFeature> features;
+  for (int i = 0; i < 1000; ++i) {
+    SequenceHashFeature f;
+    f.PushBack(i);
+    counts_.AddValue(f, i % 7, 1);
+    features.push_back(f);
+  }
+  counts_.EndAdding();
+
+  for (const SequenceHashFeature& f : features) {
+    EXPECT_TRUE(counts_.MayContainFeature(f));
+    EXPECT_NE(nullptr, counts_.GetFeatureStatsOrNull(f));
+  }
+  int num_rejected = 0;
+  for (int i = 1000; i < 2000; ++i) {
+    SequenceHashFeature f;
+    f.PushBack(i);
+    if (!counts_.MayContainFeature(f)) num_rejected++;
+    EXPECT_EQ(nullptr, counts_.GetFeatureStatsOrNull(f));
+  }
+  EXPECT_GT(num_rejected, 950);
+}
+
+TEST(PBoxTest, RankedLabelListsTest) {
+  FLAGS_smoothing_type = WittenBell;
+  PerFeatureValueCounter<SequenceHashFeature, int> counts_;
+  PerFeatureValueCounter<SequenceHashFeature, int> ranked_counts_;
+  StorageParams storage;
+  storage.ranked_label_lists = true;
+  ranked_counts_.set_storage(storage);
+  std::vector<SequenceHashFeature> features;
+  for (int i = 0; i < 1000; ++i) {
+    SequenceHashFeature f;
+    f.PushBack(i % 10);
+    counts_.AddValue(f, i % 37, 1 + i % 5);
+    ranked_counts_.AddValue(f, i % 37, 1 + i % 5);
+    features.push_back(f);
+  }
+  counts_.EndAdding();
+  ranked_counts_.EndAdding();
+  ranked_counts_.Freeze();
+  EXPECT_LT(ranked_counts_.FeatureLabelBytes(), counts_.FeatureLabelBytes());
+
+  FILE* f = tmpfile();
+  ranked_counts_.WriteFrozenToFileOrDie(f);
+  rewind(f);
+  PerFeatureValueCounter<SequenceHashFeature, int> loaded_counts_;
+  loaded_counts_.ReadFrozenFromFileOrDie(f);
+  fclose(f);
+
+  for (const auto* ranked : {&ranked_counts_, &loaded_counts_}) {
+    for (const SequenceHashFeature& feature : features) {
+      const auto* stats = counts_.GetFeatureStatsOrNull(feature);
+      const auto* ranked_stats = ranked->GetFeatureStatsOrNull(feature);
+      ASSERT_NE(nullptr, ranked_stats);
+      EXPECT_FALSE(ranked_stats->HasLabelProbabilities());
+      ASSERT_EQ(stats->NumLabels(), ranked_stats->NumLabels());
+      for (size_t i = 0; i < stats->NumLabels(); ++i) {
+        EXPECT_EQ(stats->Label(i), ranked_stats->Label(i));
+        const int label = stats->Label(i);
+        EXPECT_EQ(counts_.GetCountInFeature(feature, *stats, label, counts_.DenseLabelIndex(label)),
+                  ranked->GetCountInFeature(feature, *ranked_stats, label, ranked->DenseLabelIndex(label)));
+      }
+    }
+  }
+}
+
+TEST(PBoxTest, MemoryReportTest) {
+  FLAGS_smoothing_type = KneserNey;
+  PerFeatureValueCounter<SequenceHashFeature, int> counts_;
+  PerFeatureValueCounter<SequenceHashFeature, int> frozen_counts_;
+  for (int i = 0; i < 1000; ++i) {
+    SequenceHashFeature f;
+    counts_.AddValue(f, i % 13, 1);
+    frozen_counts_.AddValue(f, i % 13, 1);
+    for (int order = 1; order <= 2; ++order) {
+      f.PushBack(1 + (i / order) % 29);
+      counts_.AddValue(f, (i * order) % 19 - 12, 1 + i % 3);
+      frozen_counts_.AddValue(f, (i * order) % 19 - 12, 1 + i % 3);
+    }
+  }
+  counts_.EndAdding();
+  frozen_counts_.EndAdding();
+  frozen_counts_.Freeze();
+
+  // The orders of frozen stats are read back from the file.
+  FILE* f = tmpfile();
+  frozen_counts_.WriteFrozenToFileOrDie(f);
+  rewind(f);
+  PerFeatureValueCounter<SequenceHashFeature, int> loaded_counts_;
+  loaded_counts_.ReadFrozenFromFileOrDie(f);
+  fclose(f);
+
+  for (const auto* counter : {&counts_, &loaded_counts_}) {
+    const CounterMemoryReport report = counter->GetMemoryReport();
+    EXPECT_EQ(counter->Size(), report.num_features);
+    EXPECT_EQ(counter->NumFeatureValues(), report.num_pairs);
+    EXPECT_EQ(counter->FeatureLabelBytes(), report.label_bytes);
+    EXPECT_EQ(counter->FeatureValueBytes(), report.pair_table_bytes);
+    EXPECT_GT(report.FeatureLoadFactor(), 0);
+    EXPECT_LE(report.FeatureLoadFactor(), 1);
+    EXPECT_GT(report.kneser_ney_bytes, 0);
+    ASSERT_EQ(3, report.orders.size());
+    EXPECT_EQ(1, report.orders[0].num_features);
+    EXPECT_EQ(13, report.orders[0].num_pairs);
+    EXPECT_EQ(29, report.orders[1].num_features);
+    size_t num_features = 0, num_pairs = 0, feature_table_bytes = 0, kneser_ney_bytes = 0;
+    for (const OrderMemoryReport& o : report.orders) {
+      num_features += o.num_features;
+      num_pairs += o.num_pairs;
+      feature_table_bytes += o.feature_table_bytes;
+      kneser_ney_bytes += o.kneser_ney_bytes;
+      EXPECT_GT(o.label_bytes, 0);
+      EXPECT_LE(o.label_bytes, report.label_bytes);
+    }
+    EXPECT_EQ(counter->Size(), num_features);
+    EXPECT_EQ(counter->NumFeatureValues(), num_pairs);
+    // Up to rounding of the shares.
+    EXPECT_NEAR(report.feature_table_bytes, feature_table_bytes, report.orders.size());
+    EXPECT_LE(kneser_ney_bytes, report.kneser_ney_bytes);
+  }
+}
+
+TEST(PBoxTest, FingerprintCat64Test) {
+  // Saved models and count shards keep the fingerprints, so they must not change.
+  EXPECT_EQ(0xf8f76353b6d877c5ULL, FingerprintCat64(1, 2));
+  EXPECT_EQ(0xe85028e6b31f8e7aULL, FingerprintCat64(2, 1));
+  EXPECT_EQ(0xe1466c2bbd8b4c06ULL, FingerprintCat64(0x123456789ULL, 42));
+}
+
+TEST(PBoxTest, SequenceHash64FeatureTest) {
+  SequenceHash64Feature f;
+  for (int value : {1, 2, 3}) {
+    f.PushBack(value);
+  }
+  EXPECT_EQ(3, f.size());
+  EXPECT_EQ(0x17e61310334913caULL, f.hash_);
+  SequenceHash64Feature g;
+  g.PushBack(-1);
+  EXPECT_EQ(0x408c4a56f3c4443dULL, g.hash_);
+
+  // All sequences of up to three values, including the ones with leading zeros that collide in
+  // SequenceHashFeature, get distinct fingerprints, none of them the empty or the deleted key.
+  std::vector<std::vector<int> > sequences(1);
+  for (int size = 1; size <= 3; ++size) {
+    const size_t num_shorter = sequences.size();
+    for (size_t i = 0; i < num_shorter; ++i) {
+      if (static_cast<int>(sequences[i].size()) != size - 1) continue;
+      for (int value = -2; value < 40; ++value) {
+        std::vector<int> sequence = sequences[i];
+        sequence.push_back(value);
+        sequences.push_back(sequence);
+      }
+    }
+  }
+  std::unordered_set<uint64> hashes;
+  for (const std::vector<int>& sequence : sequences) {
+    SequenceHash64Feature feature;
+    for (int value : sequence) {
+      feature.PushBack(value);
+    }
+    EXPECT_FALSE(feature == SequenceHash64Feature::EmptyFeature());
+    EXPECT_FALSE(feature == SequenceHash64Feature::DeletedFeature());
+    hashes.insert(feature.hash_);
+  }
+  EXPECT_EQ(sequences.size(), hashes.size());
+
+  SequenceHashFeature leading_zero, no_zero;
+  leading_zero.PushBack(0);
+  leading_zero.PushBack(5);
+  no_zero.PushBack(5);
+  EXPECT_TRUE(leading_zero == no_zero);
+}
+
 int main(int argc, char **argv) {
   google::InstallFailureSignalHandler();
   testing::InitGoogleTest(&argc, argv);
@@ -1945,11 +1945,18 @@ void ParseTreesInFileWithParallelJSONParse(
     int start_offset,
     int num_records,
     bool show_progress,
-    std::vector<TreeStorage>* trees) {
+    std::vector<TreeStorage>* trees,
+    int shard_id,
+    int num_shards) {
 
   static const int NUM_PARSING_THREADS = 8;
 
   std::unique_ptr<RecordInput> input(new FileRecordInput(filename));
+  if (num_shards > 1) {
+    CHECK(shard_id >= 0 && shard_id < num_shards) << "Invalid shard " << shard_id << " of " << num_shards;
+    // The held-out fold of the cross-validation split is the shard.
+    input.reset(new CrossValidationInput(input.release(), shard_id, num_shards, false));
+  }
   std::unique_ptr<InputRecordReader> reader(input->CreateReader());
   std::vector<std::thread> threads;
   int records = 0;
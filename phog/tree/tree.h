@@ -1179,12 +1179,16 @@ int TreeSize(ConstLocalTreeTraversal t);
 void CompareTrees(ConstLocalTreeTraversal t1, ConstLocalTreeTraversal t2, TreeCompareInfo* info, bool only_types = false, int max_depth = std::numeric_limits<int>::max());
 void CompareTrees(ConstLocalTreeTraversal t1, ConstLocalTreeTraversal t2, int* num_equalities, int* num_diffs);
 
+// With num_shards > 1, only the records (lines) of the file whose 1-based index modulo num_shards is
+// shard_id are parsed, so that num_shards processes can split the file between them.
 void ParseTreesInFileWithParallelJSONParse(
     StringSet* ss,
     const char* filename,
     int start_offset,
     int num_records,
     bool show_progress,
-    std::vector<TreeStorage>* trees);
+    std::vector<TreeStorage>* trees,
+    int shard_id = 0,
+    int num_shards = 1);
 
 #endif /* SYNTREE_TREE_H_ */